@@ -0,0 +1,163 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * Linux epoll(7) event module.  Unlike select.c there is no FD_SETSIZE
+ * ceiling on descriptors, and each pass over the loop only touches the
+ * events the kernel reported ready.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+
+static event_module_init_t epoll_init;
+static event_module_fini_t epoll_fini;
+static event_module_add_t epoll_add;
+static event_module_del_t epoll_del;
+static event_module_process_t epoll_process;
+
+static int ep = -1;
+static struct epoll_event *event_list;
+
+#define	MAXEVENTS	128
+
+struct event_module event_module = {
+	.add =		epoll_add,
+	.del =		epoll_del,
+	.process =	epoll_process,
+	.init =		epoll_init,
+	.fini =		epoll_fini,
+};
+
+static int
+epoll_init(void)
+{
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep == -1)
+		return (errno);
+
+	event_list = calloc(MAXEVENTS, sizeof(struct epoll_event));
+	if (event_list == NULL)
+		return (ENOMEM);
+
+	return (0);
+}
+
+static void
+epoll_fini(void)
+{
+
+	(void )close(ep);
+	ep = -1;
+
+	free(event_list);
+	event_list = NULL;
+}
+
+static int
+epoll_add(struct event *ev)
+{
+	struct epoll_event ee;
+	int error;
+
+	assert(ev->fd >= 0);
+
+	memset(&ee, 0, sizeof(ee));
+	switch (ev->rdwr) {
+	case EVENT_READ:
+		ee.events = EPOLLIN;
+		break;
+	case EVENT_WRITE:
+		ee.events = EPOLLOUT;
+		break;
+	}
+	ee.data.ptr = ev;
+
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, ev->fd, &ee) == -1) {
+		error = errno;
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(ADD, %d) failed: %s\n",
+		    ev->fd, strerror(error));
+		return (error);
+	}
+	ev->index = 0;
+
+	return (0);
+}
+
+static int
+epoll_del(struct event *ev, int flags)
+{
+	int error;
+
+	assert(ev->fd >= 0);
+
+	/*
+	 * Unlike kqueue, closing the descriptor does not drop the
+	 * registration while a forked child still holds a reference
+	 * to the same file, so always delete explicitly, even with
+	 * EV_FLAG_CLOSING.
+	 */
+	if (epoll_ctl(ep, EPOLL_CTL_DEL, ev->fd, NULL) == -1) {
+		error = errno;
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(DEL, %d) failed: %s\n",
+		    ev->fd, strerror(error));
+		return (error);
+	}
+	ev->index = -1;
+
+	return (0);
+}
+
+static int
+epoll_process(u_long msec)
+{
+	struct event *ev;
+	int events, i;
+
+	events = epoll_wait(ep, event_list, MAXEVENTS, (int) msec);
+
+	if (events == -1) {
+		if (errno == EINTR)
+			return (errno);
+		DPRINTF(E_FATAL, L_GENERAL, "epoll_wait(): %s. EXITING\n", strerror(errno));
+	}
+
+	for (i = 0; i < events; i++) {
+		ev = (struct event *)event_list[i].data.ptr;
+
+		/* Deleted by a previous handler in this batch. */
+		if (ev->index == -1)
+			continue;
+
+		/*
+		 * Errors and hangups are reported regardless of the
+		 * requested mask; let the handler find out via
+		 * read()/write() like it would with select().
+		 */
+		ev->process(ev);
+	}
+
+	return (0);
+}
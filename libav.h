@@ -15,6 +15,9 @@
  * You should have received a copy of the GNU General Public License
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <pthread.h>
+#include <stdlib.h>
+
 #if HAVE_FFMPEG_LIBAVUTIL_AVUTIL_H
 #include <ffmpeg/libavutil/avutil.h>
 #elif HAVE_LIBAV_LIBAVUTIL_AVUTIL_H
@@ -143,6 +146,55 @@ lav_close(AVFormatContext *ctx)
 #endif
 }
 
+/* Before 58.9.100, libavcodec only opens codecs (which probing a
+ * stream does) from several threads at once with a lock manager
+ * registered, and before 52.30 it cannot be done at all. */
+#if LIBAVCODEC_VERSION_INT < ((58<<16)+(9<<8)+100) && \
+    LIBAVCODEC_VERSION_INT >= ((52<<16)+(30<<8)+0)
+static inline int
+lav_lockmgr(void **mutex, enum AVLockOp op)
+{
+	switch (op)
+	{
+	case AV_LOCK_CREATE:
+		*mutex = malloc(sizeof(pthread_mutex_t));
+		if (!*mutex)
+			return 1;
+		if (pthread_mutex_init(*mutex, NULL) != 0)
+		{
+			free(*mutex);
+			*mutex = NULL;
+			return 1;
+		}
+		return 0;
+	case AV_LOCK_OBTAIN:
+		return pthread_mutex_lock(*mutex) != 0;
+	case AV_LOCK_RELEASE:
+		return pthread_mutex_unlock(*mutex) != 0;
+	case AV_LOCK_DESTROY:
+		pthread_mutex_destroy(*mutex);
+		free(*mutex);
+		*mutex = NULL;
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+/* Make libav safe to call from more than one thread; call it once,
+ * before starting them.  Returns -1 if that is not possible. */
+static inline int
+lav_thread_init(void)
+{
+#if LIBAVCODEC_VERSION_INT >= ((58<<16)+(9<<8)+100)
+	return 0;
+#elif LIBAVCODEC_VERSION_INT >= ((52<<16)+(30<<8)+0)
+	return av_lockmgr_register(lav_lockmgr) == 0 ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
 static inline int
 lav_get_fps(AVStream *s)
 {
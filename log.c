@@ -162,12 +162,12 @@ log_err(int level, enum _log_facility facility, char *fname, int lineno, char *f
 	if (!GETFLAG(SYSTEMD_MASK))
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		t = time(NULL);
-		tm = localtime(&t);
+		localtime_r(&t, &tm);
 		fprintf(log_fp, "[%04d/%02d/%02d %02d:%02d:%02d] ",
-		        tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-		        tm->tm_hour, tm->tm_min, tm->tm_sec);
+		        tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		        tm.tm_hour, tm.tm_min, tm.tm_sec);
 	}
 
 	if (level)
@@ -130,8 +130,20 @@ check_for_captions(const char *path, int64_t detailID)
 	/* If we weren't given a detail ID, look for one. */
 	if (!detailID)
 	{
-		detailID = sql_get_int64_field(db, "SELECT ID from DETAILS where (PATH > '%q.' and PATH <= '%q.z')"
-						   " and MIME glob 'video/*' limit 1", file, file);
+		sqlite3_stmt *stmt;
+		char lo[MAXPATHLEN+2], hi[MAXPATHLEN+3];
+
+		stmt = sql_prepare(db, "SELECT ID from DETAILS where (PATH > ? and PATH <= ?)"
+				       " and MIME glob 'video/*' limit 1");
+		if (!stmt)
+			return;
+		snprintf(lo, sizeof(lo), "%s.", file);
+		snprintf(hi, sizeof(hi), "%s.z", file);
+		sqlite3_bind_text(stmt, 1, lo, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, hi, -1, SQLITE_STATIC);
+		if (sql_step(stmt) == SQLITE_ROW)
+			detailID = sqlite3_column_int64(stmt, 0);
+		sql_finish(stmt);
 		if (detailID <= 0)
 		{
 			//DPRINTF(E_MAXDEBUG, L_METADATA, "No file found for caption %s.\n", path);
@@ -276,17 +288,178 @@ free_metadata(metadata_t *m, uint32_t flags)
 		free(m->resolution);
 }
 
+/* Copy the strings that are not ours (flags), so that m outlives the
+ * tags it was read from */
+static void
+own_metadata(metadata_t *m, uint32_t flags)
+{
+	if( m->title && !(flags & FLAG_TITLE) )
+		m->title = strdup(m->title);
+	if( m->artist && !(flags & FLAG_ARTIST) )
+		m->artist = strdup(m->artist);
+	if( m->album && !(flags & FLAG_ALBUM) )
+		m->album = strdup(m->album);
+	if( m->genre && !(flags & FLAG_GENRE) )
+		m->genre = strdup(m->genre);
+	if( m->creator && !(flags & FLAG_CREATOR) )
+		m->creator = strdup(m->creator);
+	if( m->date && !(flags & FLAG_DATE) )
+		m->date = strdup(m->date);
+	if( m->comment && !(flags & FLAG_COMMENT) )
+		m->comment = strdup(m->comment);
+	if( m->dlna_pn && !(flags & FLAG_DLNA_PN) )
+		m->dlna_pn = strdup(m->dlna_pn);
+	if( m->mime && !(flags & FLAG_MIME) )
+		m->mime = strdup(m->mime);
+	if( m->duration && !(flags & FLAG_DURATION) )
+		m->duration = strdup(m->duration);
+	if( m->resolution && !(flags & FLAG_RESOLUTION) )
+		m->resolution = strdup(m->resolution);
+}
+
+void
+clear_metadata(metadata_t *m)
+{
+	free_metadata(m, 0xFFFFFFFF);
+	free(m->thumb_data);
+	memset(m, '\0', sizeof(*m));
+}
+
 int64_t
-GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art)
+InsertMetadata(const char *path, metadata_t *m)
 {
+	sqlite3_stmt *stmt = NULL;
+	int64_t album_art = 0, detailID;
 	int ret;
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (TITLE, PATH, CREATOR, ARTIST, GENRE, ALBUM_ART) "
-	                   "VALUES"
-	                   " ('%q', %Q, %Q, %Q, %Q, %lld);",
-	                   name, path, artist, artist, genre, album_art);
+	if( m->type != TYPE_IMAGE )
+		album_art = find_album_art(path, m->thumb_data, m->thumb_size);
+	switch( m->type )
+	{
+	case TYPE_AUDIO:
+		stmt = sql_prepare(db, "INSERT into DETAILS"
+		                       " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
+		                       "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
+		                       "VALUES"
+		                       " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+		if( !stmt )
+			break;
+		sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, m->size);
+		sqlite3_bind_int64(stmt, 3, m->timestamp);
+		sqlite3_bind_text(stmt, 4, THISORNUL(m->duration), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 5, m->channels);
+		sqlite3_bind_int64(stmt, 6, m->bitrate);
+		sqlite3_bind_int64(stmt, 7, m->frequency);
+		sqlite3_bind_text(stmt, 8, m->date, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 9, m->title, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 10, m->creator, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 11, m->artist, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 12, m->album, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 13, m->genre, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 14, m->comment, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 15, m->disc);
+		sqlite3_bind_int64(stmt, 16, m->track);
+		sqlite3_bind_text(stmt, 17, m->dlna_pn, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 18, THISORNUL(m->mime), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 19, album_art);
+		break;
+	case TYPE_IMAGE:
+		stmt = sql_prepare(db, "INSERT into DETAILS"
+		                       " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
+		                       " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
+		                       "VALUES"
+		                       " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+		if( !stmt )
+			break;
+		sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, THISORNUL(m->title), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 3, m->size);
+		sqlite3_bind_int64(stmt, 4, m->timestamp);
+		sqlite3_bind_text(stmt, 5, m->date, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 6, m->resolution, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 7, m->rotation);
+		sqlite3_bind_int(stmt, 8, m->thumbnail);
+		sqlite3_bind_text(stmt, 9, m->creator, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 10, m->dlna_pn, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 11, m->mime, -1, SQLITE_STATIC);
+		break;
+	case TYPE_VIDEO:
+		stmt = sql_prepare(db, "INSERT into DETAILS"
+		                       " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
+		                       "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART, DISC, TRACK) "
+		                       "VALUES"
+		                       " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+		if( !stmt )
+			break;
+		sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, m->size);
+		sqlite3_bind_int64(stmt, 3, m->timestamp);
+		sqlite3_bind_text(stmt, 4, m->duration, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 5, m->date, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 6, m->channels);
+		sqlite3_bind_int64(stmt, 7, m->bitrate);
+		sqlite3_bind_int64(stmt, 8, m->frequency);
+		sqlite3_bind_text(stmt, 9, m->resolution, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 10, THISORNUL(m->title), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 11, m->creator, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 12, m->artist, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 13, m->genre, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 14, m->comment, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 15, m->dlna_pn, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 16, THISORNUL(m->mime), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 17, album_art);
+		sqlite3_bind_int64(stmt, 18, m->disc);
+		sqlite3_bind_int64(stmt, 19, m->track);
+		break;
+	}
+	ret = sql_exec_stmt(stmt);
 	if( ret != SQLITE_OK )
+	{
+		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
+		return 0;
+	}
+	detailID = sqlite3_last_insert_rowid(db);
+	if( m->type == TYPE_VIDEO )
+		check_for_captions(path, detailID);
+
+	return detailID;
+}
+
+static int64_t
+get_metadata(int (*read_metadata)(const char *, const char *, metadata_t *),
+             const char *path, const char *name)
+{
+	metadata_t m;
+	int64_t ret;
+
+	if( read_metadata(path, name, &m) != 0 )
+		return 0;
+	ret = InsertMetadata(path, &m);
+	clear_metadata(&m);
+
+	return ret;
+}
+
+int64_t
+GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art)
+{
+	sqlite3_stmt *stmt;
+	int64_t ret;
+
+	stmt = sql_prepare(db, "INSERT into DETAILS"
+	                       " (TITLE, PATH, CREATOR, ARTIST, GENRE, ALBUM_ART) "
+	                       "VALUES"
+	                       " (?, ?, ?, ?3, ?, ?)");
+	if( stmt )
+	{
+		sqlite3_bind_text(stmt, 1, THISORNUL(name), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, artist, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, genre, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 5, album_art);
+	}
+	if( sql_exec_stmt(stmt) != SQLITE_OK )
 		ret = 0;
 	else
 		ret = sqlite3_last_insert_rowid(db);
@@ -294,79 +467,76 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 	return ret;
 }
 
-int64_t
-GetAudioMetadata(const char *path, const char *name)
+int
+ReadAudioMetadata(const char *path, const char *name, metadata_t *m)
 {
 	char type[4];
-	static char lang[6] = { '\0' };
+	static __thread char lang[6] = { '\0' };
 	struct stat file;
-	int64_t ret;
 	char *esc_tag;
 	int i;
-	int64_t album_art = 0;
 	struct song_metadata song;
-	metadata_t m;
 	uint32_t free_flags = FLAG_MIME|FLAG_DURATION|FLAG_DLNA_PN|FLAG_DATE;
-	memset(&m, '\0', sizeof(metadata_t));
+	memset(m, '\0', sizeof(*m));
 
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 
 	if( ends_with(path, ".mp3") )
 	{
 		strcpy(type, "mp3");
-		m.mime = strdup("audio/mpeg");
+		m->mime = strdup("audio/mpeg");
 	}
 	else if( ends_with(path, ".m4a") || ends_with(path, ".mp4") ||
 	         ends_with(path, ".aac") || ends_with(path, ".m4p") )
 	{
 		strcpy(type, "aac");
-		m.mime = strdup("audio/mp4");
+		m->mime = strdup("audio/mp4");
 	}
 	else if( ends_with(path, ".3gp") )
 	{
 		strcpy(type, "aac");
-		m.mime = strdup("audio/3gpp");
+		m->mime = strdup("audio/3gpp");
 	}
 	else if( ends_with(path, ".wma") || ends_with(path, ".asf") )
 	{
 		strcpy(type, "asf");
-		m.mime = strdup("audio/x-ms-wma");
+		m->mime = strdup("audio/x-ms-wma");
 	}
 	else if( ends_with(path, ".flac") || ends_with(path, ".fla") || ends_with(path, ".flc") )
 	{
 		strcpy(type, "flc");
-		m.mime = strdup("audio/x-flac");
+		m->mime = strdup("audio/x-flac");
 	}
 	else if( ends_with(path, ".wav") )
 	{
 		strcpy(type, "wav");
-		m.mime = strdup("audio/x-wav");
+		m->mime = strdup("audio/x-wav");
 	}
 	else if( ends_with(path, ".ogg") || ends_with(path, ".oga") )
 	{
 		strcpy(type, "ogg");
-		m.mime = strdup("audio/ogg");
+		m->mime = strdup("audio/ogg");
 	}
 	else if( ends_with(path, ".pcm") )
 	{
 		strcpy(type, "pcm");
-		m.mime = strdup("audio/L16");
+		m->mime = strdup("audio/L16");
 	}
 	else if( ends_with(path, ".dsf") )
 	{
 		strcpy(type, "dsf");
-		m.mime = strdup("audio/x-dsd");
+		m->mime = strdup("audio/x-dsd");
 	}
 	else if( ends_with(path, ".dff") )
 	{
 		strcpy(type, "dff");
-		m.mime = strdup("audio/x-dsd");
+		m->mime = strdup("audio/x-dsd");
 	}
 	else
 	{
 		DPRINTF(E_WARN, L_METADATA, "Unhandled file extension on %s\n", path);
-		return 0;
+		return -1;
 	}
 
 	if( !(*lang) )
@@ -381,46 +551,47 @@ GetAudioMetadata(const char *path, const char *name)
 	{
 		DPRINTF(E_WARN, L_METADATA, "Cannot extract tags from %s!\n", path);
 		freetags(&song);
-		free_metadata(&m, free_flags);
-		return 0;
+		free_metadata(m, free_flags);
+		memset(m, '\0', sizeof(*m));
+		return -1;
 	}
 
 	if( song.dlna_pn )
-		m.dlna_pn = strdup(song.dlna_pn);
+		m->dlna_pn = strdup(song.dlna_pn);
 	if( song.year )
-		xasprintf(&m.date, "%04d-01-01", song.year);
-	m.duration = duration_str(song.song_length);
+		xasprintf(&m->date, "%04d-01-01", song.year);
+	m->duration = duration_str(song.song_length);
 	if( song.title && *song.title )
 	{
-		m.title = trim(song.title);
-		if( (esc_tag = escape_tag(m.title, 0)) )
+		m->title = trim(song.title);
+		if( (esc_tag = escape_tag(m->title, 0)) )
 		{
 			free_flags |= FLAG_TITLE;
-			m.title = esc_tag;
+			m->title = esc_tag;
 		}
 	}
 	else
 	{
 		free_flags |= FLAG_TITLE;
-		m.title = strdup(name);
-		strip_ext(m.title);
+		m->title = strdup(name);
+		strip_ext(m->title);
 	}
 	for( i = ROLE_START; i < N_ROLE; i++ )
 	{
 		if( song.contributor[i] && *song.contributor[i] )
 		{
-			m.creator = trim(song.contributor[i]);
-			if( strlen(m.creator) > 48 )
+			m->creator = trim(song.contributor[i]);
+			if( strlen(m->creator) > 48 )
 			{
-				m.creator = strdup("Various Artists");
+				m->creator = strdup("Various Artists");
 				free_flags |= FLAG_CREATOR;
 			}
-			else if( (esc_tag = escape_tag(m.creator, 0)) )
+			else if( (esc_tag = escape_tag(m->creator, 0)) )
 			{
-				m.creator = esc_tag;
+				m->creator = esc_tag;
 				free_flags |= FLAG_CREATOR;
 			}
-			m.artist = m.creator;
+			m->artist = m->creator;
 			break;
 		}
 	}
@@ -435,74 +606,78 @@ GetAudioMetadata(const char *path, const char *name)
 		}
 		if( i <= ROLE_BAND )
 		{
-			m.artist = trim(song.contributor[i]);
-			if( strlen(m.artist) > 48 )
+			m->artist = trim(song.contributor[i]);
+			if( strlen(m->artist) > 48 )
 			{
-				m.artist = strdup("Various Artists");
+				m->artist = strdup("Various Artists");
 				free_flags |= FLAG_ARTIST;
 			}
-			else if( (esc_tag = escape_tag(m.artist, 0)) )
+			else if( (esc_tag = escape_tag(m->artist, 0)) )
 			{
-				m.artist = esc_tag;
+				m->artist = esc_tag;
 				free_flags |= FLAG_ARTIST;
 			}
 		}
 	}
 	if( song.album && *song.album )
 	{
-		m.album = trim(song.album);
-		if( (esc_tag = escape_tag(m.album, 0)) )
+		m->album = trim(song.album);
+		if( (esc_tag = escape_tag(m->album, 0)) )
 		{
 			free_flags |= FLAG_ALBUM;
-			m.album = esc_tag;
+			m->album = esc_tag;
 		}
 	}
 	if( song.genre && *song.genre )
 	{
-		m.genre = trim(song.genre);
-		if( (esc_tag = escape_tag(m.genre, 0)) )
+		m->genre = trim(song.genre);
+		if( (esc_tag = escape_tag(m->genre, 0)) )
 		{
 			free_flags |= FLAG_GENRE;
-			m.genre = esc_tag;
+			m->genre = esc_tag;
 		}
 	}
 	if( song.comment && *song.comment )
 	{
-		m.comment = trim(song.comment);
-		if( (esc_tag = escape_tag(m.comment, 0)) )
+		m->comment = trim(song.comment);
+		if( (esc_tag = escape_tag(m->comment, 0)) )
 		{
 			free_flags |= FLAG_COMMENT;
-			m.comment = esc_tag;
+			m->comment = esc_tag;
 		}
 	}
 
-	album_art = find_album_art(path, song.image, song.image_size);
-
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
-	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration, song.channels, song.bitrate,
-	                   song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
-	                   song.track, m.dlna_pn, song.mime?song.mime:m.mime, album_art);
-	if( ret != SQLITE_OK )
+	m->type = TYPE_AUDIO;
+	m->size = file.st_size;
+	m->timestamp = file.st_mtime;
+	m->channels = song.channels;
+	m->bitrate = song.bitrate;
+	m->frequency = song.samplerate;
+	m->disc = song.disc;
+	m->track = song.track;
+	if( song.mime )
 	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
+		free(m->mime);
+		m->mime = strdup(song.mime);
 	}
-	else
+	if( song.image_size )
 	{
-		ret = sqlite3_last_insert_rowid(db);
+		m->thumb_data = malloc(song.image_size);
+		if( m->thumb_data )
+		{
+			memcpy(m->thumb_data, song.image, song.image_size);
+			m->thumb_size = song.image_size;
+		}
 	}
+	/* What still points into song has to outlive it */
+	own_metadata(m, free_flags);
 	freetags(&song);
-	free_metadata(&m, free_flags);
 
-	return ret;
+	return 0;
 }
 
 /* For libjpeg error handling */
-jmp_buf setjmp_buffer;
+static __thread jmp_buf setjmp_buffer;
 static void
 libjpeg_error_handler(j_common_ptr cinfo)
 {
@@ -511,8 +686,8 @@ libjpeg_error_handler(j_common_ptr cinfo)
 	return;
 }
 
-int64_t
-GetImageMetadata(const char *path, const char *name)
+int
+ReadImageMetadata(const char *path, const char *name, metadata_t *m)
 {
 	ExifData *ed;
 	ExifEntry *e = NULL;
@@ -524,19 +699,17 @@ GetImageMetadata(const char *path, const char *name)
 	char make[32], model[64] = {'\0'};
 	char b[1024];
 	struct stat file;
-	int64_t ret;
 	image_s *imsrc;
-	metadata_t m;
 	uint32_t free_flags = 0xFFFFFFFF;
-	memset(&m, '\0', sizeof(metadata_t));
+	memset(m, '\0', sizeof(*m));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing %s...\n", path);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
 	/* MIME hard-coded to JPEG for now, until we add PNG support */
-	m.mime = strdup("image/jpeg");
+	m->mime = strdup("image/jpeg");
 
 	l = exif_loader_new();
 	exif_loader_write_file(l, path);
@@ -548,23 +721,23 @@ GetImageMetadata(const char *path, const char *name)
 	e = exif_content_get_entry (ed->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_ORIGINAL);
 	if( e || (e = exif_content_get_entry(ed->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_DIGITIZED)) )
 	{
-		m.date = strdup(exif_entry_get_value(e, b, sizeof(b)));
-		if( strlen(m.date) > 10 )
+		m->date = strdup(exif_entry_get_value(e, b, sizeof(b)));
+		if( strlen(m->date) > 10 )
 		{
-			m.date[4] = '-';
-			m.date[7] = '-';
-			m.date[10] = 'T';
+			m->date[4] = '-';
+			m->date[7] = '-';
+			m->date[10] = 'T';
 		}
 		else {
-			free(m.date);
-			m.date = NULL;
+			free(m->date);
+			m->date = NULL;
 		}
 	}
 	else {
 		/* One last effort to get the date from XMP */
-		image_get_jpeg_date_xmp(path, &m.date);
+		image_get_jpeg_date_xmp(path, &m->date);
 	}
-	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * date: %s\n", m.date);
+	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * date: %s\n", m->date);
 
 	e = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_MAKE);
 	if( e )
@@ -576,7 +749,7 @@ GetImageMetadata(const char *path, const char *name)
 			strncpyt(model, exif_entry_get_value(e, b, sizeof(b)), sizeof(model));
 			if( !strcasestr(model, make) )
 				snprintf(model, sizeof(model), "%s %s", make, exif_entry_get_value(e, b, sizeof(b)));
-			m.creator = escape_tag(trim(model), 1);
+			m->creator = escape_tag(trim(model), 1);
 		}
 	}
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * model: %s\n", model);
@@ -587,16 +760,16 @@ GetImageMetadata(const char *path, const char *name)
 		switch( exif_get_short(e->data, exif_data_get_byte_order(ed)) )
 		{
 		case 3:
-			m.rotation = 180;
+			m->rotation = 180;
 			break;
 		case 6:
-			m.rotation = 90;
+			m->rotation = 90;
 			break;
 		case 8:
-			m.rotation = 270;
+			m->rotation = 270;
 			break;
 		default:
-			m.rotation = 0;
+			m->rotation = 0;
 			break;
 		}
 	}
@@ -647,64 +820,49 @@ no_exifdata:
 
 	if( !width || !height )
 	{
-		free_metadata(&m, free_flags);
-		return 0;
+		free_metadata(m, free_flags);
+		memset(m, '\0', sizeof(*m));
+		return -1;
 	}
 	if( width <= 640 && height <= 480 )
-		m.dlna_pn = strdup("JPEG_SM");
+		m->dlna_pn = strdup("JPEG_SM");
 	else if( width <= 1024 && height <= 768 )
-		m.dlna_pn = strdup("JPEG_MED");
+		m->dlna_pn = strdup("JPEG_MED");
 	else if( (width <= 4096 && height <= 4096) || !GETFLAG(DLNA_STRICT_MASK) )
-		m.dlna_pn = strdup("JPEG_LRG");
-	xasprintf(&m.resolution, "%dx%d", width, height);
-	m.title = strdup(name);
-	strip_ext(m.title);
-
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
-	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
-	                   "VALUES"
-	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
-	                   path, m.title, (long long)file.st_size, (long long)file.st_mtime, m.date,
-	                   m.resolution, m.rotation, thumb, m.creator, m.dlna_pn, m.mime);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
-	{
-		ret = sqlite3_last_insert_rowid(db);
-	}
-	free_metadata(&m, free_flags);
+		m->dlna_pn = strdup("JPEG_LRG");
+	xasprintf(&m->resolution, "%dx%d", width, height);
+	m->title = strdup(name);
+	strip_ext(m->title);
+	m->type = TYPE_IMAGE;
+	m->size = file.st_size;
+	m->timestamp = file.st_mtime;
+	m->thumbnail = thumb;
 
-	return ret;
+	return 0;
 }
 
-int64_t
-GetVideoMetadata(const char *path, const char *name)
+int
+ReadVideoMetadata(const char *path, const char *name, metadata_t *m)
 {
 	struct stat file;
 	int ret, i;
-	struct tm *modtime;
+	struct tm modtime;
 	AVFormatContext *ctx = NULL;
 	AVStream *astream = NULL, *vstream = NULL;
 	int audio_stream = -1, video_stream = -1;
 	enum audio_profiles audio_profile = PROFILE_AUDIO_UNKNOWN;
 	char fourcc[4];
-	int64_t album_art = 0;
 	char nfo[MAXPATHLEN], *ext;
 	struct song_metadata video;
-	metadata_t m;
 	uint32_t free_flags = 0xFFFFFFFF;
 	char *path_cpy, *basepath;
 
-	memset(&m, '\0', sizeof(m));
+	memset(m, '\0', sizeof(*m));
 	memset(&video, '\0', sizeof(video));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing video %s...\n", name);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
 	ret = lav_open(&ctx, path);
@@ -713,7 +871,7 @@ GetVideoMetadata(const char *path, const char *name)
 		char err[128];
 		av_strerror(ret, err, sizeof(err));
 		DPRINTF(E_WARN, L_METADATA, "Opening %s failed! [%s]\n", path, err);
-		return 0;
+		return -1;
 	}
 	//dump_format(ctx, 0, NULL, 0);
 	for( i=0; i < ctx->nb_streams; i++)
@@ -726,7 +884,7 @@ GetVideoMetadata(const char *path, const char *name)
 			continue;
 		}
 		else if( lav_codec_type(ctx->streams[i]) == AVMEDIA_TYPE_VIDEO &&
-		         !lav_is_thumbnail_stream(ctx->streams[i], &m.thumb_data, &m.thumb_size) &&
+		         !lav_is_thumbnail_stream(ctx->streams[i], &m->thumb_data, &m->thumb_size) &&
 		         video_stream == -1 )
 		{
 			video_stream = i;
@@ -743,7 +901,8 @@ GetVideoMetadata(const char *path, const char *name)
 		if( !is_audio(path) )
 			DPRINTF(E_WARN, L_METADATA, "File %s does not contain a video stream.\n", basepath);
 		free(path_cpy);
-		return 0;
+		m->thumb_data = NULL;
+		return -1;
 	}
 
 	if( astream )
@@ -824,25 +983,25 @@ GetVideoMetadata(const char *path, const char *name)
 					DPRINTF(E_DEBUG, L_METADATA, "Unhandled audio codec [0x%X]\n", lav_codec_id(astream));
 				break;
 		}
-		m.frequency = lav_sample_rate(astream);
-		m.channels = lav_channels(astream);
+		m->frequency = lav_sample_rate(astream);
+		m->channels = lav_channels(astream);
 	}
 	if( vstream )
 	{
 		int off;
 		ts_timestamp_t ts_timestamp = NONE;
 		DPRINTF(E_DEBUG, L_METADATA, "Container: '%s' [%s]\n", ctx->iformat->name, basepath);
-		xasprintf(&m.resolution, "%dx%d", lav_width(vstream), lav_height(vstream));
+		xasprintf(&m->resolution, "%dx%d", lav_width(vstream), lav_height(vstream));
 		if( ctx->bit_rate > 8 )
-			m.bitrate = ctx->bit_rate / 8;
+			m->bitrate = ctx->bit_rate / 8;
 		if( ctx->duration > 0 )
-			m.duration = duration_str(ctx->duration / (AV_TIME_BASE/1000));
+			m->duration = duration_str(ctx->duration / (AV_TIME_BASE/1000));
 
 		/* NOTE: The DLNA spec only provides for ASF (WMV), TS, PS, and MP4 containers.
 		 * Skip DLNA parsing for everything else. */
 		if( strcmp(ctx->iformat->name, "avi") == 0 )
 		{
-			xasprintf(&m.mime, "video/x-msvideo");
+			xasprintf(&m->mime, "video/x-msvideo");
 			if( lav_codec_id(vstream) == AV_CODEC_ID_MPEG4 )
 			{
 				fourcc[0] = lav_codec_tag(vstream)     & 0xff;
@@ -852,17 +1011,17 @@ GetVideoMetadata(const char *path, const char *name)
 				if( memcmp(fourcc, "XVID", 4) == 0 ||
 				    memcmp(fourcc, "DX50", 4) == 0 ||
 				    memcmp(fourcc, "DIVX", 4) == 0 )
-					xasprintf(&m.creator, "DiVX");
+					xasprintf(&m->creator, "DiVX");
 			}
 		}
 		else if( strcmp(ctx->iformat->name, "mov,mp4,m4a,3gp,3g2,mj2") == 0 &&
 		         ends_with(path, ".mov") )
-			xasprintf(&m.mime, "video/quicktime");
+			xasprintf(&m->mime, "video/quicktime");
 		else if( strncmp(ctx->iformat->name, "matroska", 8) == 0 )
-			xasprintf(&m.mime, "video/x-matroska");
+			xasprintf(&m->mime, "video/x-matroska");
 		else if( strcmp(ctx->iformat->name, "flv") == 0 )
-			xasprintf(&m.mime, "video/x-flv");
-		if( m.mime )
+			xasprintf(&m->mime, "video/x-flv");
+		if( m->mime )
 			goto video_no_dlna;
 
 		switch( lav_codec_id(vstream) )
@@ -873,34 +1032,34 @@ GetVideoMetadata(const char *path, const char *name)
 					if( (lav_width(vstream)  == 352) &&
 					    (lav_height(vstream) <= 288) )
 					{
-						m.dlna_pn = strdup("MPEG1");
+						m->dlna_pn = strdup("MPEG1");
 					}
-					xasprintf(&m.mime, "video/mpeg");
+					xasprintf(&m->mime, "video/mpeg");
 				}
 				break;
 			case AV_CODEC_ID_MPEG2VIDEO:
-				m.dlna_pn = malloc(64);
-				off = sprintf(m.dlna_pn, "MPEG_");
+				m->dlna_pn = malloc(64);
+				off = sprintf(m->dlna_pn, "MPEG_");
 				if( strcmp(ctx->iformat->name, "mpegts") == 0 )
 				{
 					int raw_packet_size;
 					int dlna_ts_present = dlna_timestamp_is_present(path, &raw_packet_size);
 					DPRINTF(E_DEBUG, L_METADATA, "Stream %d of %s is %s MPEG2 TS packet size %d\n",
-						video_stream, basepath, m.resolution, raw_packet_size);
-					off += sprintf(m.dlna_pn+off, "TS_");
+						video_stream, basepath, m->resolution, raw_packet_size);
+					off += sprintf(m->dlna_pn+off, "TS_");
 					if( (lav_width(vstream)  >= 1280) &&
 					    (lav_height(vstream) >= 720) )
 					{
-						off += sprintf(m.dlna_pn+off, "HD_NA");
+						off += sprintf(m->dlna_pn+off, "HD_NA");
 					}
 					else
 					{
-						off += sprintf(m.dlna_pn+off, "SD_");
+						off += sprintf(m->dlna_pn+off, "SD_");
 						if( (lav_height(vstream) == 576) ||
 						    (lav_height(vstream) == 288) )
-							off += sprintf(m.dlna_pn+off, "EU");
+							off += sprintf(m->dlna_pn+off, "EU");
 						else
-							off += sprintf(m.dlna_pn+off, "NA");
+							off += sprintf(m->dlna_pn+off, "NA");
 					}
 					if( raw_packet_size == MPEG_TS_PACKET_LENGTH_DLNA )
 					{
@@ -913,20 +1072,20 @@ GetVideoMetadata(const char *path, const char *name)
 					{
 						DPRINTF(E_WARN, L_METADATA, "Unsupported DLNA TS packet size [%d] (%s)\n",
 							raw_packet_size, basepath);
-						free(m.dlna_pn);
-						m.dlna_pn = NULL;
+						free(m->dlna_pn);
+						m->dlna_pn = NULL;
 					}
 					switch( ts_timestamp )
 					{
 						case NONE:
-							xasprintf(&m.mime, "video/mpeg");
-							if( m.dlna_pn )
-								off += sprintf(m.dlna_pn+off, "_ISO");
+							xasprintf(&m->mime, "video/mpeg");
+							if( m->dlna_pn )
+								off += sprintf(m->dlna_pn+off, "_ISO");
 							break;
 						case VALID:
-							off += sprintf(m.dlna_pn+off, "_T");
+							off += sprintf(m->dlna_pn+off, "_T");
 						case EMPTY:
-							xasprintf(&m.mime, "video/vnd.dlna.mpeg-tts");
+							xasprintf(&m->mime, "video/vnd.dlna.mpeg-tts");
 						default:
 							break;
 					}
@@ -934,26 +1093,26 @@ GetVideoMetadata(const char *path, const char *name)
 				else if( strcmp(ctx->iformat->name, "mpeg") == 0 )
 				{
 					DPRINTF(E_DEBUG, L_METADATA, "Stream %d of %s is %s MPEG2 PS\n",
-						video_stream, basepath, m.resolution);
-					off += sprintf(m.dlna_pn+off, "PS_");
+						video_stream, basepath, m->resolution);
+					off += sprintf(m->dlna_pn+off, "PS_");
 					if( (lav_height(vstream) == 576) ||
 					    (lav_height(vstream) == 288) )
-						off += sprintf(m.dlna_pn+off, "PAL");
+						off += sprintf(m->dlna_pn+off, "PAL");
 					else
-						off += sprintf(m.dlna_pn+off, "NTSC");
-					xasprintf(&m.mime, "video/mpeg");
+						off += sprintf(m->dlna_pn+off, "NTSC");
+					xasprintf(&m->mime, "video/mpeg");
 				}
 				else
 				{
 					DPRINTF(E_WARN, L_METADATA, "Stream %d of %s [%s] is %s non-DLNA MPEG2\n",
-						video_stream, basepath, ctx->iformat->name, m.resolution);
-					free(m.dlna_pn);
-					m.dlna_pn = NULL;
+						video_stream, basepath, ctx->iformat->name, m->resolution);
+					free(m->dlna_pn);
+					m->dlna_pn = NULL;
 				}
 				break;
 			case AV_CODEC_ID_H264:
-				m.dlna_pn = malloc(128);
-				off = sprintf(m.dlna_pn, "AVC_");
+				m->dlna_pn = malloc(128);
+				off = sprintf(m->dlna_pn, "AVC_");
 
 				if( strcmp(ctx->iformat->name, "mpegts") == 0 )
 				{
@@ -962,7 +1121,7 @@ GetVideoMetadata(const char *path, const char *name)
 					int raw_packet_size;
 					int dlna_ts_present = dlna_timestamp_is_present(path, &raw_packet_size);
 
-					off += sprintf(m.dlna_pn+off, "TS_");
+					off += sprintf(m->dlna_pn+off, "TS_");
 					if (lav_sample_aspect_ratio(vstream).num) {
 						av_reduce(&display_aspect_ratio.num, &display_aspect_ratio.den,
 						          lav_width(vstream) * lav_sample_aspect_ratio(vstream).num,
@@ -978,7 +1137,7 @@ GetVideoMetadata(const char *path, const char *name)
 						if( (lav_profile(vstream) == FF_PROFILE_H264_MAIN || lav_profile(vstream) == FF_PROFILE_H264_HIGH) &&
 						    audio_profile == PROFILE_AUDIO_AC3 )
 						{
-							off += sprintf(m.dlna_pn+off, "HD_60_");
+							off += sprintf(m->dlna_pn+off, "HD_60_");
 							lav_profile(vstream) = FF_PROFILE_SKIP;
 						}
 					}
@@ -991,7 +1150,7 @@ GetVideoMetadata(const char *path, const char *name)
 						if( (lav_profile(vstream) == FF_PROFILE_H264_MAIN || lav_profile(vstream) == FF_PROFILE_H264_HIGH) &&
 						    audio_profile == PROFILE_AUDIO_AC3 )
 						{
-							off += sprintf(m.dlna_pn+off, "HD_50_");
+							off += sprintf(m->dlna_pn+off, "HD_50_");
 							lav_profile(vstream) = FF_PROFILE_SKIP;
 						}
 					}
@@ -999,19 +1158,19 @@ GetVideoMetadata(const char *path, const char *name)
 					{
 						case FF_PROFILE_H264_BASELINE:
 						case FF_PROFILE_H264_CONSTRAINED_BASELINE:
-							off += sprintf(m.dlna_pn+off, "BL_");
+							off += sprintf(m->dlna_pn+off, "BL_");
 							if( lav_width(vstream)  <= 352 &&
 							    lav_height(vstream) <= 288 &&
 							    lav_bit_rate(vstream) <= 384000 )
 							{
-								off += sprintf(m.dlna_pn+off, "CIF15_");
+								off += sprintf(m->dlna_pn+off, "CIF15_");
 								break;
 							}
 							else if( lav_width(vstream)  <= 352 &&
 							         lav_height(vstream) <= 288 &&
 							         lav_bit_rate(vstream) <= 3000000 )
 							{
-								off += sprintf(m.dlna_pn+off, "CIF30_");
+								off += sprintf(m->dlna_pn+off, "CIF30_");
 								break;
 							}
 							/* Fall back to Main Profile if it doesn't match a Baseline DLNA profile. */
@@ -1019,7 +1178,7 @@ GetVideoMetadata(const char *path, const char *name)
 								off -= 3;
 						default:
 						case FF_PROFILE_H264_MAIN:
-							off += sprintf(m.dlna_pn+off, "MP_");
+							off += sprintf(m->dlna_pn+off, "MP_");
 							if( lav_profile(vstream) != FF_PROFILE_H264_BASELINE &&
 							    lav_profile(vstream) != FF_PROFILE_H264_CONSTRAINED_BASELINE &&
 							    lav_profile(vstream) != FF_PROFILE_H264_MAIN )
@@ -1031,65 +1190,65 @@ GetVideoMetadata(const char *path, const char *name)
 							    lav_height(vstream) <= 576 &&
 							    lav_bit_rate(vstream) <= 10000000 )
 							{
-								off += sprintf(m.dlna_pn+off, "SD_");
+								off += sprintf(m->dlna_pn+off, "SD_");
 							}
 							else if( lav_width(vstream)  <= 1920 &&
 							         lav_height(vstream) <= 1152 &&
 							         lav_bit_rate(vstream) <= 20000000 )
 							{
-								off += sprintf(m.dlna_pn+off, "HD_");
+								off += sprintf(m->dlna_pn+off, "HD_");
 							}
 							else
 							{
 								DPRINTF(E_DEBUG, L_METADATA, "Unsupported h.264 video profile! [%s, %dx%d, %lldbps : %s]\n",
-									m.dlna_pn, lav_width(vstream), lav_height(vstream),
+									m->dlna_pn, lav_width(vstream), lav_height(vstream),
 									(long long)lav_bit_rate(vstream), basepath);
-								free(m.dlna_pn);
-								m.dlna_pn = NULL;
+								free(m->dlna_pn);
+								m->dlna_pn = NULL;
 							}
 							break;
 						case FF_PROFILE_H264_HIGH:
-							off += sprintf(m.dlna_pn+off, "HP_");
+							off += sprintf(m->dlna_pn+off, "HP_");
 							if( lav_width(vstream)  <= 1920 &&
 							    lav_height(vstream) <= 1152 &&
 							    lav_bit_rate(vstream) <= 30000000 &&
 							    audio_profile == PROFILE_AUDIO_AC3 )
 							{
-								off += sprintf(m.dlna_pn+off, "HD_");
+								off += sprintf(m->dlna_pn+off, "HD_");
 							}
 							else
 							{
 								DPRINTF(E_DEBUG, L_METADATA, "Unsupported h.264 HP video profile! [%lldbps, %d audio : %s]\n",
 									(long long)lav_bit_rate(vstream), audio_profile, basepath);
-								free(m.dlna_pn);
-								m.dlna_pn = NULL;
+								free(m->dlna_pn);
+								m->dlna_pn = NULL;
 							}
 							break;
 						case FF_PROFILE_SKIP:
 							break;
 					}
-					if( !m.dlna_pn )
+					if( !m->dlna_pn )
 						break;
 					switch( audio_profile )
 					{
 						case PROFILE_AUDIO_MP3:
-							off += sprintf(m.dlna_pn+off, "MPEG1_L3");
+							off += sprintf(m->dlna_pn+off, "MPEG1_L3");
 							break;
 						case PROFILE_AUDIO_AC3:
-							off += sprintf(m.dlna_pn+off, "AC3");
+							off += sprintf(m->dlna_pn+off, "AC3");
 							break;
 						case PROFILE_AUDIO_AAC:
 						case PROFILE_AUDIO_AAC_MULT5:
-							off += sprintf(m.dlna_pn+off, "AAC_MULT5");
+							off += sprintf(m->dlna_pn+off, "AAC_MULT5");
 							break;
 						default:
 							DPRINTF(E_WARN, L_METADATA, "No DLNA profile found for %s file [%s]\n",
-								m.dlna_pn, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+								m->dlna_pn, basepath);
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 							break;
 					}
-					if( !m.dlna_pn )
+					if( !m->dlna_pn )
 						break;
 					if( raw_packet_size == MPEG_TS_PACKET_LENGTH_DLNA )
 					{
@@ -1103,26 +1262,26 @@ GetVideoMetadata(const char *path, const char *name)
 					{
 						DPRINTF(E_WARN, L_METADATA, "Unsupported DLNA TS packet size [%d] (%s)\n",
 							raw_packet_size, basepath);
-						free(m.dlna_pn);
-						m.dlna_pn = NULL;
+						free(m->dlna_pn);
+						m->dlna_pn = NULL;
 					}
 					switch( ts_timestamp )
 					{
 						case NONE:
-							if( m.dlna_pn )
-								off += sprintf(m.dlna_pn+off, "_ISO");
+							if( m->dlna_pn )
+								off += sprintf(m->dlna_pn+off, "_ISO");
 							break;
 						case VALID:
-							off += sprintf(m.dlna_pn+off, "_T");
+							off += sprintf(m->dlna_pn+off, "_T");
 						case EMPTY:
-							xasprintf(&m.mime, "video/vnd.dlna.mpeg-tts");
+							xasprintf(&m->mime, "video/vnd.dlna.mpeg-tts");
 						default:
 							break;
 					}
 				}
 				else if( strcmp(ctx->iformat->name, "mov,mp4,m4a,3gp,3g2,mj2") == 0 )
 				{
-					off += sprintf(m.dlna_pn+off, "MP4_");
+					off += sprintf(m->dlna_pn+off, "MP4_");
 
 					switch( lav_profile(vstream) ) {
 					case FF_PROFILE_H264_BASELINE:
@@ -1131,26 +1290,26 @@ GetVideoMetadata(const char *path, const char *name)
 						    lav_height(vstream) <= 288 )
 						{
 							if( ctx->bit_rate < 600000 )
-								off += sprintf(m.dlna_pn+off, "BL_CIF15_");
+								off += sprintf(m->dlna_pn+off, "BL_CIF15_");
 							else if( ctx->bit_rate < 5000000 )
-								off += sprintf(m.dlna_pn+off, "BL_CIF30_");
+								off += sprintf(m->dlna_pn+off, "BL_CIF30_");
 							else
 								goto mp4_mp_fallback;
 
 							if( audio_profile == PROFILE_AUDIO_AMR )
 							{
-								off += sprintf(m.dlna_pn+off, "AMR");
+								off += sprintf(m->dlna_pn+off, "AMR");
 							}
 							else if( audio_profile == PROFILE_AUDIO_AAC )
 							{
-								off += sprintf(m.dlna_pn+off, "AAC_");
+								off += sprintf(m->dlna_pn+off, "AAC_");
 								if( ctx->bit_rate < 520000 )
 								{
-									off += sprintf(m.dlna_pn+off, "520");
+									off += sprintf(m->dlna_pn+off, "520");
 								}
 								else if( ctx->bit_rate < 940000 )
 								{
-									off += sprintf(m.dlna_pn+off, "940");
+									off += sprintf(m->dlna_pn+off, "940");
 								}
 								else
 								{
@@ -1170,11 +1329,11 @@ GetVideoMetadata(const char *path, const char *name)
 							if( lav_level(vstream) == 30 &&
 							    audio_profile == PROFILE_AUDIO_AAC &&
 							    ctx->bit_rate <= 5000000 )
-								off += sprintf(m.dlna_pn+off, "BL_L3L_SD_AAC");
+								off += sprintf(m->dlna_pn+off, "BL_L3L_SD_AAC");
 							else if( lav_level(vstream) <= 31 &&
 							         audio_profile == PROFILE_AUDIO_AAC &&
 							         ctx->bit_rate <= 15000000 )
-								off += sprintf(m.dlna_pn+off, "BL_L31_HD_AAC");
+								off += sprintf(m->dlna_pn+off, "BL_L31_HD_AAC");
 							else
 								goto mp4_mp_fallback;
 						}
@@ -1184,11 +1343,11 @@ GetVideoMetadata(const char *path, const char *name)
 							if( lav_level(vstream) <= 31 &&
 							    audio_profile == PROFILE_AUDIO_AAC &&
 							    ctx->bit_rate <= 15000000 )
-								off += sprintf(m.dlna_pn+off, "BL_L31_HD_AAC");
+								off += sprintf(m->dlna_pn+off, "BL_L31_HD_AAC");
 							else if( lav_level(vstream) <= 32 &&
 							         audio_profile == PROFILE_AUDIO_AAC &&
 							         ctx->bit_rate <= 21000000 )
-								off += sprintf(m.dlna_pn+off, "BL_L32_HD_AAC");
+								off += sprintf(m->dlna_pn+off, "BL_L32_HD_AAC");
 							else
 								goto mp4_mp_fallback;
 						}
@@ -1197,43 +1356,43 @@ GetVideoMetadata(const char *path, const char *name)
 						break;
 					case FF_PROFILE_H264_MAIN:
 					mp4_mp_fallback:
-						off += sprintf(m.dlna_pn+off, "MP_");
+						off += sprintf(m->dlna_pn+off, "MP_");
 						/* AVC MP4 SD profiles - 10 Mbps max */
 						if( lav_width(vstream)  <= 720 &&
 						    lav_height(vstream) <= 576 &&
 						    lav_bit_rate(vstream) <= 10000000 )
 						{
-							sprintf(m.dlna_pn+off, "SD_");
+							sprintf(m->dlna_pn+off, "SD_");
 							if( audio_profile == PROFILE_AUDIO_AC3 )
-								off += sprintf(m.dlna_pn+off, "AC3");
+								off += sprintf(m->dlna_pn+off, "AC3");
 							else if( audio_profile == PROFILE_AUDIO_AAC ||
 							         audio_profile == PROFILE_AUDIO_AAC_MULT5 )
-								off += sprintf(m.dlna_pn+off, "AAC_MULT5");
+								off += sprintf(m->dlna_pn+off, "AAC_MULT5");
 							else if( audio_profile == PROFILE_AUDIO_MP3 )
-								off += sprintf(m.dlna_pn+off, "MPEG1_L3");
+								off += sprintf(m->dlna_pn+off, "MPEG1_L3");
 							else
-								m.dlna_pn[10] = '\0';
+								m->dlna_pn[10] = '\0';
 						}
 						else if( lav_width(vstream)  <= 1280 &&
 						         lav_height(vstream) <= 720 &&
 						         lav_bit_rate(vstream) <= 15000000 &&
 						         audio_profile == PROFILE_AUDIO_AAC )
 						{
-							off += sprintf(m.dlna_pn+off, "HD_720p_AAC");
+							off += sprintf(m->dlna_pn+off, "HD_720p_AAC");
 						}
 						else if( lav_width(vstream)  <= 1920 &&
 						         lav_height(vstream) <= 1080 &&
 						         lav_bit_rate(vstream) <= 21000000 &&
 						         audio_profile == PROFILE_AUDIO_AAC )
 						{
-							off += sprintf(m.dlna_pn+off, "HD_1080i_AAC");
+							off += sprintf(m->dlna_pn+off, "HD_1080i_AAC");
 						}
-						if( strlen(m.dlna_pn) <= 11 )
+						if( strlen(m->dlna_pn) <= 11 )
 						{
 							DPRINTF(E_WARN, L_METADATA, "No DLNA profile found for %s file %s\n",
-								m.dlna_pn, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+								m->dlna_pn, basepath);
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 						}
 						break;
 					case FF_PROFILE_H264_HIGH:
@@ -1242,21 +1401,21 @@ GetVideoMetadata(const char *path, const char *name)
 						    lav_bit_rate(vstream) <= 25000000 &&
 						    audio_profile == PROFILE_AUDIO_AAC )
 						{
-							off += sprintf(m.dlna_pn+off, "HP_HD_AAC");
+							off += sprintf(m->dlna_pn+off, "HP_HD_AAC");
 						}
 						break;
 					default:
 						DPRINTF(E_DEBUG, L_METADATA, "AVC profile [%d] not recognized for file %s\n",
 							lav_profile(vstream), basepath);
-						free(m.dlna_pn);
-						m.dlna_pn = NULL;
+						free(m->dlna_pn);
+						m->dlna_pn = NULL;
 						break;
 					}
 				}
 				else
 				{
-					free(m.dlna_pn);
-					m.dlna_pn = NULL;
+					free(m->dlna_pn);
+					m->dlna_pn = NULL;
 				}
 				DPRINTF(E_DEBUG, L_METADATA, "Stream %d of %s is h.264\n", video_stream, basepath);
 				break;
@@ -1275,25 +1434,25 @@ GetVideoMetadata(const char *path, const char *name)
 
 				if( strcmp(ctx->iformat->name, "mov,mp4,m4a,3gp,3g2,mj2") == 0 )
 				{
-					m.dlna_pn = malloc(128);
-					off = sprintf(m.dlna_pn, "MPEG4_P2_");
+					m->dlna_pn = malloc(128);
+					off = sprintf(m->dlna_pn, "MPEG4_P2_");
 
 					if( ends_with(path, ".3gp") )
 					{
-						xasprintf(&m.mime, "video/3gpp");
+						xasprintf(&m->mime, "video/3gpp");
 						switch( audio_profile )
 						{
 							case PROFILE_AUDIO_AAC:
-								off += sprintf(m.dlna_pn+off, "3GPP_SP_L0B_AAC");
+								off += sprintf(m->dlna_pn+off, "3GPP_SP_L0B_AAC");
 								break;
 							case PROFILE_AUDIO_AMR:
-								off += sprintf(m.dlna_pn+off, "3GPP_SP_L0B_AMR");
+								off += sprintf(m->dlna_pn+off, "3GPP_SP_L0B_AMR");
 								break;
 							default:
 								DPRINTF(E_DEBUG, L_METADATA, "No DLNA profile found for MPEG4-P2 3GP/%d file %s\n",
 								        audio_profile, basepath);
-								free(m.dlna_pn);
-								m.dlna_pn = NULL;
+								free(m->dlna_pn);
+								m->dlna_pn = NULL;
 								break;
 						}
 					}
@@ -1302,14 +1461,14 @@ GetVideoMetadata(const char *path, const char *name)
 						if( ctx->bit_rate <= 1000000 &&
 						    audio_profile == PROFILE_AUDIO_AAC )
 						{
-							off += sprintf(m.dlna_pn+off, "MP4_ASP_AAC");
+							off += sprintf(m->dlna_pn+off, "MP4_ASP_AAC");
 						}
 						else if( ctx->bit_rate <= 4000000 &&
 						         lav_width(vstream)  <= 640 &&
 						         lav_height(vstream) <= 480 &&
 						         audio_profile == PROFILE_AUDIO_AAC )
 						{
-							off += sprintf(m.dlna_pn+off, "MP4_SP_VGA_AAC");
+							off += sprintf(m->dlna_pn+off, "MP4_SP_VGA_AAC");
 						}
 						else
 						{
@@ -1317,8 +1476,8 @@ GetVideoMetadata(const char *path, const char *name)
 								lav_width(vstream),
 								lav_height(vstream),
 								(long long)ctx->bit_rate);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 						}
 					}
 				}
@@ -1338,28 +1497,28 @@ GetVideoMetadata(const char *path, const char *name)
 					DPRINTF(E_DEBUG, L_METADATA, "Skipping DLNA parsing for non-ASF VC1 file %s\n", path);
 					break;
 				}
-				m.dlna_pn = malloc(64);
-				off = sprintf(m.dlna_pn, "WMV");
+				m->dlna_pn = malloc(64);
+				off = sprintf(m->dlna_pn, "WMV");
 				DPRINTF(E_DEBUG, L_METADATA, "Stream %d of %s is VC1\n", video_stream, basepath);
-				xasprintf(&m.mime, "video/x-ms-wmv");
+				xasprintf(&m->mime, "video/x-ms-wmv");
 				if( (lav_width(vstream)  <= 176) &&
 				    (lav_height(vstream) <= 144) &&
 				    (lav_level(vstream) == 0) )
 				{
-					off += sprintf(m.dlna_pn+off, "SPLL_");
+					off += sprintf(m->dlna_pn+off, "SPLL_");
 					switch( audio_profile )
 					{
 						case PROFILE_AUDIO_MP3:
-							off += sprintf(m.dlna_pn+off, "MP3");
+							off += sprintf(m->dlna_pn+off, "MP3");
 							break;
 						case PROFILE_AUDIO_WMA_BASE:
-							off += sprintf(m.dlna_pn+off, "BASE");
+							off += sprintf(m->dlna_pn+off, "BASE");
 							break;
 						default:
 							DPRINTF(E_DEBUG, L_METADATA, "No DLNA profile found for WMVSPLL/0x%X file %s\n",
 								audio_profile, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 							break;
 					}
 				}
@@ -1368,20 +1527,20 @@ GetVideoMetadata(const char *path, const char *name)
 				         (lav_profile(vstream) == 0) &&
 				         (ctx->bit_rate/8 <= 384000) )
 				{
-					off += sprintf(m.dlna_pn+off, "SPML_");
+					off += sprintf(m->dlna_pn+off, "SPML_");
 					switch( audio_profile )
 					{
 						case PROFILE_AUDIO_MP3:
-							off += sprintf(m.dlna_pn+off, "MP3");
+							off += sprintf(m->dlna_pn+off, "MP3");
 							break;
 						case PROFILE_AUDIO_WMA_BASE:
-							off += sprintf(m.dlna_pn+off, "BASE");
+							off += sprintf(m->dlna_pn+off, "BASE");
 							break;
 						default:
 							DPRINTF(E_DEBUG, L_METADATA, "No DLNA profile found for WMVSPML/0x%X file %s\n",
 								audio_profile, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 							break;
 					}
 				}
@@ -1389,23 +1548,23 @@ GetVideoMetadata(const char *path, const char *name)
 				         (lav_height(vstream) <= 576) &&
 				         (ctx->bit_rate/8 <= 10000000) )
 				{
-					off += sprintf(m.dlna_pn+off, "MED_");
+					off += sprintf(m->dlna_pn+off, "MED_");
 					switch( audio_profile )
 					{
 						case PROFILE_AUDIO_WMA_PRO:
-							off += sprintf(m.dlna_pn+off, "PRO");
+							off += sprintf(m->dlna_pn+off, "PRO");
 							break;
 						case PROFILE_AUDIO_WMA_FULL:
-							off += sprintf(m.dlna_pn+off, "FULL");
+							off += sprintf(m->dlna_pn+off, "FULL");
 							break;
 						case PROFILE_AUDIO_WMA_BASE:
-							off += sprintf(m.dlna_pn+off, "BASE");
+							off += sprintf(m->dlna_pn+off, "BASE");
 							break;
 						default:
 							DPRINTF(E_DEBUG, L_METADATA, "No DLNA profile found for WMVMED/0x%X file %s\n",
 								audio_profile, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 							break;
 					}
 				}
@@ -1413,29 +1572,29 @@ GetVideoMetadata(const char *path, const char *name)
 				         (lav_height(vstream) <= 1080) &&
 				         (ctx->bit_rate/8 <= 20000000) )
 				{
-					off += sprintf(m.dlna_pn+off, "HIGH_");
+					off += sprintf(m->dlna_pn+off, "HIGH_");
 					switch( audio_profile )
 					{
 						case PROFILE_AUDIO_WMA_PRO:
-							off += sprintf(m.dlna_pn+off, "PRO");
+							off += sprintf(m->dlna_pn+off, "PRO");
 							break;
 						case PROFILE_AUDIO_WMA_FULL:
-							off += sprintf(m.dlna_pn+off, "FULL");
+							off += sprintf(m->dlna_pn+off, "FULL");
 							break;
 						default:
 							DPRINTF(E_DEBUG, L_METADATA, "No DLNA profile found for WMVHIGH/0x%X file %s\n",
 								audio_profile, basepath);
-							free(m.dlna_pn);
-							m.dlna_pn = NULL;
+							free(m->dlna_pn);
+							m->dlna_pn = NULL;
 							break;
 					}
 				}
 				break;
 			case AV_CODEC_ID_MSMPEG4V3:
-				xasprintf(&m.mime, "video/x-msvideo");
+				xasprintf(&m->mime, "video/x-msvideo");
 			default:
 				DPRINTF(E_DEBUG, L_METADATA, "Stream %d of %s is %s [type %d]\n",
-					video_stream, basepath, m.resolution, lav_codec_id(vstream));
+					video_stream, basepath, m->resolution, lav_codec_id(vstream));
 				break;
 		}
 	}
@@ -1446,29 +1605,29 @@ GetVideoMetadata(const char *path, const char *name)
 		{
 			if( video.title && *video.title )
 			{
-				m.title = escape_tag(trim(video.title), 1);
+				m->title = escape_tag(trim(video.title), 1);
 			}
 			if( video.genre && *video.genre )
 			{
-				m.genre = escape_tag(trim(video.genre), 1);
+				m->genre = escape_tag(trim(video.genre), 1);
 			}
 			if( video.contributor[ROLE_TRACKARTIST] && *video.contributor[ROLE_TRACKARTIST] )
 			{
-				m.artist = escape_tag(trim(video.contributor[ROLE_TRACKARTIST]), 1);
+				m->artist = escape_tag(trim(video.contributor[ROLE_TRACKARTIST]), 1);
 			}
 			if( video.contributor[ROLE_ALBUMARTIST] && *video.contributor[ROLE_ALBUMARTIST] )
 			{
-				m.creator = escape_tag(trim(video.contributor[ROLE_ALBUMARTIST]), 1);
+				m->creator = escape_tag(trim(video.contributor[ROLE_ALBUMARTIST]), 1);
 			}
 			else
 			{
-				m.creator = m.artist;
+				m->creator = m->artist;
 				free_flags &= ~FLAG_CREATOR;
 			}
-			if (!m.thumb_data)
+			if (!m->thumb_data)
 			{
-				m.thumb_data = video.image;
-				m.thumb_size = video.image_size;
+				m->thumb_data = video.image;
+				m->thumb_size = video.image_size;
 			}
 		}
 	}
@@ -1485,13 +1644,13 @@ GetVideoMetadata(const char *path, const char *name)
 			{
 				//DEBUG DPRINTF(E_DEBUG, L_METADATA, "  %-16s: %s\n", tag->key, tag->value);
 				if( strcmp(tag->key, "title") == 0 )
-					m.title = escape_tag(trim(tag->value), 1);
+					m->title = escape_tag(trim(tag->value), 1);
 				else if( strcmp(tag->key, "genre") == 0 )
-					m.genre = escape_tag(trim(tag->value), 1);
+					m->genre = escape_tag(trim(tag->value), 1);
 				else if( strcmp(tag->key, "artist") == 0 )
-					m.artist = escape_tag(trim(tag->value), 1);
+					m->artist = escape_tag(trim(tag->value), 1);
 				else if( strcmp(tag->key, "comment") == 0 )
-					m.comment = escape_tag(trim(tag->value), 1);
+					m->comment = escape_tag(trim(tag->value), 1);
 			}
 		}
 	}
@@ -1502,13 +1661,13 @@ video_no_dlna:
 #ifdef TIVO_SUPPORT
 	if( ends_with(path, ".TiVo") && is_tivo_file(path) )
 	{
-		if( m.dlna_pn )
+		if( m->dlna_pn )
 		{
-			free(m.dlna_pn);
-			m.dlna_pn = NULL;
+			free(m->dlna_pn);
+			m->dlna_pn = NULL;
 		}
-		m.mime = realloc(m.mime, 21);
-		strcpy(m.mime, "video/x-tivo-mpeg");
+		m->mime = realloc(m->mime, 21);
+		strcpy(m->mime, "video/x-tivo-mpeg");
 	}
 #endif
 
@@ -1518,44 +1677,44 @@ video_no_dlna:
 	{
 		strcpy(ext+1, "nfo");
 		if( access(nfo, R_OK) == 0 )
-			parse_nfo(nfo, &m);
+			parse_nfo(nfo, m);
 	}
 
-	if( !m.mime )
+	if( !m->mime )
 	{
 		if( strcmp(ctx->iformat->name, "avi") == 0 )
-			xasprintf(&m.mime, "video/x-msvideo");
+			xasprintf(&m->mime, "video/x-msvideo");
 		else if( strncmp(ctx->iformat->name, "mpeg", 4) == 0 )
-			xasprintf(&m.mime, "video/mpeg");
+			xasprintf(&m->mime, "video/mpeg");
 		else if( strcmp(ctx->iformat->name, "asf") == 0 )
-			xasprintf(&m.mime, "video/x-ms-wmv");
+			xasprintf(&m->mime, "video/x-ms-wmv");
 		else if( strcmp(ctx->iformat->name, "mov,mp4,m4a,3gp,3g2,mj2") == 0 )
 			if( ends_with(path, ".mov") )
-				xasprintf(&m.mime, "video/quicktime");
+				xasprintf(&m->mime, "video/quicktime");
 			else
-				xasprintf(&m.mime, "video/mp4");
+				xasprintf(&m->mime, "video/mp4");
 		else if( strncmp(ctx->iformat->name, "matroska", 8) == 0 )
-			xasprintf(&m.mime, "video/x-matroska");
+			xasprintf(&m->mime, "video/x-matroska");
 		else if( strcmp(ctx->iformat->name, "flv") == 0 )
-			xasprintf(&m.mime, "video/x-flv");
+			xasprintf(&m->mime, "video/x-flv");
 		else
 			DPRINTF(E_WARN, L_METADATA, "%s: Unhandled format: %s\n", path, ctx->iformat->name);
 	}
 
-	if( !m.date )
+	if( !m->date )
 	{
-		m.date = malloc(20);
-		modtime = localtime(&file.st_mtime);
-		strftime(m.date, 20, "%FT%T", modtime);
+		m->date = malloc(20);
+		localtime_r(&file.st_mtime, &modtime);
+		strftime(m->date, 20, "%FT%T", &modtime);
 	}
 
-	if( !m.title )
+	if( !m->title )
 	{
-		m.title = strdup(name);
-		strip_ext(m.title);
+		m->title = strdup(name);
+		strip_ext(m->title);
 	}
 
-	if (!m.disc && !m.track)
+	if (!m->disc && !m->track)
 	{
 		/* Search for Season and Episode in the filename */
 		char *p = (char*)name, *s;
@@ -1572,38 +1731,48 @@ video_no_dlna:
 			}
 			if (season && episode)
 			{
-				m.disc = season;
-				m.track = episode;
+				m->disc = season;
+				m->track = episode;
 			}
 			p = s + 1;
 		}
 	}
 
-	album_art = find_album_art(path, m.thumb_data, m.thumb_size);
-	freetags(&video);
-	lav_close(ctx);
-
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
-	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART, DISC, TRACK) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld, %u, %u);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration,
-	                   m.date, m.channels, m.bitrate, m.frequency, m.resolution,
-	                   m.title, m.creator, m.artist, m.genre, m.comment, m.dlna_pn,
-	                   m.mime, album_art, m.disc, m.track);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
+	m->type = TYPE_VIDEO;
+	m->size = file.st_size;
+	m->timestamp = file.st_mtime;
+	/* The thumbnail belongs to ctx or to the tags */
+	if( m->thumb_data )
 	{
-		ret = sqlite3_last_insert_rowid(db);
-		check_for_captions(path, ret);
+		uint8_t *thumb = malloc(m->thumb_size);
+		if( thumb )
+			memcpy(thumb, m->thumb_data, m->thumb_size);
+		else
+			m->thumb_size = 0;
+		m->thumb_data = thumb;
 	}
-	free_metadata(&m, free_flags);
+	own_metadata(m, free_flags);
+	freetags(&video);
+	lav_close(ctx);
 	free(path_cpy);
 
-	return ret;
+	return 0;
+}
+
+int64_t
+GetAudioMetadata(const char *path, const char *name)
+{
+	return get_metadata(ReadAudioMetadata, path, name);
+}
+
+int64_t
+GetImageMetadata(const char *path, const char *name)
+{
+	return get_metadata(ReadImageMetadata, path, name);
+}
+
+int64_t
+GetVideoMetadata(const char *path, const char *name)
+{
+	return get_metadata(ReadVideoMetadata, path, name);
 }
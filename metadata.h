@@ -44,6 +44,11 @@ typedef struct metadata_s {
 	char *       dlna_pn;
 	int          thumb_size;
 	uint8_t *    thumb_data;
+	/* Filled in by the Read*Metadata() functions for InsertMetadata() */
+	int          type;
+	int64_t      size;
+	int64_t      timestamp;
+	int          thumbnail;
 } metadata_t;
 
 typedef enum {
@@ -91,6 +96,32 @@ check_for_captions(const char *path, int64_t detailID);
 int64_t
 GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art);
 
+/* Read*Metadata()
+ * parse path without touching the database, so that files can be read
+ * from any thread.  Whatever m points to then belongs to it, including
+ * the embedded album art: release it with clear_metadata().
+ * returns: 0 on success, -1 if path is not usable */
+int
+ReadAudioMetadata(const char *path, const char *name, metadata_t *m);
+
+int
+ReadImageMetadata(const char *path, const char *name, metadata_t *m);
+
+int
+ReadVideoMetadata(const char *path, const char *name, metadata_t *m);
+
+/* InsertMetadata()
+ * add the DETAILS row (and album art) for what Read*Metadata() found
+ * returns: the DETAILS ID, or 0 on error */
+int64_t
+InsertMetadata(const char *path, metadata_t *m);
+
+void
+clear_metadata(metadata_t *m);
+
+/* Get*Metadata()
+ * read and insert in one go
+ * returns: the DETAILS ID, or 0 on error */
 int64_t
 GetAudioMetadata(const char *path, const char *name);
 
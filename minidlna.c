@@ -54,6 +54,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <sys/file.h>
 #include <sys/time.h>
 #include <sys/param.h>
@@ -99,6 +100,8 @@
 #include "tivo_beacon.h"
 #include "tivo_utils.h"
 #include "avahi.h"
+#include "workers.h"
+#include "respcache.h"
 
 #if SQLITE_VERSION_NUMBER < 3005001
 # warning "Your SQLite3 library appears to be too old!  Please use 3.5.1 or newer."
@@ -128,6 +131,19 @@ OpenAndConfHTTPSocket(unsigned short port)
 
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) < 0)
 		DPRINTF(E_WARN, L_GENERAL, "setsockopt(http, SO_REUSEADDR): %s\n", strerror(errno));
+#ifdef SO_REUSEPORT
+	/* each HTTP process has its own listener on the same port */
+	if (runtime_vars.http_processes > 0 &&
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "setsockopt(http, SO_REUSEPORT): %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+#endif
+	/* so that ProcessListen() can accept until the queue is empty */
+	if (fcntl(s, F_SETFL, O_NONBLOCK) < 0)
+		DPRINTF(E_WARN, L_GENERAL, "fcntl(http, O_NONBLOCK): %s\n", strerror(errno));
 
 	memset(&listenname, 0, sizeof(struct sockaddr_in));
 	listenname.sin_family = AF_INET;
@@ -141,7 +157,7 @@ OpenAndConfHTTPSocket(unsigned short port)
 		return -1;
 	}
 
-	if (listen(s, 16) < 0)
+	if (listen(s, runtime_vars.listen_backlog) < 0)
 	{
 		DPRINTF(E_ERROR, L_GENERAL, "listen(http): %s\n", strerror(errno));
 		close(s);
@@ -152,29 +168,41 @@ OpenAndConfHTTPSocket(unsigned short port)
 }
 
 /* ProcessListen() :
- * accept incoming HTTP connection. */
+ * accept incoming HTTP connections, up to accept_batch of them
+ * each time the listening socket becomes readable. */
 static void
 ProcessListen(struct event *ev)
 {
 	int shttp;
+	int n;
 	socklen_t clientnamelen;
 	struct sockaddr_in clientname;
-	clientnamelen = sizeof(struct sockaddr_in);
 
-	shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
-	if (shttp<0)
-	{
-		DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-	}
-	else
+	for (n = 0; n < runtime_vars.accept_batch; n++)
 	{
 		struct upnphttp * tmp = 0;
+
+		clientnamelen = sizeof(struct sockaddr_in);
+		/* The connection itself stays blocking, whatever the listener is */
+#ifdef HAVE_ACCEPT4
+		shttp = accept4(ev->fd, (struct sockaddr *)&clientname, &clientnamelen, SOCK_CLOEXEC);
+#else
+		shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
+		if (shttp >= 0)
+			fcntl(shttp, F_SETFL, fcntl(shttp, F_GETFL, 0) & ~O_NONBLOCK);
+#endif
+		if (shttp < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
+			break;
+		}
+
 		DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
 			inet_ntoa(clientname.sin_addr),
 			ntohs(clientname.sin_port) );
-		/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-			DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-		}*/
 		/* Create a new upnphttp object and add it to
 		 * the active upnphttp object list */
 		tmp = New_upnphttp(shttp);
@@ -306,17 +334,68 @@ _get_dbtime(void)
 {
 	char path[PATH_MAX];
 	struct stat st;
+	time_t mtime = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
-	if (stat(path, &st) != 0)
-		return 0;
-	return st.st_mtime;
+	if (stat(path, &st) == 0)
+		mtime = st.st_mtime;
+	/* Writes only reach files.db at checkpoints */
+	snprintf(path, sizeof(path), "%s/files.db-wal", db_path);
+	if (stat(path, &st) == 0 && st.st_mtime > mtime)
+		mtime = st.st_mtime;
+	return mtime;
+}
+
+/* Beyond this many changed containers, ContainerUpdateIDs is left empty
+ * and control points have to go by SystemUpdateID alone. */
+#define MAX_CONTAINER_UPDATES 512
+
+/* Publish the containers changed since *last_id through the evented
+ * ContainerUpdateIDs variable, as "ObjectID,UpdateID[,ObjectID,UpdateID...]" */
+static void
+update_container_ids(int64_t *last_id)
+{
+	char *sql, **result;
+	int rows = 0, i;
+	size_t len = 0;
+
+	free(container_update_ids);
+	container_update_ids = NULL;
+
+	sql = sqlite3_mprintf("SELECT ID, OBJECT_ID, UPDATE_ID from CONTAINER_UPDATES"
+	                      " where ID > %lld ORDER BY ID", (long long)*last_id);
+	if (sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK)
+	{
+		sqlite3_free(sql);
+		return;
+	}
+	sqlite3_free(sql);
+	if (rows)
+		*last_id = strtoll(result[rows*3], NULL, 10);
+
+	if (rows > MAX_CONTAINER_UPDATES)
+		DPRINTF(E_DEBUG, L_GENERAL, "%d containers changed, only bumping SystemUpdateID\n", rows);
+	else if (rows)
+	{
+		for (i = 1; i <= rows; i++)
+			len += strlen(result[i*3+1]) + strlen(result[i*3+2]) + 2;
+		container_update_ids = malloc(len);
+		if (container_update_ids)
+		{
+			len = 0;
+			for (i = 1; i <= rows; i++)
+				len += sprintf(container_update_ids + len, "%s%s,%s",
+				               i > 1 ? "," : "", result[i*3+1], result[i*3+2]);
+		}
+	}
+	sqlite3_free_table(result);
 }
 
 static int
-open_db(sqlite3 **sq3)
+open_db(sqlite3 **sq3, int reader)
 {
 	char path[PATH_MAX];
+	char *mode;
 	int new_db = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
@@ -330,15 +409,52 @@ open_db(sqlite3 **sq3)
 	if (sq3)
 		*sq3 = db;
 	sqlite3_busy_timeout(db, 5000);
-	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
-	sql_exec(db, "pragma default_cache_size = 8192;");
+	/* Only takes effect when the database is created */
+	sql_exec(db, "pragma page_size = %d", runtime_vars.db_page_size);
+	/* In WAL mode readers keep their snapshot while the scanner or the
+	 * monitor writes, and a crash only loses the last transactions. */
+	mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+	if (mode && strcmp(mode, "wal") == 0)
+	{
+		sql_exec(db, "pragma synchronous = NORMAL;");
+		sqlite3_wal_autocheckpoint(db, runtime_vars.wal_checkpoint);
+	}
+	else
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "WAL mode is not available for %s\n", path);
+		sql_exec(db, "pragma journal_mode = OFF");
+		sql_exec(db, "pragma synchronous = OFF;");
+	}
+	sqlite3_free(mode);
+	db_configure(db, reader);
     sqlite3_create_collation(db, "naturalsort", SQLITE_UTF8, NULL, naturalsort);
+	/* Used by the triggers that keep OBJECTS.TITLE_KEY */
+	sqlite3_create_function(db, "naturalsort_key", 1, SQLITE_UTF8|SQLITE_DETERMINISTIC,
+	                        NULL, naturalsort_key, NULL, NULL);
+#ifdef TIVO_SUPPORT
+	/* Add TiVo-specific randomize function to sqlite */
+	if (GETFLAG(TIVO_MASK) &&
+	    sqlite3_create_function(db, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL) != SQLITE_OK)
+		DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
+#endif
 
 	return new_db;
 }
 
+#ifdef HAVE_INOTIFY
+/* db is per thread, so the monitor writes through a connection of its
+ * own instead of sharing the one the main loop reads with. */
+static void *
+inotify_main(void *arg)
+{
+	open_db(NULL, 0);
+	start_inotify();
+	sql_close(db);
+
+	return NULL;
+}
+#endif
+
 static struct media_dir_s*
 ParseUPNPMediaDir(const char *media_option) {
   media_types type = ALL_MEDIA;
@@ -487,26 +603,32 @@ rescan:
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d => %d); need to recreate...\n",
 				ret, DB_VERSION);
-		sqlite3_close(db);
+		sql_close(db);
 
 		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
-		open_db(&db);
+		open_db(&db, 0);
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
 	}
+	if (sql_get_int_field(db, "SELECT count(*) from sqlite_master where NAME = 'DETAILS_FTS'") > 0)
+		SETFLAG(FTS_SEARCH_MASK);
+	else
+		CLEARFLAG(FTS_SEARCH_MASK);
 	if (ret || GETFLAG(RESCAN_MASK))
 	{
 #if USE_FORK
-		sqlite3_close(db);
+		sql_close(db);
 		*scanner_pid = fork();
-		open_db(&db);
+		open_db(&db, 0);
 		if (*scanner_pid == 0) /* child (scanner) process */
 		{
 			start_scanner();
-			sqlite3_close(db);
+			/* Fold the whole scan into files.db and empty the WAL */
+			sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+			sql_close(db);
 			log_close();
 			freeoptions();
 			free(children);
@@ -674,6 +796,19 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.worker_threads = 4;
+	runtime_vars.http_processes = 0;
+	runtime_vars.listen_backlog = 16;
+	runtime_vars.accept_batch = 16;
+	runtime_vars.response_cache_size = 1024;
+	runtime_vars.wal_checkpoint = 1000;
+	runtime_vars.db_page_size = 4096;
+	runtime_vars.db_cache_size = 32768;
+	runtime_vars.db_reader_cache_size = 2048;
+	runtime_vars.db_mmap_size = 0;
+	runtime_vars.db_temp_store = 0;
+	runtime_vars.db_heap_limit = 0;
+	runtime_vars.scan_threads = 4;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
@@ -847,6 +982,82 @@ init(int argc, char **argv)
 		case MAX_CONNECTIONS:
 			runtime_vars.max_connections = atoi(ary_options[i].value);
 			break;
+		case WORKER_THREADS:
+			runtime_vars.worker_threads = atoi(ary_options[i].value);
+			break;
+		case HTTP_PROCESSES:
+			runtime_vars.http_processes = atoi(ary_options[i].value);
+#ifndef SO_REUSEPORT
+			if (runtime_vars.http_processes > 0)
+			{
+				DPRINTF(E_WARN, L_GENERAL, "SO_REUSEPORT is not supported, ignoring http_processes\n");
+				runtime_vars.http_processes = 0;
+			}
+#endif
+			break;
+		case LISTEN_BACKLOG:
+			runtime_vars.listen_backlog = atoi(ary_options[i].value);
+			break;
+		case ACCEPT_BATCH:
+			runtime_vars.accept_batch = atoi(ary_options[i].value);
+			if (runtime_vars.accept_batch < 1)
+				runtime_vars.accept_batch = 1;
+			break;
+		case RESPONSE_CACHE_SIZE:
+			runtime_vars.response_cache_size = atoi(ary_options[i].value);
+			if (runtime_vars.response_cache_size < 0)
+				runtime_vars.response_cache_size = 0;
+			break;
+		case WAL_CHECKPOINT:
+			runtime_vars.wal_checkpoint = atoi(ary_options[i].value);
+			if (runtime_vars.wal_checkpoint < 1)
+				runtime_vars.wal_checkpoint = 1000;
+			break;
+		case DB_PAGE_SIZE:
+			runtime_vars.db_page_size = atoi(ary_options[i].value);
+			if (runtime_vars.db_page_size < 512 || runtime_vars.db_page_size > 65536 ||
+			    (runtime_vars.db_page_size & (runtime_vars.db_page_size - 1)))
+			{
+				DPRINTF(E_WARN, L_GENERAL, "db_page_size must be a power of two "
+				        "from 512 to 65536, using 4096\n");
+				runtime_vars.db_page_size = 4096;
+			}
+			break;
+		case DB_CACHE_SIZE:
+			runtime_vars.db_cache_size = atoi(ary_options[i].value);
+			if (runtime_vars.db_cache_size < 0)
+				runtime_vars.db_cache_size = 0;
+			break;
+		case DB_READER_CACHE_SIZE:
+			runtime_vars.db_reader_cache_size = atoi(ary_options[i].value);
+			if (runtime_vars.db_reader_cache_size < 0)
+				runtime_vars.db_reader_cache_size = 0;
+			break;
+		case DB_MMAP_SIZE:
+			runtime_vars.db_mmap_size = atoi(ary_options[i].value);
+			if (runtime_vars.db_mmap_size < 0)
+				runtime_vars.db_mmap_size = 0;
+			break;
+		case DB_TEMP_STORE:
+			if (strcasecmp(ary_options[i].value, "memory") == 0)
+				runtime_vars.db_temp_store = 2;
+			else if (strcasecmp(ary_options[i].value, "file") == 0)
+				runtime_vars.db_temp_store = 1;
+			else
+				runtime_vars.db_temp_store = 0;
+			break;
+		case DB_HEAP_LIMIT:
+			runtime_vars.db_heap_limit = atoi(ary_options[i].value);
+			if (runtime_vars.db_heap_limit < 0)
+				runtime_vars.db_heap_limit = 0;
+			break;
+		case DB_WARMUP:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(DB_WARMUP_MASK);
+			break;
+		case SCAN_THREADS:
+			runtime_vars.scan_threads = atoi(ary_options[i].value);
+			break;
 		case MERGE_MEDIA_DIRS:
 			if (strtobool(ary_options[i].value))
 				SETFLAG(MERGE_MEDIA_DIRS_MASK);
@@ -1135,6 +1346,378 @@ init(int argc, char **argv)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to init event module. "
 		    "[%s] EXITING.\n", strerror(error));
 
+	respcache_init((size_t)runtime_vars.response_cache_size * 1024);
+	/* Past the limit SQLite recycles its page cache before growing */
+	if (runtime_vars.db_heap_limit)
+		sqlite3_soft_heap_limit64((sqlite3_int64)runtime_vars.db_heap_limit * 1024);
+
+	return 0;
+}
+
+/* HTTP processes :
+ * with http_processes set, the main process keeps SSDP, inotify and
+ * event subscriptions, and that many processes serve HTTP.
+ * Each one has its own SO_REUSEPORT listener and database connection.
+ * The main process sends them the current SystemUpdateID, network
+ * interfaces and the clients it identified over SSDP through a
+ * socketpair, and they pass SUBSCRIBE and UNSUBSCRIBE connections
+ * back over the same socketpair.
+ * fork() from a threaded process can leave the child with locks held by
+ * threads it does not have, so the HTTP processes are forked by a
+ * supervisor process, itself forked before the main process starts any
+ * thread.  The supervisor restarts the ones that die, and tells the main
+ * process to send the new one its state. */
+struct http_process {
+	pid_t pid;		/* supervisor only */
+	time_t started;		/* supervisor only */
+	int fd;			/* the HTTP process end of the socketpair */
+	struct event ev;	/* our end of the socketpair */
+};
+
+struct http_state {
+	uint32_t update_id;
+	int n_lan_addr;
+	struct lan_addr_s lan_addr[MAX_LAN_ADDR];
+	int n_clients;
+	struct ssdp_client clients[CLIENT_CACHE_SLOTS];
+};
+
+static struct http_process *http_procs;
+static struct http_state http_state_sent;
+static struct event supervisorev;
+
+static void
+get_http_state(struct http_state *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->update_id = updateID;
+	st->n_lan_addr = n_lan_addr;
+	for (i = 0; i < n_lan_addr; i++)
+	{
+		st->lan_addr[i] = lan_addr[i];
+		st->lan_addr[i].snotify = -1;
+	}
+	st->n_clients = GetSSDPClients(st->clients, CLIENT_CACHE_SLOTS);
+}
+
+/* delete finished and idle HTTP connections */
+static void
+reap_http_connections(void)
+{
+	struct upnphttp *e, *next;
+	time_t lastidletime = time(NULL) - HTTP_KEEPALIVE_TIMEOUT;
+
+	for (e = upnphttphead.lh_first; e != NULL; e = next)
+	{
+		next = e->entries.le_next;
+		if(e->state >= 100 ||
+		   (e->state == 0 && e->requests && e->idle_since <= lastidletime))
+		{
+			LIST_REMOVE(e, entries);
+			Delete_upnphttp(e);
+		}
+	}
+}
+
+/* main process: a connection passed over by an HTTP process */
+static void
+ProcessHandoff(struct event *ev)
+{
+	struct upnphttp *h = NULL;
+
+	if (Adopt_upnphttp(ev->fd, &h) < 0)
+	{
+		/* the HTTP process is gone */
+		event_module.del(ev, EV_FLAG_CLOSING);
+		close(ev->fd);
+		ev->fd = -1;
+		return;
+	}
+	if (h)
+		LIST_INSERT_HEAD(&upnphttphead, h, entries);
+}
+
+/* HTTP process: state update from the main process */
+static void
+ProcessParentMessage(struct event *ev)
+{
+	struct http_state st;
+	int i, n;
+
+	n = recv(ev->fd, &st, sizeof(st), 0);
+	if (n == 0 || (n < 0 && errno != EINTR))
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Lost the main process, exiting\n");
+		quitting = 1;
+		return;
+	}
+	if (n != sizeof(st))
+		return;
+	updateID = st.update_id;
+	for (i = 0; i < st.n_lan_addr; i++)
+	{
+		lan_addr[i] = st.lan_addr[i];
+		lan_addr[i].snotify = -1;
+	}
+	n_lan_addr = st.n_lan_addr;
+	for (i = 0; i < st.n_clients; i++)
+	{
+		struct client_cache_s *client = SearchClientCache(st.clients[i].addr, 1);
+
+		if (!client)
+			AddClientCache(st.clients[i].addr, st.clients[i].type);
+		else if (client->type != &client_types[st.clients[i].type])
+		{
+			client->type = &client_types[st.clients[i].type];
+			client->age = time(NULL);
+		}
+	}
+}
+
+static void
+http_process_main(int sock)
+{
+	struct event listenev, parentev;
+	struct upnphttp *e;
+	int shttpl, i;
+
+	/* Only the main process announces itself and reaps the others */
+	signal(SIGHUP, SIG_IGN);
+	memset(children, 0, runtime_vars.max_connections * sizeof(struct child));
+	number_of_children = 0;
+	for (i = 0; i < n_lan_addr; i++)
+	{
+		close(lan_addr[i].snotify);
+		lan_addr[i].snotify = -1;
+	}
+	if (sssdp >= 0)
+		close(sssdp);
+	sssdp = -1;
+	sparent = sock;
+
+	/* process_fork() dropped the event queue shared with the main process
+	 * when it started the supervisor */
+	if (event_module.init() != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to init event module. EXITING.\n");
+	/* The connection inherited from the main process must not be used
+	 * across fork(), so leave it alone and open our own. */
+	sql_cache_forget();
+	open_db(NULL, 1);
+	/* Serve nothing before the main process sent its state */
+	parentev = (struct event ){ .fd = sock, .rdwr = EVENT_READ, .process = ProcessParentMessage };
+	ProcessParentMessage(&parentev);
+	shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
+	if (shttpl < 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
+	listenev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
+	event_module.add(&listenev);
+	event_module.add(&parentev);
+	if (workers_init(runtime_vars.worker_threads) != 0)
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to start worker threads, "
+		                            "Browse and Search will block the HTTP process.\n");
+
+	while (!quitting)
+	{
+		event_module.process(HTTP_KEEPALIVE_TIMEOUT * 1000);
+		reap_http_connections();
+	}
+
+	workers_fini();
+	while ((e = upnphttphead.lh_first) != NULL)
+	{
+		LIST_REMOVE(e, entries);
+		Delete_upnphttp(e);
+	}
+	close(shttpl);
+	close(sock);
+	process_reap_children();
+	event_module.fini();
+	sql_close(db);
+	exit(EXIT_SUCCESS);
+}
+
+/* supervisor: fork HTTP process n, and have the main process
+ * send it the current state */
+static void
+spawn_http_process(int n, int ctl)
+{
+	struct http_process *proc = &http_procs[n];
+	struct sigaction sa;
+	pid_t pid;
+	int i;
+
+	proc->started = time(NULL);
+	pid = fork();
+	if (pid < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "fork(): %s\n", strerror(errno));
+		return;
+	}
+	if (pid == 0)
+	{
+		close(ctl);
+		for (i = 0; i < runtime_vars.http_processes; i++)
+		{
+			if (i != n)
+				close(http_procs[i].fd);
+		}
+		memset(&sa, 0, sizeof(struct sigaction));
+		sa.sa_handler = process_handle_child_termination;
+		sigaction(SIGCHLD, &sa, NULL);
+		http_process_main(proc->fd);
+	}
+	proc->pid = pid;
+	if (send(ctl, &n, sizeof(n), 0) < 0)
+		DPRINTF(E_ERROR, L_GENERAL, "send(supervisor): %s\n", strerror(errno));
+	DPRINTF(E_INFO, L_GENERAL, "Started HTTP process %d [%d]\n", n, (int)pid);
+}
+
+/* supervisor: keep the HTTP processes running, restarting each one at
+ * most every 10 seconds, until the main process goes away */
+static void
+http_supervisor_main(int ctl)
+{
+	struct pollfd pfd = { .fd = ctl, .events = POLLIN };
+	char c;
+	pid_t pid;
+	int i;
+
+	/* We reap our own children, and only the main process reloads */
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	for (i = 0; i < runtime_vars.http_processes; i++)
+		spawn_http_process(i, ctl);
+
+	while (!quitting)
+	{
+		if (poll(&pfd, 1, 1000) > 0)
+		{
+			ssize_t n = recv(ctl, &c, 1, MSG_DONTWAIT);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+				break;
+		}
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		{
+			for (i = 0; i < runtime_vars.http_processes; i++)
+			{
+				if (http_procs[i].pid != pid)
+					continue;
+				DPRINTF(E_ERROR, L_GENERAL, "HTTP process %d [%d] exited\n", i, (int)pid);
+				http_procs[i].pid = 0;
+			}
+		}
+		for (i = 0; i < runtime_vars.http_processes; i++)
+		{
+			if (!http_procs[i].pid && time(NULL) >= http_procs[i].started + 10)
+				spawn_http_process(i, ctl);
+		}
+	}
+
+	for (i = 0; i < runtime_vars.http_processes; i++)
+	{
+		if (http_procs[i].pid)
+			kill(http_procs[i].pid, SIGTERM);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* main process: the supervisor started HTTP process n */
+static void
+ProcessSupervisorMessage(struct event *ev)
+{
+	struct http_state st;
+	int n, ret;
+
+	ret = recv(ev->fd, &n, sizeof(n), 0);
+	if (ret == 0 || (ret < 0 && errno != EINTR && errno != EAGAIN))
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Lost the HTTP process supervisor, "
+		                            "HTTP processes will not be restarted\n");
+		event_module.del(ev, EV_FLAG_CLOSING);
+		close(ev->fd);
+		ev->fd = -1;
+		return;
+	}
+	if (ret != sizeof(n) || n < 0 || n >= runtime_vars.http_processes)
+		return;
+	get_http_state(&st);
+	if (send(http_procs[n].ev.fd, &st, sizeof(st), MSG_DONTWAIT) < 0)
+		DPRINTF(E_ERROR, L_GENERAL, "send(HTTP process %d): %s\n", n, strerror(errno));
+}
+
+/* Send the HTTP processes our state when it changed */
+static void
+update_http_processes(void)
+{
+	struct http_state st;
+	int i;
+
+	get_http_state(&st);
+	if (memcmp(&st, &http_state_sent, sizeof(st)) == 0)
+		return;
+	for (i = 0; i < runtime_vars.http_processes; i++)
+	{
+		if (http_procs[i].ev.fd >= 0 &&
+		    send(http_procs[i].ev.fd, &st, sizeof(st), MSG_DONTWAIT) < 0)
+			DPRINTF(E_ERROR, L_GENERAL, "send(HTTP process %d): %s\n", i, strerror(errno));
+	}
+	http_state_sent = st;
+}
+
+/* Fork the supervisor, which forks the HTTP processes.
+ * Must run before the main process starts any thread. */
+static int
+start_http_processes(void)
+{
+	int ctl[2], sv[2];
+	pid_t pid;
+	int i;
+
+	http_procs = calloc(runtime_vars.http_processes, sizeof(struct http_process));
+	if (!http_procs)
+		return -1;
+	for (i = 0; i < runtime_vars.http_processes; i++)
+	{
+		/* The supervisor keeps the other end open, so the socketpair
+		 * outlives the HTTP processes it restarts */
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "socketpair(): %s\n", strerror(errno));
+			return -1;
+		}
+		http_procs[i].ev = (struct event ){ .fd = sv[0], .rdwr = EVENT_READ,
+		                                    .process = ProcessHandoff, .data = &http_procs[i] };
+		http_procs[i].fd = sv[1];
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "socketpair(): %s\n", strerror(errno));
+		return -1;
+	}
+	pid = process_fork(NULL);
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		close(ctl[0]);
+		for (i = 0; i < runtime_vars.http_processes; i++)
+			close(http_procs[i].ev.fd);
+		http_supervisor_main(ctl[1]);
+	}
+	close(ctl[1]);
+	for (i = 0; i < runtime_vars.http_processes; i++)
+	{
+		close(http_procs[i].fd);
+		http_procs[i].fd = -1;
+		event_module.add(&http_procs[i].ev);
+	}
+	supervisorev = (struct event ){ .fd = ctl[0], .rdwr = EVENT_READ, .process = ProcessSupervisorMessage };
+	event_module.add(&supervisorev);
+	DPRINTF(E_INFO, L_GENERAL, "Started HTTP process supervisor [%d]\n", (int)pid);
+
 	return 0;
 }
 
@@ -1147,11 +1730,12 @@ main(int argc, char **argv)
 	int shttpl = -1;
 	int smonitor = -1;
 	struct upnphttp * e = 0;
-	struct upnphttp * next;
 	struct timeval tv, timeofday, lastnotifytime = {0, 0};
 	time_t lastupdatetime = 0, lastdbtime = 0;
+	int client_fetches = 0;
 	u_long timeout;	/* in milliseconds */
 	int last_changecnt = 0;
+	int64_t last_container_update;
 	pid_t scanner_pid = 0;
 	pthread_t inotify_thread = 0;
 	struct event ssdpev, httpev, monev;
@@ -1179,7 +1763,7 @@ main(int argc, char **argv)
 
 	LIST_INIT(&upnphttphead);
 
-	ret = open_db(NULL);
+	ret = open_db(NULL, 0);
 	if (ret == 0)
 	{
 		updateID = sql_get_int_field(db, "SELECT VALUE from SETTINGS where KEY = 'UPDATE_ID'");
@@ -1188,17 +1772,35 @@ main(int argc, char **argv)
 	}
 	check_db(db, ret, &scanner_pid);
 	lastdbtime = _get_dbtime();
+	last_container_update = sql_get_int64_field(db, "SELECT max(ID) from CONTAINER_UPDATES");
+	last_changecnt = db_changes(db);
+	if (GETFLAG(DB_WARMUP_MASK) && !GETFLAG(SCANNING_MASK))
+		db_warmup(db);
+	/* before any thread exists, see start_http_processes() */
+	if (runtime_vars.http_processes)
+	{
+		if (start_http_processes() != 0)
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to start HTTP processes. EXITING\n");
+		DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d with %d processes\n",
+			runtime_vars.port, runtime_vars.http_processes);
+	}
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
 		if (!sqlite3_threadsafe() || sqlite3_libversion_number() < 3005001)
 			DPRINTF(E_ERROR, L_GENERAL, "SQLite library is not threadsafe!  "
 			                            "Inotify will be disabled.\n");
-		else if (pthread_create(&inotify_thread, NULL, start_inotify, NULL) != 0)
+		else if (pthread_create(&inotify_thread, NULL, inotify_main, NULL) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: pthread_create() failed for start_inotify. EXITING\n");
 	}
 #endif /* HAVE_INOTIFY */
 
+	/* HTTP processes start their own */
+	if (!runtime_vars.http_processes &&
+	    workers_init(runtime_vars.worker_threads) != 0)
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to start worker threads, "
+		                            "Browse and Search will block the main loop.\n");
+
 #ifdef HAVE_KQUEUE
 	if (!GETFLAG(SCANNING_MASK)) {
 		av_register_all();
@@ -1228,21 +1830,20 @@ main(int argc, char **argv)
 	}
 
 	/* open socket for HTTP connections. */
-	shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
-	if (shttpl < 0)
-		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
-	DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
-	httpev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
-	event_module.add(&httpev);
+	if (!runtime_vars.http_processes)
+	{
+		shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
+		if (shttpl < 0)
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
+		DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
+		httpev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
+		event_module.add(&httpev);
+	}
 
 #ifdef TIVO_SUPPORT
 	if (GETFLAG(TIVO_MASK))
 	{
 		DPRINTF(E_WARN, L_GENERAL, "TiVo support is enabled.\n");
-		/* Add TiVo-specific randomize function to sqlite */
-		ret = sqlite3_create_function(db, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL);
-		if (ret != SQLITE_OK)
-			DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
 		if (GETFLAG(TIVO_BONJOUR_MASK))
 		{
 			tivo_bonjour_register();
@@ -1326,21 +1927,31 @@ main(int argc, char **argv)
 			CLEARFLAG(SCANNING_MASK);
 			if (_get_dbtime() != lastdbtime)
 				updateID++;
+			if (GETFLAG(DB_WARMUP_MASK))
+				db_warmup(db);
 #ifdef HAVE_KQUEUE
 			av_register_all();
 			kqueue_monitor_start();
 #endif /* HAVE_KQUEUE */
 		}
 
+		/* wake up in time to drop idle persistent connections */
+		if (!LIST_EMPTY(&upnphttphead) && timeout > HTTP_KEEPALIVE_TIMEOUT * 1000)
+			timeout = HTTP_KEEPALIVE_TIMEOUT * 1000;
+		/* and to time out client lookups */
+		if (client_fetches && timeout > 1000)
+			timeout = 1000;
+
 		event_module.process(timeout);
 		if (quitting)
 			goto shutdown;
 
 		upnpevents_gc();
+		client_fetches = ExpireClientFetches();
 
 		/* increment SystemUpdateID if the content database has changed,
 		 * and if there is an active HTTP connection, at most once every 2 seconds */
-		if (!LIST_EMPTY(&upnphttphead) &&
+		if ((!LIST_EMPTY(&upnphttphead) || runtime_vars.http_processes) &&
 		    (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
 			if (GETFLAG(SCANNING_MASK))
@@ -1352,24 +1963,18 @@ main(int argc, char **argv)
 					last_changecnt = -1;
 				}
 			}
-			if (sqlite3_total_changes(db) != last_changecnt)
+			if (db_changes(db) != last_changecnt)
 			{
 				updateID++;
-				last_changecnt = sqlite3_total_changes(db);
+				last_changecnt = db_changes(db);
+				update_container_ids(&last_container_update);
 				upnp_event_var_change_notify(EContentDirectory);
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
-		/* delete finished HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = next)
-		{
-			next = e->entries.le_next;
-			if(e->state >= 100)
-			{
-				LIST_REMOVE(e, entries);
-				Delete_upnphttp(e);
-			}
-		}
+		if (runtime_vars.http_processes)
+			update_http_processes();
+		reap_http_connections();
 	}
 
 shutdown:
@@ -1377,6 +1982,8 @@ shutdown:
 	if (GETFLAG(SCANNING_MASK) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
+	workers_fini();
+
 	/* close out open sockets */
 	while (upnphttphead.lh_first != NULL)
 	{
@@ -1414,7 +2021,7 @@ shutdown:
 	event_module.fini();
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
-	sqlite3_close(db);
+	sql_close(db);
 
 	upnpevents_removeSubscribers();
 
@@ -49,6 +49,19 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int worker_threads;	/* threads running Browse/Search actions */
+	int http_processes;	/* processes serving HTTP, 0 to serve it from the main process */
+	int listen_backlog;	/* listen() backlog of the HTTP socket */
+	int accept_batch;	/* max connections accepted per listen event */
+	int response_cache_size;	/* KiB of Browse/Search responses to keep, 0 to disable */
+	int wal_checkpoint;	/* WAL pages between checkpoints by the writers */
+	int db_page_size;	/* page size of a new database, in bytes */
+	int db_cache_size;	/* KiB of page cache per database connection */
+	int db_reader_cache_size;	/* KiB of page cache per worker or HTTP process connection */
+	int db_mmap_size;	/* MiB of the database to access through mmap(), 0 to disable */
+	int db_temp_store;	/* pragma temp_store: 0 default, 1 file, 2 memory */
+	int db_heap_limit;	/* KiB of heap SQLite should stay under, 0 for no limit */
+	int scan_threads;	/* number of threads reading metadata during a scan */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
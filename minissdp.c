@@ -41,6 +41,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/queue.h>
 
 #include "event.h"
 #include "minidlnapath.h"
@@ -318,104 +321,143 @@ SendSSDPNotifies(int s, const char *host, unsigned short port,
 	}
 }
 
-static void
-ParseUPnPClient(char *location)
-{
-	char buf[8192];
-	struct sockaddr_in dest;
-	int s, n, do_headers = 0, nread = 0;
-	struct timeval tv;
-	char *addr, *path, *port_str;
-	long port = 80;
-	char *off = NULL, *p;
-	int content_len = sizeof(buf);
-	struct NameValueParserData xml;
-	struct client_cache_s *client;
-	int type = 0;
-	char *model, *serial, *name;
+/* Some renderers can only be told apart by their device description.
+ * It is fetched without blocking the event loop, and the outcome is
+ * remembered per LOCATION so that a renderer that keeps announcing
+ * itself is not asked again until the entry expires.  A failed fetch
+ * is remembered too, and retried after a delay that doubles with each
+ * further failure. */
+#define LOCATION_CACHE_SLOTS	CLIENT_CACHE_SLOTS
+#define LOCATION_MAX_LEN	256
+#define LOCATION_CACHE_AGE	3600
+#define FETCH_TIMEOUT		2	/* seconds */
+#define FETCH_MAX		4	/* fetches at once */
+#define FETCH_RETRY		30	/* seconds, after the first failure */
 
-	if (strncmp(location, "http://", 7) != 0)
-		return;
-	path = location + 7;
-	port_str = strsep(&path, "/");
-	if (!path)
-		return;
-	addr = strsep(&port_str, ":");
-	if (port_str)
-	{
-		port = strtol(port_str, NULL, 10);
-		if (!port)
-			port = 80;
-	}
+struct location_cache_s {
+	char location[LOCATION_MAX_LEN];
+	struct in_addr addr;
+	int type;
+	time_t age;
+	int failures;
+	time_t retry;
+};
 
-	memset(&dest, '\0', sizeof(dest));
-	if (!inet_aton(addr, &dest.sin_addr))
-		return;
-	/* Check if the client is already in cache */
-	dest.sin_family = AF_INET;
-	dest.sin_port = htons(port);
+static struct location_cache_s locations[LOCATION_CACHE_SLOTS];
 
-	s = socket(PF_INET, SOCK_STREAM, 0);
-	if (s < 0)
-		return;
+enum fetch_state { EFetchConnecting, EFetchSending, EFetchReceiving, EFetchDone };
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 500000;
-	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+struct client_fetch {
+	struct event ev;
+	enum fetch_state state;
+	struct in_addr addr;
+	time_t started;
+	char location[LOCATION_MAX_LEN];
+	char buf[8192];
+	int len;
+	int sent;
+	LIST_ENTRY(client_fetch) entries;
+};
 
-	if (connect(s, (struct sockaddr*)&dest, sizeof(struct sockaddr_in)) < 0)
-		goto close;
+static LIST_HEAD(, client_fetch) fetches = LIST_HEAD_INITIALIZER(fetches);
+static int nfetches;
 
-	n = snprintf(buf, sizeof(buf), "GET /%s HTTP/1.0\r\n"
-	                               "HOST: %s:%ld\r\n\r\n",
-	                               path, addr, port);
-	if (write(s, buf, n) < 1)
-		goto close;
+static struct location_cache_s *
+SearchLocationCache(const char *location)
+{
+	int i;
 
-	while ((n = read(s, buf+nread, sizeof(buf)-nread-1)) > 0)
+	for (i = 0; i < LOCATION_CACHE_SLOTS; i++)
 	{
-		nread += n;
-		buf[nread] = '\0';
-		n = nread - 4;
-		p = buf;
-
-		while (!off && (n-- > 0))
-		{
-			if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
-			{
-				off = p + 4;
-				do_headers = 1;
-			}
-			p++;
-		}
-		if (!off)
+		if (!locations[i].age || strcmp(locations[i].location, location) != 0)
 			continue;
-
-		if (do_headers)
+		if (time(NULL) - locations[i].age > LOCATION_CACHE_AGE)
 		{
-			p = buf;
-			if (strncmp(p, "HTTP/", 5) != 0)
-				goto close;
-			while (*p != ' ' && *p != '\t')
-				p++;
-			/* If we don't get a 200 status, ignore it */
-			if (strtol(p, NULL, 10) != 200)
-				goto close;
-			p = strcasestr(p, "Content-Length:");
-			if (p)
-				content_len = strtol(p+15, NULL, 10);
-			do_headers = 0;
+			locations[i].age = 0;
+			return NULL;
 		}
-		if ((buf + nread - off) >= content_len)
-			break;
+		return &locations[i];
 	}
-close:
-	close(s);
-	if (!off)
+
+	return NULL;
+}
+
+static struct location_cache_s *
+AddLocationCache(const char *location, struct in_addr addr, int type)
+{
+	struct location_cache_s *slot;
+	int i;
+
+	/* Reuse this location's slot, or take a free one, or else the oldest */
+	slot = SearchLocationCache(location);
+	for (i = 0; !slot && i < LOCATION_CACHE_SLOTS; i++)
+	{
+		if (!locations[i].age)
+			slot = &locations[i];
+	}
+	for (i = 0; !slot && i < LOCATION_CACHE_SLOTS; i++)
+	{
+		if (i == 0 || locations[i].age < slot->age)
+			slot = &locations[i];
+	}
+	strncpyt(slot->location, location, sizeof(slot->location));
+	slot->addr = addr;
+	slot->type = type;
+	slot->age = time(NULL);
+	slot->failures = 0;
+	slot->retry = 0;
+
+	return slot;
+}
+
+/* Hold off on this location for a while */
+static void
+FailLocationCache(const char *location, struct in_addr addr)
+{
+	struct location_cache_s *slot;
+	int failures = 0;
+	time_t delay;
+
+	slot = SearchLocationCache(location);
+	if (slot)
+		failures = slot->failures;
+	slot = AddLocationCache(location, addr, 0);
+	slot->failures = failures + 1;
+	delay = FETCH_RETRY << MIN(failures, 7);
+	slot->retry = slot->age + MIN(delay, LOCATION_CACHE_AGE);
+	DPRINTF(E_DEBUG, L_SSDP, "Not fetching %s again for %ld seconds\n",
+		location, (long)(slot->retry - slot->age));
+}
+
+static void
+SetClientType(struct in_addr addr, int type)
+{
+	struct client_cache_s *client;
+
+	if (!type)
 		return;
-	nread -= off - buf;
-	ParseNameValue(off, nread, &xml, 0);
+	/* Add this client to the cache if it's not there already. */
+	client = SearchClientCache(addr, 1);
+	if (!client)
+	{
+		AddClientCache(addr, type);
+	}
+	else
+	{
+		client->type = &client_types[type];
+		client->age = time(NULL);
+	}
+}
+
+/* Find the client type from a device description */
+static int
+ParseClientDescription(char *desc, int len)
+{
+	struct NameValueParserData xml;
+	char *model, *serial, *name;
+	int type = 0;
+
+	ParseNameValue(desc, len, &xml, 0);
 	model = GetValueFromNameValueList(&xml, "modelName");
 	serial = GetValueFromNameValueList(&xml, "serialNumber");
 	name = GetValueFromNameValueList(&xml, "friendlyName");
@@ -465,19 +507,246 @@ close:
 		}
 	}
 	ClearNameValueList(&xml);
-	if (!type)
+
+	return type;
+}
+
+static void
+CloseClientFetch(struct client_fetch *f)
+{
+	if (f->state != EFetchDone)
+		FailLocationCache(f->location, f->addr);
+	event_module.del(&f->ev, EV_FLAG_CLOSING);
+	close(f->ev.fd);
+	LIST_REMOVE(f, entries);
+	nfetches--;
+	free(f);
+}
+
+/* The whole reply is in, or as much of it as fits */
+static void
+FinishClientFetch(struct client_fetch *f)
+{
+	char *p, *body;
+	int type;
+
+	body = strstr(f->buf, "\r\n\r\n");
+	if (!body || strncmp(f->buf, "HTTP/", 5) != 0)
 		return;
-	/* Add this client to the cache if it's not there already. */
-	client = SearchClientCache(dest.sin_addr, 1);
-	if (!client)
+	body += 4;
+	p = f->buf;
+	while (*p != ' ' && *p != '\t')
+		p++;
+	/* If we don't get a 200 status, ignore it */
+	if (strtol(p, NULL, 10) != 200)
+		return;
+	type = ParseClientDescription(body, f->buf + f->len - body);
+	AddLocationCache(f->location, f->addr, type);
+	SetClientType(f->addr, type);
+	f->state = EFetchDone;
+}
+
+/* Is the reply complete, going by its Content-Length? */
+static int
+ClientFetchComplete(struct client_fetch *f)
+{
+	char *body, *p;
+
+	body = strstr(f->buf, "\r\n\r\n");
+	if (!body)
+		return 0;
+	body += 4;
+	*(body - 2) = '\0';
+	p = strcasestr(f->buf, "Content-Length:");
+	*(body - 2) = '\r';
+	if (!p)
+		return 0;
+
+	return (f->buf + f->len - body) >= strtol(p+15, NULL, 10);
+}
+
+static void
+ProcessClientFetch(struct event *ev)
+{
+	struct client_fetch *f = ev->data;
+	socklen_t len;
+	int n, err;
+
+	switch (f->state)
 	{
-		AddClientCache(dest.sin_addr, type);
+	case EFetchConnecting:
+		len = sizeof(err);
+		if (getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+		{
+			DPRINTF(E_DEBUG, L_SSDP, "Failed to connect to %s\n", f->location);
+			CloseClientFetch(f);
+			return;
+		}
+		f->state = EFetchSending;
+		/* fall through */
+	case EFetchSending:
+		n = send(ev->fd, f->buf + f->sent, f->len - f->sent, 0);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				CloseClientFetch(f);
+			return;
+		}
+		f->sent += n;
+		if (f->sent < f->len)
+			return;
+		event_module.del(&f->ev, 0);
+		f->ev.rdwr = EVENT_READ;
+		event_module.add(&f->ev);
+		f->state = EFetchReceiving;
+		f->len = 0;
+		f->buf[0] = '\0';
+		break;
+	case EFetchReceiving:
+		n = recv(ev->fd, f->buf + f->len, sizeof(f->buf) - f->len - 1, 0);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				CloseClientFetch(f);
+			return;
+		}
+		f->len += n;
+		f->buf[f->len] = '\0';
+		if (n == 0 || f->len == sizeof(f->buf) - 1 || ClientFetchComplete(f))
+		{
+			FinishClientFetch(f);
+			CloseClientFetch(f);
+		}
+		break;
+	case EFetchDone:
+		break;
 	}
-	else
+}
+
+static void
+ParseUPnPClient(const char *location)
+{
+	char url[LOCATION_MAX_LEN];
+	struct sockaddr_in dest;
+	struct location_cache_s *cached;
+	struct client_fetch *f;
+	char *addr, *path, *port_str;
+	long port = 80;
+	int s;
+
+	cached = SearchLocationCache(location);
+	if (cached && !cached->failures)
 	{
-		client->type = &client_types[type];
-		client->age = time(NULL);
+		SetClientType(cached->addr, cached->type);
+		return;
+	}
+	if (cached && time(NULL) < cached->retry)
+		return;
+	for (f = fetches.lh_first; f != NULL; f = f->entries.le_next)
+	{
+		if (strcmp(f->location, location) == 0)
+			return;
+	}
+	if (nfetches >= FETCH_MAX)
+	{
+		DPRINTF(E_DEBUG, L_SSDP, "Too many device description fetches, skipping %s\n", location);
+		return;
 	}
+
+	if (strncmp(location, "http://", 7) != 0 ||
+	    strlen(location) >= sizeof(url))
+		return;
+	strcpy(url, location);
+	path = url + 7;
+	port_str = strsep(&path, "/");
+	if (!path)
+		return;
+	addr = strsep(&port_str, ":");
+	if (port_str)
+	{
+		port = strtol(port_str, NULL, 10);
+		if (!port)
+			port = 80;
+	}
+
+	memset(&dest, '\0', sizeof(dest));
+	if (!inet_aton(addr, &dest.sin_addr))
+		return;
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+
+	f = calloc(1, sizeof(struct client_fetch));
+	if (!f)
+		return;
+	s = socket(PF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+	{
+		free(f);
+		return;
+	}
+	if (fcntl(s, F_SETFL, O_NONBLOCK) < 0 ||
+	    (connect(s, (struct sockaddr*)&dest, sizeof(struct sockaddr_in)) < 0 &&
+	     errno != EINPROGRESS))
+	{
+		DPRINTF(E_DEBUG, L_SSDP, "Failed to connect to %s\n", location);
+		FailLocationCache(location, dest.sin_addr);
+		close(s);
+		free(f);
+		return;
+	}
+
+	strncpyt(f->location, location, sizeof(f->location));
+	f->addr = dest.sin_addr;
+	f->started = time(NULL);
+	f->state = EFetchConnecting;
+	f->len = snprintf(f->buf, sizeof(f->buf), "GET /%s HTTP/1.0\r\n"
+	                                          "HOST: %s:%ld\r\n\r\n",
+	                                          path, addr, port);
+	f->ev = (struct event ){ .fd = s, .rdwr = EVENT_WRITE, .process = ProcessClientFetch, .data = f };
+	if (event_module.add(&f->ev) != 0)
+	{
+		close(s);
+		free(f);
+		return;
+	}
+	LIST_INSERT_HEAD(&fetches, f, entries);
+	nfetches++;
+}
+
+int
+GetSSDPClients(struct ssdp_client *list, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < LOCATION_CACHE_SLOTS && n < max; i++)
+	{
+		if (!locations[i].age || !locations[i].type)
+			continue;
+		list[n].addr = locations[i].addr;
+		list[n].type = locations[i].type;
+		n++;
+	}
+
+	return n;
+}
+
+int
+ExpireClientFetches(void)
+{
+	struct client_fetch *f, *next;
+	time_t now = time(NULL);
+
+	for (f = fetches.lh_first; f != NULL; f = next)
+	{
+		next = f->entries.le_next;
+		if (now - f->started >= FETCH_TIMEOUT)
+		{
+			DPRINTF(E_DEBUG, L_SSDP, "Timed out fetching %s\n", f->location);
+			CloseClientFetch(f);
+		}
+	}
+
+	return nfetches;
 }
 
 /* ProcessSSDPRequest()
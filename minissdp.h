@@ -41,4 +41,20 @@ int SendSSDPGoodbyes(int s);
 
 int SubmitServicesToMiniSSDPD(const char *host, unsigned short port);
 
+/* ExpireClientFetches()
+ * give up on device description fetches that are taking too long
+ * returns: number of fetches still in progress */
+int ExpireClientFetches(void);
+
+/* clients identified by their device description */
+struct ssdp_client {
+	struct in_addr addr;
+	int type;
+};
+
+/* GetSSDPClients()
+ * fill list with up to max clients identified by their device description
+ * returns: number of clients */
+int GetSSDPClients(struct ssdp_client *list, int max);
+
 #endif
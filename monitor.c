@@ -272,7 +272,7 @@ monitor_remove_file(const char * path)
 		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
 	}
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
+	scan_cache_flush();
 	playlist = is_playlist(path);
 	id = sql_get_text_field(db, "SELECT ID from %s where PATH = '%q'", playlist?"PLAYLISTS":"DETAILS", path);
 	if( !id )
@@ -623,7 +623,7 @@ monitor_remove_directory(int fd, const char * path)
 	int rows, i, ret = 1;
 
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
+	scan_cache_flush();
 	#ifdef HAVE_INOTIFY
 	if( fd > 0 )
 	{
@@ -684,7 +684,8 @@ start_inotify(void)
 	inotify_create_watches(pollfds[0].fd);
 	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce inotify thread priority\n");
-	sqlite3_release_memory(1<<31);
+	/* Only our own cache: the others may have been warmed up on purpose */
+	sqlite3_db_release_memory(db);
 	av_register_all();
 
 	while( !quitting )
@@ -29,6 +29,8 @@
 #include <ctype.h>
 #include <stdint.h>
 
+#include <sqlite3.h>
+
 /* states: S_N: normal, S_I: comparing integral part, S_F: comparing
    fractional parts, S_Z: idem but with leading Zeroes only */
 #define  S_N    0x0
@@ -44,14 +46,20 @@
 #undef isdigit
 #define isdigit(a) ((unsigned)((a) - '0') <= 9)
 
+/* SQLite doesn't NUL-terminate the strings it passes to collations */
+#define AT(p, e)   ((p) < (e) ? *(p) : '\0')
+#define NEXT(p, e) ((p) < (e) ? tolower(*(p)++) : '\0')
+
 /* Compare S1 and S2 as strings holding indices/version numbers,
    returning less than, equal to or greater than zero if S1 is less than,
    equal to or greater than S2 (for more info, see the texinfo doc).
 */
-static int strverscasecmp (const char *s1, const char *s2)
+static int strverscasecmp (const char *s1, int len1, const char *s2, int len2)
 {
   const unsigned char *p1 = (const unsigned char *) s1;
   const unsigned char *p2 = (const unsigned char *) s2;
+  const unsigned char *e1 = p1 + len1;
+  const unsigned char *e2 = p2 + len2;
   unsigned char c1, c2;
   int state;
   int diff;
@@ -82,28 +90,25 @@ static int strverscasecmp (const char *s1, const char *s2)
                  -1,  CMP, CMP, CMP
   };
 
-  if (p1 == p2)
+  if (p1 == p2 && len1 == len2)
     return 0;
 
-  c1 = *p1;
-  c2 = *p2;
-
   /* Skip leading spaces. */
-  while (isspace(c1))
-    c1 = *++p1;
-  while (isspace(c2))
-    c2 = *++p2;
+  while (isspace(AT(p1, e1)))
+    p1++;
+  while (isspace(AT(p2, e2)))
+    p2++;
 
-  c1 = tolower(*p1++);
-  c2 = tolower(*p2++);
+  c1 = NEXT(p1, e1);
+  c2 = NEXT(p2, e2);
   /* Hint: '0' is a digit too.  */
   state = S_N | ((c1 == '0') + (isdigit (c1) != 0));
 
   while ((diff = c1 - c2) == 0 && c1 != '\0')
     {
       state = next_state[state];
-      c1 = tolower(*p1++);
-      c2 = tolower(*p2++);
+      c1 = NEXT(p1, e1);
+      c2 = NEXT(p2, e2);
       state |= (c1 == '0') + (isdigit (c1) != 0);
     }
 
@@ -115,11 +120,15 @@ static int strverscasecmp (const char *s1, const char *s2)
       return diff;
 
     case LEN:
-      while (isdigit (*p1++))
-	if (!isdigit (*p2++))
-	  return 1;
+      while (isdigit (AT(p1, e1)))
+	{
+	  p1++;
+	  if (!isdigit (AT(p2, e2)))
+	    return 1;
+	  p2++;
+	}
 
-      return isdigit (*p2) ? -1 : diff;
+      return isdigit (AT(p2, e2)) ? -1 : diff;
 
     default:
       return state;
@@ -129,5 +138,83 @@ static int strverscasecmp (const char *s1, const char *s2)
 int
 naturalsort(void *arg, int len1, const void *data1, int len2, const void *data2)
 {
-  return strverscasecmp((const char *)data1, (const char *)data2);
+  return strverscasecmp((const char *)data1, len1, (const char *)data2, len2);
+}
+
+/* Write to KEY a string whose plain binary order follows the collation
+   above, so that natural order can be read from an index.  Leading
+   spaces are skipped, case is folded and every run of digits is
+   prefixed by its kind and length.  Runs with leading zeros compare
+   digit by digit after the zeros, which only differs from
+   strverscasecmp() for two such runs that first differ in two non-zero
+   digits.  KEY must hold 3 * LEN + 1 bytes.  Returns the key length. */
+static int
+make_sort_key (const char *s, int len, char *key)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  const unsigned char *e = p + len;
+  char *k = key;
+  int n, z;
+
+  while (isspace (AT(p, e)))
+    p++;
+
+  while (p < e)
+    {
+      if (!isdigit (*p))
+	{
+	  *k++ = tolower (*p++);
+	  continue;
+	}
+      for (n = 1; isdigit (AT(p + n, e)); n++)
+	;
+      if (*p == '0' && n > 1)
+	{
+	  /* More zeros sort first, zeros alone after any digits */
+	  for (z = 1; z < n && p[z] == '0'; z++)
+	    ;
+	  *k++ = '0';
+	  *k++ = '~' - (z < 93 ? z : 93);
+	  memcpy (k, p + z, n - z);
+	  k += n - z;
+	  if (z == n)
+	    *k++ = ':';
+	}
+      else
+	{
+	  /* Longer numbers are bigger */
+	  *k++ = '1';
+	  *k++ = '!' + (n < 93 ? n : 93);
+	  memcpy (k, p, n);
+	  k += n;
+	}
+      p += n;
+    }
+  *k = '\0';
+
+  return k - key;
+}
+
+void
+naturalsort_key(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  const char *s;
+  char *key;
+  int len;
+
+  if (sqlite3_value_type (argv[0]) == SQLITE_NULL)
+    {
+      sqlite3_result_null (context);
+      return;
+    }
+  s = (const char *) sqlite3_value_text (argv[0]);
+  len = sqlite3_value_bytes (argv[0]);
+  key = sqlite3_malloc (3 * len + 1);
+  if (!key)
+    {
+      sqlite3_result_error_nomem (context);
+      return;
+    }
+  len = make_sort_key (s, len, key);
+  sqlite3_result_text (context, key, len, sqlite3_free);
 }
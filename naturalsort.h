@@ -18,6 +18,9 @@
 #ifndef __NATURALSORT_H__
 #define __NATURALSORT_H__
 
+#include <sqlite3.h>
+
 int naturalsort(void *arg, int len1, const void *data1, int len2, const void *data2);
+void naturalsort_key(sqlite3_context *context, int argc, sqlite3_value **argv);
 
 #endif /* __NATURALSORT_H__ */
@@ -68,6 +68,20 @@ static const struct {
 	{ WIDE_LINKS, "wide_links" },
 	{ TIVO_DISCOVERY, "tivo_discovery" },
 	{ ENABLE_SUBTITLES, "enable_subtitles" },
+	{ WORKER_THREADS, "worker_threads" },
+	{ HTTP_PROCESSES, "http_processes" },
+	{ LISTEN_BACKLOG, "listen_backlog" },
+	{ ACCEPT_BATCH, "accept_batch" },
+	{ RESPONSE_CACHE_SIZE, "response_cache_size" },
+	{ WAL_CHECKPOINT, "wal_checkpoint" },
+	{ DB_PAGE_SIZE, "db_page_size" },
+	{ DB_CACHE_SIZE, "db_cache_size" },
+	{ DB_READER_CACHE_SIZE, "db_reader_cache_size" },
+	{ DB_MMAP_SIZE, "db_mmap_size" },
+	{ DB_TEMP_STORE, "db_temp_store" },
+	{ DB_HEAP_LIMIT, "db_heap_limit" },
+	{ DB_WARMUP, "db_warmup" },
+	{ SCAN_THREADS, "scan_threads" },
 };
 
 int
@@ -61,6 +61,20 @@ enum upnpconfigoptions {
 	WIDE_LINKS,			/* allow following symlinks outside the defined media_dirs */
 	TIVO_DISCOVERY,			/* TiVo discovery protocol: bonjour or beacon. Defaults to bonjour if supported */
 	ENABLE_SUBTITLES,		/* Enable generic subtitle support for all clients by default */
+	WORKER_THREADS,			/* number of threads running Browse/Search actions */
+	HTTP_PROCESSES,			/* number of processes serving HTTP on a shared port */
+	LISTEN_BACKLOG,			/* listen() backlog of the HTTP socket */
+	ACCEPT_BATCH,			/* max connections accepted per listen event */
+	RESPONSE_CACHE_SIZE,		/* KiB of Browse/Search responses to keep */
+	WAL_CHECKPOINT,			/* WAL pages between checkpoints by the writers */
+	DB_PAGE_SIZE,			/* page size of a new database */
+	DB_CACHE_SIZE,			/* KiB of page cache per database connection */
+	DB_READER_CACHE_SIZE,		/* KiB of page cache per read-only connection */
+	DB_MMAP_SIZE,			/* MiB of the database to access through mmap() */
+	DB_TEMP_STORE,			/* where SQLite keeps temporary tables: file or memory */
+	DB_HEAP_LIMIT,			/* KiB of heap SQLite should stay under */
+	DB_WARMUP,			/* read the database indexes in at startup */
+	SCAN_THREADS,			/* number of threads reading metadata during a scan */
 };
 
 /* readoptionsfile()
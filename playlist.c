@@ -159,10 +159,10 @@ fill_playlists(void)
 		{
 			detailID = GetFolderMetadata(plname, NULL, NULL, NULL, 0);
 			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME) "
+			             " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME, TITLE_KEY) "
 			             "VALUES"
-			             " ('%s$%llX', '%s', %lld, 'container.%s', '%q')",
-			             MUSIC_PLIST_ID, plID, MUSIC_PLIST_ID, detailID, class, plname);
+			             " ('%s$%llX', '%s', %lld, 'container.%s', '%q', " SQL_TITLE_KEY("%lld") ")",
+			             MUSIC_PLIST_ID, plID, MUSIC_PLIST_ID, detailID, class, plname, detailID);
 		}
 
 		plpath = dirname(plpath);
@@ -221,9 +221,9 @@ retry:
 found:
 				DPRINTF(E_DEBUG, L_SCANNER, "+ %s found in db\n", fname);
 				sql_exec(db, "INSERT into OBJECTS"
-				             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME, REF_ID) "
+				             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME, REF_ID, TITLE_KEY) "
 				             "SELECT"
-				             " '%s$%llX$%d', '%s$%llX', CLASS, DETAIL_ID, NAME, OBJECT_ID from OBJECTS"
+				             " '%s$%llX$%d', '%s$%llX', CLASS, DETAIL_ID, NAME, OBJECT_ID, TITLE_KEY from OBJECTS"
 				             " where DETAIL_ID = %lld and OBJECT_ID glob '" BROWSEDIR_ID "$*'",
 				             MUSIC_PLIST_ID, plID, plist.track,
 				             MUSIC_PLIST_ID, plID,
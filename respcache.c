@@ -0,0 +1,208 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * LRU cache of Browse and Search responses.  Control points repeat the
+ * same requests over and over, so a hit skips SQLite and DIDL-Lite
+ * generation entirely.  Everything is dropped as soon as the database
+ * changes.  SystemUpdateID is part of the key, since it shows in the
+ * response and lags behind the database.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "respcache.h"
+
+#define RESPCACHE_BUCKETS	256
+
+struct entry {
+	LIST_ENTRY(entry) hash;
+	TAILQ_ENTRY(entry) lru;
+	unsigned int hval;
+	size_t size;
+	size_t len;
+	char *key;
+	char data[];
+};
+
+static LIST_HEAD(, entry) buckets[RESPCACHE_BUCKETS];
+static TAILQ_HEAD(entry_lru, entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t budget;
+static struct respcache_stats stats;
+static unsigned int generation;
+/* db_changes() of this thread's connection when it last looked */
+static __thread int seen_changes = -1;
+
+static unsigned int
+hash_key(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+	return h;
+}
+
+static void
+remove_entry(struct entry *e)
+{
+	LIST_REMOVE(e, hash);
+	TAILQ_REMOVE(&lru, e, lru);
+	stats.entries--;
+	stats.bytes -= e->size;
+	free(e);
+}
+
+/* Each thread compares the counter of its own connection, which is
+ * the only one it can read without I/O.  The first thread to see a
+ * change drops everything; the others flush again when they see it,
+ * which costs little since the cache is empty by then. */
+void
+respcache_sync(int changes)
+{
+	struct entry *e;
+
+	if (!budget || changes == seen_changes)
+		return;
+	seen_changes = changes;
+
+	pthread_mutex_lock(&lock);
+	while ((e = TAILQ_FIRST(&lru)))
+		remove_entry(e);
+	generation++;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+respcache_init(size_t size)
+{
+	int i;
+
+	for (i = 0; i < RESPCACHE_BUCKETS; i++)
+		LIST_INIT(&buckets[i]);
+	budget = size;
+}
+
+static char *
+lookup(const char *key, size_t *len, unsigned int *gen, int count)
+{
+	struct entry *e;
+	unsigned int hval;
+	char *data = NULL;
+
+	if (!budget)
+		return NULL;
+	hval = hash_key(key);
+
+	pthread_mutex_lock(&lock);
+	*gen = generation;
+	LIST_FOREACH(e, &buckets[hval % RESPCACHE_BUCKETS], hash)
+	{
+		if (e->hval != hval || strcmp(e->key, key) != 0)
+			continue;
+		data = malloc(e->len);
+		if (!data)
+			break;
+		memcpy(data, e->data, e->len);
+		*len = e->len;
+		TAILQ_REMOVE(&lru, e, lru);
+		TAILQ_INSERT_HEAD(&lru, e, lru);
+		break;
+	}
+	if (count && data)
+		stats.hits++;
+	else if (count)
+		stats.misses++;
+	pthread_mutex_unlock(&lock);
+
+	return data;
+}
+
+char *
+respcache_get(const char *key, size_t *len, unsigned int *gen)
+{
+	return lookup(key, len, gen, 1);
+}
+
+char *
+respcache_peek(const char *key, size_t *len, unsigned int *gen)
+{
+	return lookup(key, len, gen, 0);
+}
+
+void
+respcache_put(const char *key, const char *data, size_t len, unsigned int gen)
+{
+	struct entry *e, *old;
+	size_t keylen, size;
+	unsigned int hval;
+
+	if (!budget)
+		return;
+	keylen = strlen(key) + 1;
+	size = sizeof(struct entry) + len + keylen;
+	/* One huge result should not flush everything else */
+	if (size > budget / 8)
+		return;
+	e = malloc(size);
+	if (!e)
+		return;
+	hval = hash_key(key);
+	e->hval = hval;
+	e->size = size;
+	e->len = len;
+	memcpy(e->data, data, len);
+	e->key = e->data + len;
+	memcpy(e->key, key, keylen);
+
+	pthread_mutex_lock(&lock);
+	/* Built from a library that has changed since */
+	if (gen != generation)
+	{
+		pthread_mutex_unlock(&lock);
+		free(e);
+		return;
+	}
+	LIST_FOREACH(old, &buckets[hval % RESPCACHE_BUCKETS], hash)
+	{
+		if (old->hval == hval && strcmp(old->key, key) == 0)
+		{
+			remove_entry(old);
+			break;
+		}
+	}
+	while (stats.bytes + size > budget && (old = TAILQ_LAST(&lru, entry_lru)))
+		remove_entry(old);
+	LIST_INSERT_HEAD(&buckets[hval % RESPCACHE_BUCKETS], e, hash);
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	stats.entries++;
+	stats.bytes += size;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+respcache_get_stats(struct respcache_stats *st)
+{
+	pthread_mutex_lock(&lock);
+	*st = stats;
+	pthread_mutex_unlock(&lock);
+	st->budget = budget;
+}
@@ -0,0 +1,59 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RESPCACHE_H__
+#define __RESPCACHE_H__
+
+#include <stddef.h>
+
+struct respcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long entries;
+	size_t bytes;
+	size_t budget;
+};
+
+/* respcache_init()
+ * set the memory budget in bytes; 0 disables the cache */
+void respcache_init(size_t size);
+
+/* respcache_sync()
+ * drop everything if the database changed; changes is db_changes() of
+ * the calling thread's connection.  Call it before respcache_get(). */
+void respcache_sync(int changes);
+
+/* respcache_get()
+ * look up the response stored for key.  gen is set to the current
+ * generation of the cache, to be passed back to respcache_put().
+ * returns: malloc()ed copy of the response, or NULL on a miss */
+char *respcache_get(const char *key, size_t *len, unsigned int *gen);
+
+/* respcache_peek()
+ * respcache_get() for entries that are not responses, like the
+ * TotalMatches of a Search: it leaves the hit/miss counters alone */
+char *respcache_peek(const char *key, size_t *len, unsigned int *gen);
+
+/* respcache_put()
+ * store the response for key, evicting the least recently used ones.
+ * It is dropped if the library changed since respcache_get() gave gen. */
+void respcache_put(const char *key, const char *data, size_t len, unsigned int gen);
+
+/* respcache_get_stats()
+ * hit/miss counters and memory use of this process */
+void respcache_get_stats(struct respcache_stats *st);
+
+#endif
@@ -20,10 +20,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
 #include <locale.h>
+#include <pthread.h>
+#include <signal.h>
 #include <libgen.h>
 #include <inttypes.h>
 #include <sys/param.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -57,14 +61,107 @@ typedef struct dirent scan_filter;
 #define AV_LOG_PANIC AV_LOG_FATAL
 #endif
 
-int valid_cache = 0;
+/* The initial scan commits every this many files, or this often,
+ * whichever comes first */
+#define SCAN_BATCH_FILES	1000
+#define SCAN_BATCH_MSEC		1000
+
+/* Lookups the scanner would otherwise repeat for nearly every file:
+ * the next free child ID of each virtual container, the containers
+ * themselves by name, and the directories already mirrored into the
+ * media type trees.  They are filled from the database on a miss, so
+ * anything that deletes objects must call scan_cache_flush(). */
+#define SCAN_CACHE_BUCKETS	4096
+
+struct scan_cache_entry {
+	LIST_ENTRY(scan_cache_entry) hash;
+	unsigned int hval;
+	int64_t value;
+	char key[];
+};
+LIST_HEAD(scan_cache, scan_cache_entry);
 
-struct virtual_item
-{
-	int64_t objectID;
-	char parentID[64];
+static struct scan_cache *next_ids;	/* container ID -> next child */
+static struct scan_cache *containers;	/* parent, class, name, artist -> container */
+static struct scan_cache *dirs;		/* mirrored directory IDs */
+static struct {
 	char name[256];
-};
+	char id[64];
+} last_album;
+
+static int batch_files;
+static struct timeval batch_start;
+
+static unsigned int
+scan_cache_hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+	return h;
+}
+
+/* Returns the value stored for key, adding it as -1 if it is missing.
+ * NULL means there was no memory for a new entry. */
+static int64_t *
+scan_cache_lookup(struct scan_cache **cache, const char *key)
+{
+	struct scan_cache_entry *e;
+	unsigned int hval = scan_cache_hash(key);
+	size_t len;
+
+	if( !*cache )
+	{
+		*cache = calloc(SCAN_CACHE_BUCKETS, sizeof(**cache));
+		if( !*cache )
+			return NULL;
+	}
+	LIST_FOREACH(e, &(*cache)[hval % SCAN_CACHE_BUCKETS], hash)
+	{
+		if( e->hval == hval && strcmp(e->key, key) == 0 )
+			return &e->value;
+	}
+	len = strlen(key) + 1;
+	e = malloc(sizeof(*e) + len);
+	if( !e )
+		return NULL;
+	e->hval = hval;
+	e->value = -1;
+	memcpy(e->key, key, len);
+	LIST_INSERT_HEAD(&(*cache)[hval % SCAN_CACHE_BUCKETS], e, hash);
+
+	return &e->value;
+}
+
+static void
+scan_cache_free(struct scan_cache **cache)
+{
+	struct scan_cache_entry *e;
+	int i;
+
+	if( !*cache )
+		return;
+	for( i = 0; i < SCAN_CACHE_BUCKETS; i++ )
+	{
+		while( (e = LIST_FIRST(&(*cache)[i])) )
+		{
+			LIST_REMOVE(e, hash);
+			free(e);
+		}
+	}
+	free(*cache);
+	*cache = NULL;
+}
+
+void
+scan_cache_flush(void)
+{
+	scan_cache_free(&next_ids);
+	scan_cache_free(&containers);
+	scan_cache_free(&dirs);
+	last_album.id[0] = '\0';
+}
 
 int64_t
 get_next_available_id(const char *table, const char *parentID)
@@ -86,73 +183,184 @@ get_next_available_id(const char *table, const char *parentID)
 		return objectID;
 }
 
-int
+/* Hand out the next child ID of a virtual container */
+static int64_t
+next_object_id(const char *parentID)
+{
+	int64_t *next = scan_cache_lookup(&next_ids, parentID);
+
+	if( !next )
+		return get_next_available_id("OBJECTS", parentID);
+	if( *next < 0 )
+		*next = get_next_available_id("OBJECTS", parentID);
+
+	return (*next)++;
+}
+
+/* Add a row to OBJECTS.  Every kind of object goes through the one
+ * statement, with a NULL refID or name left at the column default. */
+static int
+insert_object(const char *objectID, const char *parentID, const char *refID,
+              const char *class, int64_t detailID, const char *name)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = sql_prepare(db, "INSERT into OBJECTS"
+	                       " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME, TITLE_KEY) "
+	                       "VALUES (?, ?, ?, ?, ?, ?, " SQL_TITLE_KEY("?5") ")");
+	if( !stmt )
+		return SQLITE_ERROR;
+	sqlite3_bind_text(stmt, 1, objectID, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, parentID, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, refID, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, class, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 5, detailID);
+	sqlite3_bind_text(stmt, 6, name, -1, SQLITE_STATIC);
+
+	return sql_exec_stmt(stmt);
+}
+
+static int
+object_exists(const char *objectID)
+{
+	sqlite3_stmt *stmt;
+	int ret;
+
+	stmt = sql_prepare(db, "SELECT 1 from OBJECTS where OBJECT_ID = ?");
+	if( !stmt )
+		return 0;
+	sqlite3_bind_text(stmt, 1, objectID, -1, SQLITE_STATIC);
+	ret = (sql_step(stmt) == SQLITE_ROW);
+	sql_finish(stmt);
+
+	return ret;
+}
+
+/* DETAIL_ID of an object, or 0 */
+static int64_t
+get_detail_id(const char *objectID)
+{
+	sqlite3_stmt *stmt;
+	int64_t detailID = 0;
+
+	stmt = sql_prepare(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?");
+	if( !stmt )
+		return 0;
+	sqlite3_bind_text(stmt, 1, objectID, -1, SQLITE_STATIC);
+	if( sql_step(stmt) == SQLITE_ROW )
+		detailID = sqlite3_column_int64(stmt, 0);
+	sql_finish(stmt);
+
+	return detailID;
+}
+
+/* Find or create the container for item under rootParent, and return
+ * its object ID in id.  Names and artists match case insensitively,
+ * like the database lookup does. */
+static int
 insert_container(const char *item, const char *rootParent, const char *refID, const char *class,
-                 const char *artist, const char *genre, const char *album_art, int64_t *objectID, int64_t *parentID)
+                 const char *artist, const char *genre, const char *album_art, char *id, size_t len)
 {
-	char *result;
+	sqlite3_stmt *stmt;
+	const char *result;
+	char container[64];
 	char *base;
+	char *key, *p;
+	int64_t *cached = NULL, *next;
+	int64_t parentID = 0;
+	int found = 0, created = 0;
 	int ret = 0;
 
-	result = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o "
-					"left join DETAILS d on (o.DETAIL_ID = d.ID)"
-					" where o.PARENT_ID = '%s'"
-					" and o.NAME like '%q'"
-					" and d.ARTIST %s %Q"
-					" and o.CLASS = 'container.%s' limit 1",
-					rootParent, item, artist?"like":"is", artist, class);
-	if( result )
-	{
-		base = strrchr(result, '$');
-		if( base )
-			*parentID = strtoll(base+1, NULL, 16);
-		else
-			*parentID = 0;
-		*objectID = get_next_available_id("OBJECTS", result);
+	xasprintf(&key, "%s\x1f%s\x1f%s\x1f%c%s", rootParent, class, item,
+	          artist ? '=' : '-', artist ? artist : "");
+	if( key )
+	{
+		for( p = key; *p; p++ )
+		{
+			if( *p >= 'A' && *p <= 'Z' )
+				*p += 'a' - 'A';
+		}
+		cached = scan_cache_lookup(&containers, key);
+		free(key);
 	}
-	else
+	if( cached && *cached >= 0 )
 	{
-		int64_t detailID = 0;
-		*objectID = 0;
-		*parentID = get_next_available_id("OBJECTS", rootParent);
-		if( refID )
+		snprintf(id, len, "%s$%llX", rootParent, (long long)*cached);
+		return 0;
+	}
+
+	stmt = sql_prepare(db, artist ?
+	                       "SELECT OBJECT_ID from OBJECTS o "
+	                       "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                       " where o.PARENT_ID = ? and o.NAME like ? and d.ARTIST like ?"
+	                       " and o.CLASS = ? limit 1" :
+	                       "SELECT OBJECT_ID from OBJECTS o "
+	                       "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                       " where o.PARENT_ID = ? and o.NAME like ? and d.ARTIST is ?"
+	                       " and o.CLASS = ? limit 1");
+	snprintf(container, sizeof(container), "container.%s", class);
+	if( stmt )
+	{
+		sqlite3_bind_text(stmt, 1, rootParent, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, item, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, artist, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, container, -1, SQLITE_STATIC);
+		if( sql_step(stmt) == SQLITE_ROW &&
+		    (result = (const char *)sqlite3_column_text(stmt, 0)) )
 		{
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = %Q", refID);
-			if( result )
-				detailID = strtoll(result, NULL, 10);
+			base = strrchr(result, '$');
+			if( base )
+				parentID = strtoll(base+1, NULL, 16);
+			found = 1;
 		}
+		sql_finish(stmt);
+	}
+	if( !found )
+	{
+		int64_t detailID = 0;
+		char objectID[128];
+		created = 1;
+		parentID = next_object_id(rootParent);
+		if( refID )
+			detailID = get_detail_id(refID);
 		if( !detailID )
 		{
 			detailID = GetFolderMetadata(item, NULL, artist, genre, (album_art ? strtoll(album_art, NULL, 10) : 0));
 		}
-		ret = sql_exec(db, "INSERT into OBJECTS"
-		                   " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
-		                   "VALUES"
-		                   " ('%s$%llX', '%s', %Q, %lld, 'container.%s', '%q')",
-		                   rootParent, (long long)*parentID, rootParent,
-		                   refID, (long long)detailID, class, item);
+		snprintf(objectID, sizeof(objectID), "%s$%llX", rootParent, (long long)parentID);
+		ret = insert_object(objectID, rootParent, refID, container, detailID, item);
 	}
-	sqlite3_free(result);
+	if( cached && ret == SQLITE_OK )
+		*cached = parentID;
+	snprintf(id, len, "%s$%llX", rootParent, (long long)parentID);
+	/* A new container starts out empty */
+	if( created && ret == SQLITE_OK && (next = scan_cache_lookup(&next_ids, id)) )
+		*next = 0;
 
 	return ret;
 }
 
+static void
+insert_virtual_item(const char *parentID, const char *refID, const char *class, int64_t detailID, const char *name)
+{
+	char objectID[128];
+
+	snprintf(objectID, sizeof(objectID), "%s$%llX", parentID, (long long)next_object_id(parentID));
+	insert_object(objectID, parentID, refID, class, detailID, name);
+}
+
 static void
 insert_containers(const char *name, const char *path, const char *refID, const char *class, int64_t detailID)
 {
 	char sql[128];
 	char **result;
+	char id[64], parent[64], all[64];
 	int ret;
 	int cols, row;
-	int64_t objectID, parentID;
 
 	if( strstr(class, "imageItem") )
 	{
 		char *date_taken = NULL, *camera = NULL;
-		static struct virtual_item last_date;
-		static struct virtual_item last_cam;
-		static struct virtual_item last_camdate;
-		static long long last_all_objectID = 0;
 
 		snprintf(sql, sizeof(sql), "SELECT DATE, CREATOR from DETAILS where ID = %lld", (long long)detailID);
 		ret = sql_get_table(db, sql, &result, &row, &cols);
@@ -168,61 +376,13 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		if( !camera )
 			camera = _("Unknown Camera");
 
-		if( valid_cache && strcmp(last_date.name, date_taken) == 0 )
-		{
-			last_date.objectID++;
-			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last date item: %s/%s/%X\n", last_date.name, last_date.parentID, last_date.objectID);
-		}
-		else
-		{
-			insert_container(date_taken, IMAGE_DATE_ID, NULL, "album.photoAlbum", NULL, NULL, NULL, &objectID, &parentID);
-			sprintf(last_date.parentID, IMAGE_DATE_ID"$%llX", (unsigned long long)parentID);
-			last_date.objectID = objectID;
-			strncpyt(last_date.name, date_taken, sizeof(last_date.name));
-			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached date item: %s/%s/%X\n", last_date.name, last_date.parentID, last_date.objectID);
-		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-		             last_date.parentID, (long long)last_date.objectID, last_date.parentID, refID, class, (long long)detailID, name);
-
-		if( !valid_cache || strcmp(camera, last_cam.name) != 0 )
-		{
-			insert_container(camera, IMAGE_CAMERA_ID, NULL, "storageFolder", NULL, NULL, NULL, &objectID, &parentID);
-			sprintf(last_cam.parentID, IMAGE_CAMERA_ID"$%llX", (long long)parentID);
-			strncpyt(last_cam.name, camera, sizeof(last_cam.name));
-			/* Invalidate last_camdate cache */
-			last_camdate.name[0] = '\0';
-		}
-		if( valid_cache && strcmp(last_camdate.name, date_taken) == 0 )
-		{
-			last_camdate.objectID++;
-			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last camdate item: %s/%s/%s/%X\n", camera, last_camdate.name, last_camdate.parentID, last_camdate.objectID);
-		}
-		else
-		{
-			insert_container(date_taken, last_cam.parentID, NULL, "album.photoAlbum", NULL, NULL, NULL, &objectID, &parentID);
-			sprintf(last_camdate.parentID, "%s$%llX", last_cam.parentID, (long long)parentID);
-			last_camdate.objectID = objectID;
-			strncpyt(last_camdate.name, date_taken, sizeof(last_camdate.name));
-			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached camdate item: %s/%s/%s/%X\n", camera, last_camdate.name, last_camdate.parentID, last_camdate.objectID);
-		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-		             last_camdate.parentID, last_camdate.objectID, last_camdate.parentID, refID, class, (long long)detailID, name);
+		insert_container(date_taken, IMAGE_DATE_ID, NULL, "album.photoAlbum", NULL, NULL, NULL, id, sizeof(id));
+		insert_virtual_item(id, refID, class, detailID, name);
+		insert_container(camera, IMAGE_CAMERA_ID, NULL, "storageFolder", NULL, NULL, NULL, parent, sizeof(parent));
+		insert_container(date_taken, parent, NULL, "album.photoAlbum", NULL, NULL, NULL, id, sizeof(id));
+		insert_virtual_item(id, refID, class, detailID, name);
 		/* All Images */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", IMAGE_ALL_ID);
-		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"IMAGE_ALL_ID"$%llX', '"IMAGE_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_virtual_item(IMAGE_ALL_ID, refID, class, detailID, name);
 	}
 	else if( strstr(class, "audioItem") )
 	{
@@ -237,143 +397,47 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		}
 		char *album = result[4], *artist = result[5], *genre = result[6];
 		char *album_art = result[7];
-		static struct virtual_item last_album;
-		static struct virtual_item last_artist;
-		static struct virtual_item last_artistAlbum;
-		static struct virtual_item last_artistAlbumAll;
-		static struct virtual_item last_genre;
-		static struct virtual_item last_genreArtist;
-		static struct virtual_item last_genreArtistAll;
-		static long long last_all_objectID = 0;
+		char artist_id[64];
 
 		if( album )
 		{
-			if( valid_cache && strcmp(album, last_album.name) == 0 )
-			{
-				last_album.objectID++;
-				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last album item: %s/%s/%X\n", last_album.name, last_album.parentID, last_album.objectID);
-			}
-			else
+			/* Consecutive tracks of an album stay together even if
+			 * their artists differ, as they do on compilations */
+			if( !last_album.id[0] || strcmp(album, last_album.name) != 0 )
 			{
 				strncpyt(last_album.name, album, sizeof(last_album.name));
-				insert_container(album, MUSIC_ALBUM_ID, NULL, "album.musicAlbum", artist, genre, album_art, &objectID, &parentID);
-				sprintf(last_album.parentID, MUSIC_ALBUM_ID"$%llX", (long long)parentID);
-				last_album.objectID = objectID;
-				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached album item: %s/%s/%X\n", last_album.name, last_album.parentID, last_album.objectID);
+				insert_container(album, MUSIC_ALBUM_ID, NULL, "album.musicAlbum", artist, genre, album_art,
+				                 last_album.id, sizeof(last_album.id));
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_album.parentID, last_album.objectID, last_album.parentID, refID, class, (long long)detailID, name);
+			insert_virtual_item(last_album.id, refID, class, detailID, name);
 		}
 		if( artist )
 		{
-			if( !valid_cache || strcmp(artist, last_artist.name) != 0 )
-			{
-				insert_container(artist, MUSIC_ARTIST_ID, NULL, "person.musicArtist", NULL, genre, NULL, &objectID, &parentID);
-				sprintf(last_artist.parentID, MUSIC_ARTIST_ID"$%llX", (long long)parentID);
-				strncpyt(last_artist.name, artist, sizeof(last_artist.name));
-				last_artistAlbum.name[0] = '\0';
-				/* Add this file to the "- All Albums -" container as well */
-				insert_container(_("- All Albums -"), last_artist.parentID, NULL, "album", artist, genre, NULL, &objectID, &parentID);
-				sprintf(last_artistAlbumAll.parentID, "%s$%llX", last_artist.parentID, (long long)parentID);
-				last_artistAlbumAll.objectID = objectID;
-			}
-			else
-			{
-				last_artistAlbumAll.objectID++;
-			}
-			if( valid_cache && strcmp(album?album:_("Unknown Album"), last_artistAlbum.name) == 0 )
-			{
-				last_artistAlbum.objectID++;
-				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last artist/album item: %s/%s/%X\n", last_artist.name, last_artist.parentID, last_artist.objectID);
-			}
-			else
-			{
-				insert_container(album?album:_("Unknown Album"), last_artist.parentID, album?last_album.parentID:NULL,
-				                 "album.musicAlbum", artist, genre, album_art, &objectID, &parentID);
-				sprintf(last_artistAlbum.parentID, "%s$%llX", last_artist.parentID, (long long)parentID);
-				last_artistAlbum.objectID = objectID;
-				strncpyt(last_artistAlbum.name, album ? album : _("Unknown Album"), sizeof(last_artistAlbum.name));
-				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached artist/album item: %s/%s/%X\n", last_artist.name, last_artist.parentID, last_artist.objectID);
-			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_artistAlbum.parentID, last_artistAlbum.objectID, last_artistAlbum.parentID, refID, class, (long long)detailID, name);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_artistAlbumAll.parentID, last_artistAlbumAll.objectID, last_artistAlbumAll.parentID, refID, class, (long long)detailID, name);
+			insert_container(artist, MUSIC_ARTIST_ID, NULL, "person.musicArtist", NULL, genre, NULL, artist_id, sizeof(artist_id));
+			/* Add this file to the "- All Albums -" container as well */
+			insert_container(_("- All Albums -"), artist_id, NULL, "album", artist, genre, NULL, all, sizeof(all));
+			insert_container(album?album:_("Unknown Album"), artist_id, album?last_album.id:NULL,
+			                 "album.musicAlbum", artist, genre, album_art, id, sizeof(id));
+			insert_virtual_item(id, refID, class, detailID, name);
+			insert_virtual_item(all, refID, class, detailID, name);
 		}
 		if( genre )
 		{
-			if( !valid_cache || strcmp(genre, last_genre.name) != 0 )
-			{
-				insert_container(genre, MUSIC_GENRE_ID, NULL, "genre.musicGenre", NULL, NULL, NULL, &objectID, &parentID);
-				sprintf(last_genre.parentID, MUSIC_GENRE_ID"$%llX", (long long)parentID);
-				strncpyt(last_genre.name, genre, sizeof(last_genre.name));
-				/* Add this file to the "- All Artists -" container as well */
-				insert_container(_("- All Artists -"), last_genre.parentID, NULL, "person", NULL, genre, NULL, &objectID, &parentID);
-				sprintf(last_genreArtistAll.parentID, "%s$%llX", last_genre.parentID, (long long)parentID);
-				last_genreArtistAll.objectID = objectID;
-			}
-			else
-			{
-				last_genreArtistAll.objectID++;
-			}
-			if( valid_cache && strcmp(artist?artist:_("Unknown Artist"), last_genreArtist.name) == 0 )
-			{
-				last_genreArtist.objectID++;
-			}
-			else
-			{
-				insert_container(artist?artist:_("Unknown Artist"), last_genre.parentID, artist?last_artist.parentID:NULL,
-				                 "person.musicArtist", NULL, genre, NULL, &objectID, &parentID);
-				sprintf(last_genreArtist.parentID, "%s$%llX", last_genre.parentID, (long long)parentID);
-				last_genreArtist.objectID = objectID;
-				strncpyt(last_genreArtist.name, artist ? artist : _("Unknown Artist"), sizeof(last_genreArtist.name));
-				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached genre/artist item: %s/%s/%X\n", last_genreArtist.name, last_genreArtist.parentID, last_genreArtist.objectID);
-			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_genreArtist.parentID, last_genreArtist.objectID, last_genreArtist.parentID, refID, class, (long long)detailID, name);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_genreArtistAll.parentID, last_genreArtistAll.objectID, last_genreArtistAll.parentID, refID, class, (long long)detailID, name);
+			insert_container(genre, MUSIC_GENRE_ID, NULL, "genre.musicGenre", NULL, NULL, NULL, parent, sizeof(parent));
+			/* Add this file to the "- All Artists -" container as well */
+			insert_container(_("- All Artists -"), parent, NULL, "person", NULL, genre, NULL, all, sizeof(all));
+			insert_container(artist?artist:_("Unknown Artist"), parent, artist?artist_id:NULL,
+			                 "person.musicArtist", NULL, genre, NULL, id, sizeof(id));
+			insert_virtual_item(id, refID, class, detailID, name);
+			insert_virtual_item(all, refID, class, detailID, name);
 		}
 		/* All Music */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", MUSIC_ALL_ID);
-		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"MUSIC_ALL_ID"$%llX', '"MUSIC_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_virtual_item(MUSIC_ALL_ID, refID, class, detailID, name);
 	}
 	else if( strstr(class, "videoItem") )
 	{
-		static long long last_all_objectID = 0;
-
 		/* All Videos */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", VIDEO_ALL_ID);
-		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"VIDEO_ALL_ID"$%llX', '"VIDEO_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_virtual_item(VIDEO_ALL_ID, refID, class, detailID, name);
 		return;
 	}
 	else
@@ -381,7 +445,6 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		return;
 	}
 	sqlite3_free_table(result);
-	valid_cache = 1;
 }
 
 int64_t
@@ -389,13 +452,14 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 {
 	int64_t detailID = 0;
 	char class[] = "container.storageFolder";
-	char *result, *p;
-	static char last_found[256] = "-1";
+	char id_buf[64], parent_buf[64];
+	char *p;
 
 	if( strcmp(base, BROWSEDIR_ID) != 0 )
 	{
 		int found = 0;
-		char id_buf[64], parent_buf[64], refID[64];
+		int64_t refDetailID;
+		char refID[64];
 		char *dir_buf, *dir;
 
 		dir_buf = strdup(path);
@@ -405,25 +469,23 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 		snprintf(parent_buf, sizeof(parent_buf), "%s%s", base, parentID);
 		while( !found )
 		{
-			if( valid_cache && strcmp(id_buf, last_found) == 0 )
+			int64_t *known = scan_cache_lookup(&dirs, id_buf);
+
+			if( known && *known >= 0 )
 				break;
-			if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%s'", id_buf) > 0 )
+			if( object_exists(id_buf) )
 			{
-				strcpy(last_found, id_buf);
+				if( known )
+					*known = 1;
 				break;
 			}
 			/* Does not exist.  Need to create, and may need to create parents also */
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s'", refID);
-			if( result )
-			{
-				detailID = strtoll(result, NULL, 10);
-				sqlite3_free(result);
-			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
-			             "VALUES"
-			             " ('%s', '%s', %Q, %lld, '%s', '%q')",
-			             id_buf, parent_buf, refID, detailID, class, strrchr(dir, '/')+1);
+			if( (refDetailID = get_detail_id(refID)) )
+				detailID = refDetailID;
+			if( insert_object(id_buf, parent_buf, refID, class, detailID,
+			                  strrchr(dir, '/')+1) == SQLITE_OK &&
+			    known )
+				*known = 1;
 			if( (p = strrchr(id_buf, '$')) )
 				*p = '\0';
 			if( (p = strrchr(parent_buf, '$')) )
@@ -437,54 +499,97 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	}
 
 	detailID = GetFolderMetadata(name, path, NULL, NULL, find_album_art(path, NULL, 0));
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', %lld, '%s', '%q')",
-	             base, parentID, objectID, base, parentID, detailID, class, name);
+	snprintf(id_buf, sizeof(id_buf), "%s%s$%X", base, parentID, objectID);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", base, parentID);
+	insert_object(id_buf, parent_buf, NULL, class, detailID, name);
 
 	return detailID;
 }
 
-int
-insert_file(const char *name, const char *path, const char *parentID, int object, media_types types)
+/* A file on its way into the database: what read_file() found out
+ * about it, in any thread, for write_file() to insert. */
+struct scan_file
 {
+	const char *name;
+	const char *path;
+	media_types types;
 	const char *class;
-	char objectID[64];
-	int64_t detailID = 0;
 	char base[8];
-	char *typedir_parentID;
-	char *baseid;
-	char *objname;
-	media_types mtype = get_media_type(name);
+	enum { FILE_SKIP, FILE_MEDIA, FILE_PLAYLIST, FILE_BAD } kind;
+	metadata_t m;
+};
 
-	if( mtype == TYPE_IMAGE && (types & TYPE_IMAGE) )
+/* Some file extensions can be used for both audio and video.
+** Fall back to audio on these files if video parsing fails. */
+static void
+read_audio_file(struct scan_file *f)
+{
+	if( (f->types & TYPE_AUDIO) && is_audio(f->name) &&
+	    ReadAudioMetadata(f->path, f->name, &f->m) == 0 )
 	{
-		if( is_album_art(name) )
-			return -1;
-		strcpy(base, IMAGE_DIR_ID);
-		class = "item.imageItem.photo";
-		detailID = GetImageMetadata(path, name);
+		strcpy(f->base, MUSIC_DIR_ID);
+		f->class = "item.audioItem.musicTrack";
+		f->kind = FILE_MEDIA;
 	}
-	else if( mtype == TYPE_VIDEO && (types & TYPE_VIDEO) )
+	else
+		f->kind = FILE_BAD;
+}
+
+static void
+read_file(struct scan_file *f)
+{
+	media_types mtype = get_media_type(f->name);
+
+	f->kind = FILE_BAD;
+	if( mtype == TYPE_IMAGE && (f->types & TYPE_IMAGE) )
 	{
-		strcpy(base, VIDEO_DIR_ID);
-		class = "item.videoItem";
-		detailID = GetVideoMetadata(path, name);
+		if( is_album_art(f->name) )
+		{
+			f->kind = FILE_SKIP;
+			return;
+		}
+		strcpy(f->base, IMAGE_DIR_ID);
+		f->class = "item.imageItem.photo";
+		if( ReadImageMetadata(f->path, f->name, &f->m) == 0 )
+			f->kind = FILE_MEDIA;
 	}
-	else if( mtype == TYPE_PLAYLIST && (types & TYPE_PLAYLIST) )
+	else if( mtype == TYPE_VIDEO && (f->types & TYPE_VIDEO) )
 	{
-		if( insert_playlist(path, name) == 0 )
-			return 1;
+		strcpy(f->base, VIDEO_DIR_ID);
+		f->class = "item.videoItem";
+		if( ReadVideoMetadata(f->path, f->name, &f->m) == 0 )
+			f->kind = FILE_MEDIA;
 	}
-	/* Some file extensions can be used for both audio and video.
-	** Fall back to audio on these files if video parsing fails. */
-	if (!detailID && (types & TYPE_AUDIO) && is_audio(name) )
+	else if( mtype == TYPE_PLAYLIST && (f->types & TYPE_PLAYLIST) )
 	{
-		strcpy(base, MUSIC_DIR_ID);
-		class = "item.audioItem.musicTrack";
-		detailID = GetAudioMetadata(path, name);
+		/* Playlists are read straight into the database */
+		f->kind = FILE_PLAYLIST;
+		return;
+	}
+	if( f->kind == FILE_BAD )
+		read_audio_file(f);
+}
+
+static int
+write_file(struct scan_file *f, const char *parentID, int object)
+{
+	const char *name = f->name, *path = f->path;
+	char objectID[64], id_buf[64], parent_buf[64];
+	int64_t detailID = 0;
+	char *typedir_parentID;
+	char *baseid;
+	char *objname;
+
+	if( f->kind == FILE_SKIP )
+		return -1;
+	if( f->kind == FILE_PLAYLIST )
+	{
+		if( insert_playlist(path, name) == 0 )
+			return 1;
+		read_audio_file(f);
 	}
+	if( f->kind == FILE_MEDIA )
+		detailID = InsertMetadata(path, &f->m);
 	if( !detailID )
 	{
 		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s\n", path);
@@ -495,11 +600,8 @@ insert_file(const char *name, const char *path, const char *parentID, int object
 	objname = strdup(name);
 	strip_ext(objname);
 
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s', '%s%s', '%s', %lld, '%q')",
-	             objectID, BROWSEDIR_ID, parentID, class, detailID, objname);
+	snprintf(id_buf, sizeof(id_buf), "%s%s", BROWSEDIR_ID, parentID);
+	insert_object(objectID, id_buf, NULL, f->class, detailID, objname);
 
 	if( *parentID )
 	{
@@ -511,21 +613,36 @@ insert_file(const char *name, const char *path, const char *parentID, int object
 			typedir_objectID = strtol(baseid+1, NULL, 16);
 			*baseid = '\0';
 		}
-		insert_directory(objname, path, base, typedir_parentID, typedir_objectID);
+		insert_directory(objname, path, f->base, typedir_parentID, typedir_objectID);
 		free(typedir_parentID);
 	}
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', '%s', '%s', %lld, '%q')",
-	             base, parentID, object, base, parentID, objectID, class, detailID, objname);
+	snprintf(id_buf, sizeof(id_buf), "%s%s$%X", f->base, parentID, object);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", f->base, parentID);
+	insert_object(id_buf, parent_buf, objectID, f->class, detailID, objname);
 
-	insert_containers(objname, path, objectID, class, detailID);
+	insert_containers(objname, path, objectID, f->class, detailID);
 	free(objname);
 
 	return 0;
 }
 
+int
+insert_file(const char *name, const char *path, const char *parentID, int object, media_types types)
+{
+	struct scan_file f;
+	int ret;
+
+	memset(&f, 0, sizeof(f));
+	f.name = name;
+	f.path = path;
+	f.types = types;
+	read_file(&f);
+	ret = write_file(&f, parentID, object);
+	clear_metadata(&f.m);
+
+	return ret;
+}
+
 int
 CreateDatabase(void)
 {
@@ -553,11 +670,19 @@ CreateDatabase(void)
 			0 };
 
 	ret = sql_exec(db, create_objectTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = db_create_triggers(db);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_detailTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
+	ret = db_create_sort_keys(db);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	/* Search falls back to scanning DETAILS without it */
+	db_create_fts(db);
 	ret = sql_exec(db, create_albumArtTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
@@ -568,6 +693,10 @@ CreateDatabase(void)
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_playlistTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	/* Its triggers are added once the initial scan is done */
+	ret = sql_exec(db, create_containerUpdatesTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_settingsTable_sqlite);
@@ -578,10 +707,11 @@ CreateDatabase(void)
 		goto sql_failed;
 	for( i=0; containers[i]; i=i+3 )
 	{
-		ret = sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME)"
+		int64_t detailID = GetFolderMetadata(containers[i+2], NULL, NULL, NULL, 0);
+		ret = sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME, TITLE_KEY)"
 		                   " values "
-		                   "('%s', '%s', %lld, 'container.storageFolder', '%q')",
-		                   containers[i], containers[i+1], GetFolderMetadata(containers[i+2], NULL, NULL, NULL, 0), containers[i+2]);
+		                   "('%s', '%s', %lld, 'container.storageFolder', '%q', " SQL_TITLE_KEY("%lld") ")",
+		                   containers[i], containers[i+1], (long long)detailID, containers[i+2], (long long)detailID);
 		if( ret != SQLITE_OK )
 			goto sql_failed;
 	}
@@ -593,13 +723,14 @@ CreateDatabase(void)
 		if( sql_get_int_field(db, "SELECT 1 from OBJECTS where OBJECT_ID = '%s'", magic->objectid_match) == 0 )
 		{
 			char *parent = strdup(magic->objectid_match);
+			int64_t detailID = GetFolderMetadata(_(magic->name), NULL, NULL, NULL, 0);
 			if (strrchr(parent, '$'))
 				*strrchr(parent, '$') = '\0';
-			ret = sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME)"
+			ret = sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME, TITLE_KEY)"
 			                   " values "
-					   "('%s', '%s', %lld, 'container.storageFolder', '%q')",
-					   magic->objectid_match, parent,
-					   GetFolderMetadata(_(magic->name), NULL, NULL, NULL, 0), _(magic->name));
+					   "('%s', '%s', %lld, 'container.storageFolder', '%q', " SQL_TITLE_KEY("%lld") ")",
+					   magic->objectid_match, parent, (long long)detailID,
+					   _(magic->name), (long long)detailID);
 			free(parent);
 			if( ret != SQLITE_OK )
 				goto sql_failed;
@@ -608,7 +739,11 @@ CreateDatabase(void)
 	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
-	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
+	/* Ahead of IDX_OBJECTS_CLASS, which then wins the planner's tie
+	 * for class matches that cannot use the title order */
+	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS_TITLE ON OBJECTS(CLASS, TITLE_KEY, OBJECT_ID, DETAIL_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS, OBJECT_ID, DETAIL_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_TITLE ON OBJECTS(PARENT_ID, TITLE_KEY);");
 	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
 	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
 	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
@@ -718,6 +853,252 @@ filter_avp(scan_filter *d)
 		);
 }
 
+/* Without a transaction of its own, each INSERT is committed alone.
+ * The scan writes in batches instead, and every commit makes the files
+ * scanned so far visible to Browse and Search. */
+static void
+scan_batch_begin(void)
+{
+	batch_files = 0;
+	gettimeofday(&batch_start, 0);
+	sql_exec(db, "BEGIN");
+}
+
+static void
+scan_batch_end(void)
+{
+	if (!sqlite3_get_autocommit(db) && sql_exec(db, "COMMIT") == SQLITE_OK)
+		return;
+	/* An I/O error may have rolled the batch back already, or the
+	 * commit failed.  Either way the rows the scan caches point at
+	 * may be gone. */
+	if (!sqlite3_get_autocommit(db))
+		sql_exec(db, "ROLLBACK");
+	scan_cache_flush();
+}
+
+static void
+scan_batch_next(void)
+{
+	struct timeval now;
+
+	if (++batch_files < SCAN_BATCH_FILES)
+	{
+		gettimeofday(&now, 0);
+		timevalsub(&now, &batch_start);
+		if (now.tv_sec * 1000 + now.tv_usec / 1000 < SCAN_BATCH_MSEC)
+			return;
+	}
+	scan_batch_end();
+	scan_batch_begin();
+}
+
+/* Scan pipeline :
+ * ScanDirectory() walks the tree and queues every entry in order.
+ * A pool of scan_threads reads the metadata of the queued files, and
+ * the scanner thread inserts them from the head of the queue as they
+ * are ready, so the database ends up exactly as a serial scan leaves
+ * it.  Only the scanner thread touches the database. */
+struct scan_job
+{
+	struct scan_job *next;
+	char *parent;		/* parent object ID */
+	int object;		/* object number under parent */
+	int is_dir;
+	int done;		/* metadata read, ready to insert */
+	struct scan_file f;
+	char *path;
+	char *name;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued, or quit */
+	pthread_cond_t ready;	/* a job is done */
+	struct scan_job *head, *tail;
+	struct scan_job *next;	/* first job no thread has taken yet */
+	int queued, max_queued;
+	int quit;
+	pthread_t *threads;
+	int nthreads;
+} pipeline = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.max_queued = 1,
+};
+
+static long long unsigned int files_scanned = 0;
+
+static void *
+scan_thread(void *arg)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&pipeline.lock);
+	for (;;)
+	{
+		while (!pipeline.quit && !pipeline.next)
+			pthread_cond_wait(&pipeline.work, &pipeline.lock);
+		job = pipeline.next;
+		if (!job)
+			break;
+		pipeline.next = job->next;
+		if (job->done)
+			continue;
+		pthread_mutex_unlock(&pipeline.lock);
+
+		read_file(&job->f);
+
+		pthread_mutex_lock(&pipeline.lock);
+		job->done = 1;
+		if (job == pipeline.head)
+			pthread_cond_signal(&pipeline.ready);
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	return NULL;
+}
+
+static void
+scan_threads_start(int count)
+{
+	sigset_t set, oset;
+	int i;
+
+	if (count < 2 || !(pipeline.threads = calloc(count, sizeof(pthread_t))))
+		return;
+	/* Leave signals to the scanner thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (i = 0; i < count; i++)
+	{
+		if (pthread_create(&pipeline.threads[i], NULL, scan_thread, NULL) != 0)
+		{
+			DPRINTF(E_ERROR, L_SCANNER, "pthread_create() failed for scanner: %s\n", strerror(errno));
+			break;
+		}
+		pipeline.nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	/* Enough work queued to keep every thread busy while the head of
+	 * the queue is slow to read */
+	if (pipeline.nthreads)
+		pipeline.max_queued = pipeline.nthreads * 16;
+	DPRINTF(E_INFO, L_SCANNER, "Reading metadata with %d threads\n", pipeline.nthreads);
+}
+
+static void
+scan_threads_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.quit = 1;
+	pthread_cond_broadcast(&pipeline.work);
+	pthread_mutex_unlock(&pipeline.lock);
+	for (i = 0; i < pipeline.nthreads; i++)
+		pthread_join(pipeline.threads[i], NULL);
+	free(pipeline.threads);
+	pipeline.threads = NULL;
+	pipeline.nthreads = 0;
+	pipeline.max_queued = 1;
+	pipeline.quit = 0;
+}
+
+/* Insert the job at the head of the queue, once it has been read */
+static void
+scan_write_one(void)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&pipeline.lock);
+	job = pipeline.head;
+	while (!job->done)
+		pthread_cond_wait(&pipeline.ready, &pipeline.lock);
+	pipeline.head = job->next;
+	if (!pipeline.head)
+		pipeline.tail = NULL;
+	/* Directories are done without any thread taking them */
+	if (pipeline.next == job)
+		pipeline.next = job->next;
+	pipeline.queued--;
+	pthread_mutex_unlock(&pipeline.lock);
+
+	if (job->is_dir)
+		insert_directory(job->name, job->path, BROWSEDIR_ID, job->parent, job->object);
+	else
+	{
+		if (write_file(&job->f, job->parent, job->object) == 0)
+			files_scanned++;
+		scan_batch_next();
+		clear_metadata(&job->f.m);
+	}
+	free(job->parent);
+	free(job->path);
+	free(job->name);
+	free(job);
+}
+
+static void
+scan_flush(void)
+{
+	while (pipeline.head)
+		scan_write_one();
+}
+
+/* Queue an entry; name and path are taken over */
+static void
+scan_queue(char *name, char *path, const char *parent, int object, media_types types, int is_dir)
+{
+	struct scan_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->parent = strdup(parent);
+	if (!job || !job->parent || !path)
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", name);
+		if (job)
+			free(job->parent);
+		free(job);
+		free(name);
+		free(path);
+		return;
+	}
+	job->object = object;
+	job->is_dir = is_dir;
+	job->name = name;
+	job->path = path;
+	job->f.name = name;
+	job->f.path = path;
+	job->f.types = types;
+	if (is_dir)
+		job->done = 1;
+	else if (!pipeline.nthreads)
+	{
+		read_file(&job->f);
+		job->done = 1;
+	}
+
+	pthread_mutex_lock(&pipeline.lock);
+	if (pipeline.tail)
+		pipeline.tail->next = job;
+	else
+		pipeline.head = job;
+	pipeline.tail = job;
+	if (!pipeline.next)
+		pipeline.next = job;
+	pipeline.queued++;
+	if (!job->done)
+		pthread_cond_signal(&pipeline.work);
+	pthread_mutex_unlock(&pipeline.lock);
+
+	while (pipeline.queued >= pipeline.max_queued)
+		scan_write_one();
+}
+
 static void
 ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 {
@@ -725,7 +1106,6 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 	int i, n, startID = 0;
 	char *full_path;
 	char *name = NULL;
-	static long long unsigned int fileno = 0;
 	enum file_types type;
 
 
@@ -801,24 +1181,26 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
 		{
 			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
+			scan_queue(name, strdup(full_path), THISORNUL(parent), i+startID, dir_types, 1);
 			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
 			ScanDirectory(full_path, parent_id, dir_types);
 			free(parent_id);
 		}
 		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
 		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
-				fileno++;
+			scan_queue(name, strdup(full_path), THISORNUL(parent), i+startID, dir_types, 0);
 		}
-		free(name);
+		else
+			free(name);
 		free(namelist[i]);
 	}
 	free(namelist);
 	free(full_path);
 	if( !parent )
 	{
-		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
+		/* The next media dir numbers its objects after this one's */
+		scan_flush();
+		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, files_scanned);
 	}
 }
 
@@ -924,6 +1306,14 @@ start_scanner(void)
 	if( GETFLAG(RESCAN_MASK) )
 		return start_rescan();
 
+	if( runtime_vars.scan_threads > 1 && lav_thread_init() != 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "This libavcodec cannot be used from several threads, "
+		                           "reading metadata with one\n");
+		runtime_vars.scan_threads = 1;
+	}
+	scan_threads_start(runtime_vars.scan_threads);
+	scan_batch_begin();
 	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
 	{
 		int64_t id;
@@ -951,12 +1341,17 @@ start_scanner(void)
 			parent_id = NULL;
 		}
 	}
+	scan_batch_end();
+	scan_threads_stop();
+	scan_cache_flush();
 	/* Create this index after scanning, so it doesn't slow down the scanning process.
 	 * This index is very useful for large libraries used with an XBox360 (or any
 	 * client that uses UPnPSearch on large containers). */
 	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
 
 	fill_playlists();
+	/* Likewise, only changes after the initial scan need to be evented */
+	db_create_container_updates(db);
 
 	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
 	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
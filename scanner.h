@@ -57,7 +57,8 @@
 #define IMAGE_DIR_ID		"3$16"
 #define IMAGE_RATING_ID		"3$300"
 
-extern int valid_cache;
+void
+scan_cache_flush(void);
 
 int
 is_video(const char *file);
@@ -29,7 +29,9 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"REF_ID TEXT DEFAULT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
-					"NAME TEXT DEFAULT NULL"
+					"NAME TEXT DEFAULT NULL, "
+					"CHILD_COUNT INTEGER DEFAULT 0, "
+					"TITLE_KEY TEXT DEFAULT NULL"
 					");";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
@@ -83,6 +85,12 @@ char create_playlistTable_sqlite[] = "CREATE TABLE PLAYLISTS ("
 					"TIMESTAMP INTEGER DEFAULT 0"
 					");";
 
+char create_containerUpdatesTable_sqlite[] = "CREATE TABLE CONTAINER_UPDATES ("
+					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+					"OBJECT_ID TEXT UNIQUE NOT NULL, "
+					"UPDATE_ID INTEGER NOT NULL"
+					");";
+
 char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"KEY TEXT NOT NULL, "
 					"VALUE TEXT"
@@ -15,7 +15,11 @@
  * You should have received a copy of the GNU General Public License
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
+#include "config.h"
+
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -23,6 +27,220 @@
 #include "upnpglobalvars.h"
 #include "log.h"
 
+/* Statements are compiled once per connection and thread, and reused
+ * from here as long as they are not evicted.  Entries handed out by
+ * sql_prepare() are busy until sql_finish(). */
+#define STMT_CACHE_SIZE	32
+
+struct stmt_cache {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	char *sql;
+	unsigned int hash;
+	unsigned int used;
+	int busy;
+};
+
+static __thread struct stmt_cache stmt_cache[STMT_CACHE_SIZE];
+static __thread unsigned int stmt_clock;
+
+static unsigned int
+sql_hash(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+static sqlite3_stmt *
+sql_cache_get(sqlite3 *db, const char *sql, unsigned int hash)
+{
+	int i;
+
+	for (i = 0; i < STMT_CACHE_SIZE; i++)
+	{
+		struct stmt_cache *e = &stmt_cache[i];
+		if (e->stmt && !e->busy && e->db == db && e->hash == hash &&
+		    strcmp(e->sql, sql) == 0)
+		{
+			e->busy = 1;
+			e->used = ++stmt_clock;
+			return e->stmt;
+		}
+	}
+	return NULL;
+}
+
+static void
+sql_cache_put(sqlite3 *db, sqlite3_stmt *stmt, char *sql, unsigned int hash)
+{
+	struct stmt_cache *e = NULL;
+	int i;
+
+	for (i = 0; i < STMT_CACHE_SIZE; i++)
+	{
+		if (stmt_cache[i].busy)
+			continue;
+		if (!e || !stmt_cache[i].stmt ||
+		    (e->stmt && stmt_cache[i].used < e->used))
+			e = &stmt_cache[i];
+		if (!e->stmt)
+			break;
+	}
+	if (!e)
+	{
+		free(sql);
+		return;
+	}
+	if (e->stmt)
+	{
+		sqlite3_finalize(e->stmt);
+		free(e->sql);
+	}
+	e->db = db;
+	e->stmt = stmt;
+	e->sql = sql;
+	e->hash = hash;
+	e->used = ++stmt_clock;
+	e->busy = 1;
+}
+
+sqlite3_stmt *
+sql_prepare(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	unsigned int hash;
+	char *copy;
+
+	hash = sql_hash(sql);
+	stmt = sql_cache_get(db, sql, hash);
+	if (stmt)
+		return stmt;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		return NULL;
+	}
+	/* Without a copy of the text it is simply not cached,
+	 * and sql_finish() finalizes it */
+	copy = strdup(sql);
+	if (copy)
+		sql_cache_put(db, stmt, copy, hash);
+
+	return stmt;
+}
+
+int
+sql_step(sqlite3_stmt *stmt)
+{
+	int counter, result;
+
+	for (counter = 0;
+	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+	}
+
+	return result;
+}
+
+int
+sql_foreach(sqlite3_stmt *stmt, sqlite3_callback callback, void *arg)
+{
+	char *argv[64], *colv[64];
+	int i, ncols, result;
+
+	ncols = sqlite3_column_count(stmt);
+	if (ncols > 64)
+		return SQLITE_TOOBIG;
+	for (i = 0; i < ncols; i++)
+		colv[i] = (char *)sqlite3_column_name(stmt, i);
+	while ((result = sql_step(stmt)) == SQLITE_ROW)
+	{
+		for (i = 0; i < ncols; i++)
+			argv[i] = (char *)sqlite3_column_text(stmt, i);
+		if (callback(arg, ncols, argv, colv) != 0)
+			return SQLITE_ABORT;
+	}
+
+	return result == SQLITE_DONE ? SQLITE_OK : result;
+}
+
+void
+sql_finish(sqlite3_stmt *stmt)
+{
+	int i;
+
+	if (!stmt)
+		return;
+	for (i = 0; i < STMT_CACHE_SIZE; i++)
+	{
+		if (stmt_cache[i].stmt == stmt)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			stmt_cache[i].busy = 0;
+			return;
+		}
+	}
+	sqlite3_finalize(stmt);
+}
+
+int
+sql_exec_stmt(sqlite3_stmt *stmt)
+{
+	int ret;
+
+	if (!stmt)
+		return SQLITE_ERROR;
+	while ((ret = sql_step(stmt)) == SQLITE_ROW)
+		continue;
+	if (ret == SQLITE_DONE)
+		ret = SQLITE_OK;
+	else
+		DPRINTF(E_ERROR, L_DB_SQL, "SQL ERROR %d [%s]\n%s\n", ret,
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+	sql_finish(stmt);
+
+	return ret;
+}
+
+void
+sql_close(sqlite3 *db)
+{
+	int i;
+
+	for (i = 0; i < STMT_CACHE_SIZE; i++)
+	{
+		if (stmt_cache[i].stmt && stmt_cache[i].db == db)
+		{
+			sqlite3_finalize(stmt_cache[i].stmt);
+			free(stmt_cache[i].sql);
+			memset(&stmt_cache[i], 0, sizeof(stmt_cache[i]));
+		}
+	}
+	/* The cache is per thread, so other threads may still hold
+	 * statements on db; it then lingers until they finalize them. */
+	sqlite3_close_v2(db);
+}
+
+void
+sql_cache_forget(void)
+{
+	int i;
+
+	for (i = 0; i < STMT_CACHE_SIZE; i++)
+		free(stmt_cache[i].sql);
+	memset(stmt_cache, 0, sizeof(stmt_cache));
+}
+
 int
 sql_exec(sqlite3 *db, const char *fmt, ...)
 {
@@ -65,41 +283,47 @@ sql_get_table(sqlite3 *db, const char *sql, char ***pazResult, int *pnRow, int *
 	return ret;
 }
 
+/* Statements built with sqlite3_vmprintf() carry their values in the
+ * text, so they are not worth caching; sql_finish() finalizes them. */
+static sqlite3_stmt *
+sql_vprepare(sqlite3 *db, const char *fmt, va_list ap)
+{
+	sqlite3_stmt *stmt;
+	char *sql;
+
+	sql = sqlite3_vmprintf(fmt, ap);
+	if (!sql)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "malloc failed\n");
+		return NULL;
+	}
+	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		stmt = NULL;
+	}
+	sqlite3_free(sql);
+
+	return stmt;
+}
+
 int
 sql_get_int_field(sqlite3 *db, const char *fmt, ...)
 {
 	va_list		ap;
-	int		counter, result;
-	char		*sql;
+	int		result;
 	int		ret;
 	sqlite3_stmt	*stmt;
 	
 	va_start(ap, fmt);
-	sql = sqlite3_vmprintf(fmt, ap);
+	stmt = sql_vprepare(db, fmt, ap);
 	va_end(ap);
+	if (!stmt)
+		return -1;
 
-	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
-
-	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
-	{
-		case SQLITE_OK:
-			break;
-		default:
-			DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
-			sqlite3_free(sql);
-			return -1;
-	}
-
-	for (counter = 0;
-	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
-	     counter++) {
-		/* While SQLITE_BUSY has a built in timeout,
-		 * SQLITE_LOCKED does not, so sleep */
-		if (result == SQLITE_LOCKED)
-			sleep(1);
-	}
-
-	switch (result)
+	switch ((result = sql_step(stmt)))
 	{
 		case SQLITE_DONE:
 			/* no rows returned */
@@ -114,12 +338,11 @@ sql_get_int_field(sqlite3 *db, const char *fmt, ...)
 			ret = sqlite3_column_int(stmt, 0);
 			break;
 		default:
-			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sql);
+			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sqlite3_sql(stmt));
 			ret = -1;
 			break;
 	}
-	sqlite3_free(sql);
-	sqlite3_finalize(stmt);
+	sql_finish(stmt);
 
 	return ret;
 }
@@ -128,37 +351,17 @@ int64_t
 sql_get_int64_field(sqlite3 *db, const char *fmt, ...)
 {
 	va_list		ap;
-	int		counter, result;
-	char		*sql;
+	int		result;
 	int64_t		ret;
 	sqlite3_stmt	*stmt;
 	
 	va_start(ap, fmt);
-	sql = sqlite3_vmprintf(fmt, ap);
+	stmt = sql_vprepare(db, fmt, ap);
 	va_end(ap);
+	if (!stmt)
+		return -1;
 
-	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
-
-	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
-	{
-		case SQLITE_OK:
-			break;
-		default:
-			DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
-			sqlite3_free(sql);
-			return -1;
-	}
-
-	for (counter = 0;
-	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
-	     counter++) {
-		/* While SQLITE_BUSY has a built in timeout,
-		 * SQLITE_LOCKED does not, so sleep */
-		if (result == SQLITE_LOCKED)
-			sleep(1);
-	}
-
-	switch (result)
+	switch ((result = sql_step(stmt)))
 	{
 		case SQLITE_DONE:
 			/* no rows returned */
@@ -173,12 +376,11 @@ sql_get_int64_field(sqlite3 *db, const char *fmt, ...)
 			ret = sqlite3_column_int64(stmt, 0);
 			break;
 		default:
-			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sql);
+			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sqlite3_sql(stmt));
 			ret = -1;
 			break;
 	}
-	sqlite3_free(sql);
-	sqlite3_finalize(stmt);
+	sql_finish(stmt);
 
 	return ret;
 }
@@ -187,8 +389,7 @@ char *
 sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 {
 	va_list         ap;
-	int             counter, result, len;
-	char            *sql;
+	int             result, len;
 	char            *str;
 	sqlite3_stmt    *stmt;
 
@@ -199,33 +400,12 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	}
 
 	va_start(ap, fmt);
-	sql = sqlite3_vmprintf(fmt, ap);
+	stmt = sql_vprepare(db, fmt, ap);
 	va_end(ap);
+	if (!stmt)
+		return NULL;
 
-	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
-
-	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
-	{
-		case SQLITE_OK:
-			break;
-		default:
-			DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
-			sqlite3_free(sql);
-			return NULL;
-	}
-	sqlite3_free(sql);
-
-	for (counter = 0;
-	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
-	     counter++)
-	{
-		/* While SQLITE_BUSY has a built in timeout,
-		 * SQLITE_LOCKED does not, so sleep */
-		if (result == SQLITE_LOCKED)
-			sleep(1);
-	}
-
-	switch (result)
+	switch ((result = sql_step(stmt)))
 	{
 		case SQLITE_DONE:
 			/* no rows returned */
@@ -254,11 +434,117 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 			str = NULL;
 			break;
 	}
-	sqlite3_finalize(stmt);
+	sql_finish(stmt);
 
 	return str;
 }
 
+/* Keep OBJECTS.CHILD_COUNT up to date however rows are added or
+ * removed.  A container inserted after its children counts them. */
+int
+db_create_triggers(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "CREATE TRIGGER CHILD_COUNT_INSERT AFTER INSERT ON OBJECTS "
+	                   "BEGIN "
+	                   "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1 where OBJECT_ID = new.PARENT_ID; "
+	                   "UPDATE OBJECTS set CHILD_COUNT = "
+	                   "(SELECT count(*) from OBJECTS where PARENT_ID = new.OBJECT_ID) "
+	                   "where ID = new.ID and new.CLASS glob 'container*'; "
+	                   "END;");
+	if (ret != SQLITE_OK)
+		return ret;
+	return sql_exec(db, "CREATE TRIGGER CHILD_COUNT_DELETE AFTER DELETE ON OBJECTS "
+	                    "BEGIN "
+	                    "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1 where OBJECT_ID = old.PARENT_ID; "
+	                    "END;");
+}
+
+/* OBJECTS.TITLE_KEY, the natural order key of the title, lets sorting
+ * by title walk an index.  New rows get it in their INSERT (SQL_TITLE_KEY);
+ * this keeps it in step when a title changes. */
+int
+db_create_sort_keys(sqlite3 *db)
+{
+	return sql_exec(db, "CREATE TRIGGER TITLE_KEY_UPDATE AFTER UPDATE OF TITLE ON DETAILS "
+	                    "BEGIN "
+	                    "UPDATE OBJECTS set TITLE_KEY = naturalsort_key(new.TITLE) where DETAIL_ID = new.ID; "
+	                    "END;");
+}
+
+/* Count the children added to and removed from each container, for the
+ * ContainerUpdateIDs state variable.  Every change gives the container's
+ * row a new ID, so the containers changed since a given ID come out in
+ * the order of their last change. */
+int
+db_create_container_updates(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "CREATE TRIGGER CONTAINER_UPDATE_INSERT AFTER INSERT ON OBJECTS "
+	                   "BEGIN "
+	                   "INSERT OR REPLACE into CONTAINER_UPDATES (OBJECT_ID, UPDATE_ID) values (new.PARENT_ID, "
+	                   "coalesce((SELECT UPDATE_ID from CONTAINER_UPDATES where OBJECT_ID = new.PARENT_ID), 0) + 1); "
+	                   "END;");
+	if (ret != SQLITE_OK)
+		return ret;
+	return sql_exec(db, "CREATE TRIGGER CONTAINER_UPDATE_DELETE AFTER DELETE ON OBJECTS "
+	                    "BEGIN "
+	                    "INSERT OR REPLACE into CONTAINER_UPDATES (OBJECT_ID, UPDATE_ID) values (old.PARENT_ID, "
+	                    "coalesce((SELECT UPDATE_ID from CONTAINER_UPDATES where OBJECT_ID = old.PARENT_ID), 0) + 1); "
+	                    "END;");
+}
+
+/* Trigram index over the DETAILS text that Search criteria can match
+ * with "contains".  It is an external content table, so the triggers
+ * keep it in step with DETAILS whoever writes to it.  Needs SQLite
+ * 3.34 or later built with FTS5; without it Search scans DETAILS. */
+int
+db_create_fts(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "CREATE VIRTUAL TABLE DETAILS_FTS USING fts5("
+	                   "TITLE, CREATOR, ARTIST, ALBUM, GENRE, "
+	                   "content = 'DETAILS', content_rowid = 'ID', tokenize = 'trigram')");
+	if (ret != SQLITE_OK)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Full-text search index is not available\n");
+		return ret;
+	}
+	ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_INSERT AFTER INSERT ON DETAILS "
+	                   "BEGIN "
+	                   "INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+	                   "values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM, new.GENRE); "
+	                   "END;");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_DELETE AFTER DELETE ON DETAILS "
+		                   "BEGIN "
+		                   "INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+		                   "values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM, old.GENRE); "
+		                   "END;");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_UPDATE AFTER UPDATE OF ID, TITLE, CREATOR, ARTIST, ALBUM, GENRE ON DETAILS "
+		                   "BEGIN "
+		                   "INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+		                   "values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM, old.GENRE); "
+		                   "INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+		                   "values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM, new.GENRE); "
+		                   "END;");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "INSERT into DETAILS_FTS (DETAILS_FTS) values ('rebuild')");
+	if (ret != SQLITE_OK)
+	{
+		sql_exec(db, "DROP TRIGGER IF EXISTS DETAILS_FTS_INSERT");
+		sql_exec(db, "DROP TRIGGER IF EXISTS DETAILS_FTS_DELETE");
+		sql_exec(db, "DROP TRIGGER IF EXISTS DETAILS_FTS_UPDATE");
+		sql_exec(db, "DROP TABLE IF EXISTS DETAILS_FTS");
+	}
+
+	return ret;
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -289,7 +575,113 @@ db_upgrade(sqlite3 *db)
 		if (ret != SQLITE_OK)
 			return 10;
 	}
+	if (db_vers < 12)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 12);
+		ret = sql_exec(db, "ALTER TABLE OBJECTS ADD CHILD_COUNT INTEGER DEFAULT 0");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT = "
+			                   "(SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID) "
+			                   "where CLASS glob 'container*'");
+		if (ret == SQLITE_OK)
+			ret = db_create_triggers(db);
+		if (ret != SQLITE_OK)
+			return 11;
+	}
+	if (db_vers < 13)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 13);
+		/* Search still works without it */
+		db_create_fts(db);
+	}
+	if (db_vers < 14)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 14);
+		/* Covers class searches within a subtree */
+		ret = sql_exec(db, "DROP INDEX IF EXISTS IDX_OBJECTS_CLASS");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "CREATE INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS, OBJECT_ID, DETAIL_ID)");
+		if (ret != SQLITE_OK)
+			return 13;
+	}
+	if (db_vers < 15)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 15);
+		ret = sql_exec(db, "ALTER TABLE OBJECTS ADD TITLE_KEY TEXT DEFAULT NULL");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "UPDATE OBJECTS set TITLE_KEY = "
+			                   "(SELECT naturalsort_key(TITLE) from DETAILS d where d.ID = OBJECTS.DETAIL_ID)");
+		if (ret == SQLITE_OK)
+			ret = db_create_sort_keys(db);
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "CREATE INDEX IDX_OBJECTS_PARENT_TITLE ON OBJECTS(PARENT_ID, TITLE_KEY)");
+		/* IDX_OBJECTS_CLASS must come after it, see CreateDatabase() */
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "CREATE INDEX IDX_OBJECTS_CLASS_TITLE ON OBJECTS(CLASS, TITLE_KEY, OBJECT_ID, DETAIL_ID)");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "DROP INDEX IF EXISTS IDX_OBJECTS_CLASS");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "CREATE INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS, OBJECT_ID, DETAIL_ID)");
+		if (ret != SQLITE_OK)
+			return 14;
+	}
+	if (db_vers < 16)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 16);
+		ret = sql_exec(db, "CREATE TABLE CONTAINER_UPDATES ("
+		                   "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+		                   "OBJECT_ID TEXT UNIQUE NOT NULL, "
+		                   "UPDATE_ID INTEGER NOT NULL)");
+		if (ret == SQLITE_OK)
+			ret = db_create_container_updates(db);
+		if (ret != SQLITE_OK)
+			return 15;
+	}
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
 	return 0;
 }
+
+/* Per-connection settings from minidlna.conf.  Readers get a page
+ * cache of their own size, since there is one per worker thread in
+ * every HTTP process and they can lean on the OS cache or mmap. */
+void
+db_configure(sqlite3 *db, int reader)
+{
+	sql_exec(db, "pragma cache_size = -%d",
+	         reader ? runtime_vars.db_reader_cache_size : runtime_vars.db_cache_size);
+	if (runtime_vars.db_mmap_size)
+		sql_exec(db, "pragma mmap_size = %lld", (long long)runtime_vars.db_mmap_size << 20);
+	if (runtime_vars.db_temp_store)
+		sql_exec(db, "pragma temp_store = %d", runtime_vars.db_temp_store);
+}
+
+/* Read every page of the OBJECTS and DETAILS tables and of their
+ * indexes, so that the first Browse after a restart finds them in the
+ * OS cache (or mapped) instead of waiting on the disk. */
+void
+db_warmup(sqlite3 *db)
+{
+	char **result;
+	int i, rows = 0;
+
+	if (sql_get_table(db, "SELECT name, tbl_name from sqlite_master "
+	                      "where type = 'index' and tbl_name in ('OBJECTS', 'DETAILS')",
+	                  &result, &rows, NULL) != SQLITE_OK)
+		return;
+	sql_get_int_field(db, "SELECT count(*) from OBJECTS NOT INDEXED");
+	sql_get_int_field(db, "SELECT count(*) from DETAILS NOT INDEXED");
+	for (i = 1; i <= rows; i++)
+		sql_get_int_field(db, "SELECT count(*) from %s INDEXED BY \"%s\"",
+		                  result[i*2+1], result[i*2]);
+	sqlite3_free_table(result);
+	DPRINTF(E_INFO, L_DB_SQL, "Warmed up %d indexes\n", rows);
+}
+
+/* Changes made through this connection, plus anything committed by the
+ * others: the scanner, the monitor and the HTTP processes. */
+int
+db_changes(sqlite3 *db)
+{
+	return sqlite3_total_changes(db) + sql_get_int_field(db, "pragma data_version");
+}
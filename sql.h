@@ -39,6 +39,67 @@ int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow,
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+
+/* sql_prepare()
+ * compile (or reuse) the statement for sql, which takes its values
+ * as '?' parameters so that its text can be reused.  Bind them with
+ * sqlite3_bind_*(), step through the rows with sql_step() or
+ * sql_foreach() and the usual sqlite3_column_*() accessors, then hand
+ * it back with sql_finish().  Compiled statements are kept in a small
+ * per-thread cache, keyed by connection and text.
+ * returns: statement, or NULL on error */
+sqlite3_stmt *sql_prepare(sqlite3 *db, const char *sql);
+
+/* sql_step()
+ * sqlite3_step() that retries a busy or locked database */
+int sql_step(sqlite3_stmt *stmt);
+
+/* sql_foreach()
+ * call callback for each remaining row, like sqlite3_exec() does
+ * returns: SQLITE_OK, SQLITE_ABORT if the callback stopped, or the error */
+int sql_foreach(sqlite3_stmt *stmt, sqlite3_callback callback, void *arg);
+
+/* sql_finish()
+ * reset a cached statement for the next user, or finalize it */
+void sql_finish(sqlite3_stmt *stmt);
+
+/* sql_exec_stmt()
+ * run a statement from sql_prepare() to completion and finish it
+ * returns: SQLITE_OK, or the error */
+int sql_exec_stmt(sqlite3_stmt *stmt);
+
+/* sql_close()
+ * drop this thread's statements cached for db, then close it */
+void sql_close(sqlite3 *db);
+
+/* sql_cache_forget()
+ * abandon the cache without touching its connections, which belong
+ * to the parent after fork() */
+void sql_cache_forget(void);
+
+/* TITLE_KEY of a new OBJECTS row, given how its DETAIL_ID is spelled:
+ * "%lld" in a printf format, or the numbered parameter DETAIL_ID is bound
+ * to, like "?5".  A bare "?" would be a parameter of its own. */
+#define SQL_TITLE_KEY(id) "(SELECT naturalsort_key(TITLE) from DETAILS where ID = " id ")"
+
+int db_create_triggers(sqlite3 *db);
+int db_create_sort_keys(sqlite3 *db);
+int db_create_fts(sqlite3 *db);
+int db_create_container_updates(sqlite3 *db);
 int db_upgrade(sqlite3 *db);
 
+/* db_configure()
+ * apply the cache, mmap and temp store settings to a new connection;
+ * reader is set for the worker and HTTP process connections */
+void db_configure(sqlite3 *db, int reader);
+
+/* db_warmup()
+ * pull the OBJECTS and DETAILS pages and indexes into memory */
+void db_warmup(sqlite3 *db);
+
+/* db_changes()
+ * a counter that moves whenever the database changes, through this
+ * connection or any other; only comparable for the same connection */
+int db_changes(sqlite3 *db);
+
 #endif
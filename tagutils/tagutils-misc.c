@@ -87,7 +87,7 @@ struct {
 	{ "ko_KR",  { "CP949", "ISO-8859-1", 0 } },
 	{ 0,        { 0 } }
 };
-static int lang_index = -1;
+static __thread int lang_index = -1;
 
 static int
 _lang2cp(char *lang)
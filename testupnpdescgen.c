@@ -40,6 +40,7 @@ char modelname[] = "MiniDLNA";
 char modelnumber[] = "1";
 char presentationurl[] = "http://192.168.0.1:8080/";
 unsigned int updateID = 0;
+char *container_update_ids = NULL;
 
 int getifaddr(const char * ifname, char * buf, int len)
 {
@@ -329,6 +329,7 @@ static const struct stateVar ContentDirectoryVars[] =
 	{"SearchCapabilities", 0, 0},
 	{"SortCapabilities", 0, 0},
 	{"SystemUpdateID", 3|EVENTED, 0, 0, 255},
+	{"ContainerUpdateIDs", 0|EVENTED, 0, 0, 255},
 	{0, 0}
 };
 
@@ -728,6 +729,10 @@ genEventVars(int * len, const struct serviceDesc * s, const char * servns)
 					snprintf(buf, sizeof(buf), "%d", updateID);
 					str = strcat_str(str, len, &tmplen, buf);
 				}
+				else if( strcmp(v->name, "ContainerUpdateIDs") == 0 && container_update_ids )
+				{
+					str = strcat_str(str, len, &tmplen, container_update_ids);
+				}
 				break;
 			default:
 				str = strcat_str(str, len, &tmplen, upnpallowedvalues[v->ieventvalue]);
@@ -74,12 +74,13 @@ char presentationurl[PRESENTATIONURL_MAX_LEN];
 int n_lan_addr = 0;
 struct lan_addr_s lan_addr[MAX_LAN_ADDR];
 int sssdp = -1;
+int sparent = -1;
 
 /* Path of the Unix socket used to communicate with MiniSSDPd */
 const char * minissdpdsocketpath = "/var/run/minissdpd.sock";
 
 /* UPnP-A/V [DLNA] */
-sqlite3 *db;
+__thread sqlite3 *db;
 char friendly_name[FRIENDLYNAME_MAX_LEN];
 char db_path[1024] = {'\0'};
 char log_path[1024] = {'\0'};
@@ -87,4 +88,5 @@ struct media_dir_s * media_dirs = NULL;
 struct album_art_name_s * album_art_names = NULL;
 volatile short int quitting = 0;
 volatile uint32_t updateID = 0;
+char *container_update_ids = NULL;
 const char *force_sort_criteria = NULL;
@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 11
+#define DB_VERSION 16
 
 #ifdef READYNAS
 # define LOGFILE_NAME "upnp-av.log"
@@ -204,6 +204,8 @@ extern uint32_t runtime_flags;
 #define RESCAN_MASK           0x0200
 #define SUBTITLES_MASK        0x0400
 #define FORCE_ALPHASORT_MASK  0x0800
+#define FTS_SEARCH_MASK       0x1000
+#define DB_WARMUP_MASK        0x2000
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -229,11 +231,13 @@ extern char presentationurl[];
 extern int n_lan_addr;
 extern struct lan_addr_s lan_addr[];
 extern int sssdp;
+/* socket to the main process, in HTTP processes */
+extern int sparent;
 
 extern const char *minissdpdsocketpath;
 
 /* UPnP-A/V [DLNA] */
-extern sqlite3 *db;
+extern __thread sqlite3 *db;	/* each thread opens its own connection */
 #define FRIENDLYNAME_MAX_LEN 64
 extern char friendly_name[];
 extern char db_path[1024];
@@ -242,6 +246,7 @@ extern struct media_dir_s *media_dirs;
 extern struct album_art_name_s *album_art_names;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
+extern char *container_update_ids;
 extern const char *force_sort_criteria;
 
 #endif
@@ -53,6 +53,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -76,6 +77,7 @@
 #include "image_utils.h"
 #include "log.h"
 #include "sql.h"
+#include "respcache.h"
 #include <libexif/exif-loader.h>
 #include "tivo_utils.h"
 #include "tivo_commands.h"
@@ -85,8 +87,13 @@
 
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
+/* file body sent per wakeup, so that one fast client does not hold up
+ * the event loop; background transfers get a smaller share */
+#define SEND_BUDGET (16 * MIN_BUFFER_SIZE)
+#define BACKGROUND_SEND_BUDGET MIN_BUFFER_SIZE
 
 #define INIT_STR(s, d) { s.data = d; s.size = sizeof(d); s.off = 0; }
+#define REQ_HDR(h, f) ((h)->req_buf + (h)->f)
 
 #include "icons.c"
 
@@ -103,6 +110,14 @@ static void SendResp_resizedimg(struct upnphttp *, char * url);
 static void SendResp_thumbnail(struct upnphttp *, char * url);
 static void SendResp_dlnafile(struct upnphttp *, char * url);
 static void Process_upnphttp(struct event *ev);
+static void send_file(struct upnphttp *h);
+static void Reset_upnphttp(struct upnphttp *h);
+static void process_pipelined(struct upnphttp *h);
+static void Handoff_upnphttp(struct upnphttp *h);
+static int grow_req_buf(struct upnphttp *h, int len);
+
+/* most request data passed along with a connection to the main process */
+#define HANDOFF_MAX	8192
 
 struct upnphttp * 
 New_upnphttp(int s)
@@ -114,6 +129,7 @@ New_upnphttp(int s)
 	if(ret == NULL)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
+	ret->send_fd = -1;
 	ret->ev = (struct event ){ .fd = s, .rdwr = EVENT_READ, .process = Process_upnphttp, .data = ret };
 	event_module.add(&ret->ev);
 	return ret;
@@ -123,6 +139,19 @@ void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
 
+	/* a worker thread can't close it; the main loop will once it's sent */
+	if(h->ev.fd < 0 || h->state == 4)
+		return;
+	if(h->send_fd >= 0)
+	{
+		close(h->send_fd);
+		h->send_fd = -1;
+	}
+	if(h->reqflags & FLAG_KEEPALIVE)
+	{
+		Reset_upnphttp(h);
+		return;
+	}
 	event_module.del(&h->ev, EV_FLAG_CLOSING);
 	if(close(h->ev.fd) < 0)
 	{
@@ -137,6 +166,14 @@ Delete_upnphttp(struct upnphttp * h)
 {
 	if(h)
 	{
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		if(h->state == 4)
+		{
+			/* Only at shutdown, after the workers are stopped.
+			 * The event was already removed by Suspend_upnphttp(). */
+			close(h->ev.fd);
+			h->ev.fd = -1;
+		}
 		if(h->ev.fd >= 0)
 			CloseSocket_upnphttp(h);
 		free(h->req_buf);
@@ -145,24 +182,201 @@ Delete_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* Drop the request that was just answered, keeping any pipelined
+ * data that follows it, and go back to waiting for the next one. */
+static void
+Reset_upnphttp(struct upnphttp * h)
+{
+	int used, flags;
+
+	used = h->req_contentoff;
+	if(h->reqflags & FLAG_CONTENTLEN)
+		used += h->req_contentlen;
+	if(used > h->req_buflen)
+		used = h->req_buflen;
+	h->req_buflen -= used;
+	if(h->req_buflen)
+		memmove(h->req_buf, h->req_buf + used, h->req_buflen);
+	if(h->req_buf)
+		h->req_buf[h->req_buflen] = '\0';
+	h->req_scanoff = 0;
+
+	if(h->ev.rdwr != EVENT_READ)
+	{
+		flags = fcntl(h->ev.fd, F_GETFL, 0);
+		if(flags >= 0)
+			fcntl(h->ev.fd, F_SETFL, flags & ~O_NONBLOCK);
+		event_module.del(&h->ev, 0);
+		h->ev.rdwr = EVENT_READ;
+		event_module.add(&h->ev);
+	}
+
+	h->req_contentlen = 0;
+	h->req_contentoff = 0;
+	h->req_command = EUnknown;
+	h->req_client = NULL;
+	h->req_soapAction = 0;
+	h->req_soapActionLen = 0;
+	h->req_Callback = 0;
+	h->req_CallbackLen = 0;
+	h->req_NT = 0;
+	h->req_NTLen = 0;
+	h->req_Timeout = 0;
+	h->req_SID = 0;
+	h->req_SIDLen = 0;
+	h->req_RangeStart = 0;
+	h->req_RangeEnd = 0;
+	h->req_chunklen = 0;
+	h->reqflags = 0;
+	h->respflags = 0;
+	h->res_buflen = 0;
+	h->res_sent = 0;
+	h->idle_since = time(NULL);
+	h->state = 0;
+}
+
+enum http_header {
+	HDR_UNKNOWN = 0,
+	HDR_NT,
+	HDR_SID,
+	HDR_HOST,
+	HDR_RANGE,
+	HDR_TIMEOUT,
+	HDR_CALLBACK,
+	HDR_CONNECTION,
+	HDR_SOAPACTION,
+	HDR_USER_AGENT,
+	HDR_FRIENDLYNAME,
+	HDR_UCTT_UPNP_ORG,
+	HDR_CONTENT_LENGTH,
+	HDR_ACCEPT_LANGUAGE,
+	HDR_X_AV_CLIENT_INFO,
+	HDR_TRANSFER_ENCODING,
+	HDR_PLAYSPEED_DLNA_ORG,
+	HDR_GETCAPTIONINFO_SEC,
+	HDR_REALTIMEINFO_DLNA_ORG,
+	HDR_TRANSFERMODE_DLNA_ORG,
+	HDR_TIMESEEKRANGE_DLNA_ORG,
+	HDR_GETCONTENTFEATURES_DLNA_ORG,
+	HDR_GETAVAILABLESEEKRANGE_DLNA_ORG,
+};
+
+/* Identify a request header from its name.  Switching on the length
+ * first leaves at most three names to compare. */
+static enum http_header
+http_header(const char *name, int len)
+{
+	switch(len)
+	{
+	case 2:
+		if(strncasecmp(name, "NT", 2) == 0)
+			return HDR_NT;
+		break;
+	case 3:
+		if(strncasecmp(name, "SID", 3) == 0)
+			return HDR_SID;
+		break;
+	case 4:
+		if(strncasecmp(name, "Host", 4) == 0)
+			return HDR_HOST;
+		break;
+	case 5:
+		if(strncasecmp(name, "Range", 5) == 0)
+			return HDR_RANGE;
+		break;
+	case 7:
+		if(strncasecmp(name, "Timeout", 7) == 0)
+			return HDR_TIMEOUT;
+		break;
+	case 8:
+		if(strncasecmp(name, "Callback", 8) == 0)
+			return HDR_CALLBACK;
+		break;
+	case 10:
+		if(strncasecmp(name, "Connection", 10) == 0)
+			return HDR_CONNECTION;
+		if(strncasecmp(name, "SOAPAction", 10) == 0)
+			return HDR_SOAPACTION;
+		if(strncasecmp(name, "User-Agent", 10) == 0)
+			return HDR_USER_AGENT;
+		break;
+	case 12:
+		if(strncasecmp(name, "FriendlyName", 12) == 0)
+			return HDR_FRIENDLYNAME;
+		break;
+	case 13:
+		if(strncasecmp(name, "uctt.upnp.org", 13) == 0)
+			return HDR_UCTT_UPNP_ORG;
+		break;
+	case 14:
+		if(strncasecmp(name, "Content-Length", 14) == 0)
+			return HDR_CONTENT_LENGTH;
+		break;
+	case 15:
+		if(strncasecmp(name, "Accept-Language", 15) == 0)
+			return HDR_ACCEPT_LANGUAGE;
+		break;
+	case 16:
+		if(strncasecmp(name, "X-AV-Client-Info", 16) == 0)
+			return HDR_X_AV_CLIENT_INFO;
+		break;
+	case 17:
+		if(strncasecmp(name, "Transfer-Encoding", 17) == 0)
+			return HDR_TRANSFER_ENCODING;
+		break;
+	case 18:
+		if(strncasecmp(name, "PlaySpeed.dlna.org", 18) == 0)
+			return HDR_PLAYSPEED_DLNA_ORG;
+		if(strncasecmp(name, "getCaptionInfo.sec", 18) == 0)
+			return HDR_GETCAPTIONINFO_SEC;
+		break;
+	case 21:
+		if(strncasecmp(name, "realTimeInfo.dlna.org", 21) == 0)
+			return HDR_REALTIMEINFO_DLNA_ORG;
+		if(strncasecmp(name, "transferMode.dlna.org", 21) == 0)
+			return HDR_TRANSFERMODE_DLNA_ORG;
+		break;
+	case 22:
+		if(strncasecmp(name, "TimeSeekRange.dlna.org", 22) == 0)
+			return HDR_TIMESEEKRANGE_DLNA_ORG;
+		break;
+	case 27:
+		if(strncasecmp(name, "getcontentFeatures.dlna.org", 27) == 0)
+			return HDR_GETCONTENTFEATURES_DLNA_ORG;
+		break;
+	case 30:
+		if(strncasecmp(name, "getAvailableSeekRange.dlna.org", 30) == 0)
+			return HDR_GETAVAILABLESEEKRANGE_DLNA_ORG;
+		break;
+	}
+
+	return HDR_UNKNOWN;
+}
+
 /* parse HttpHeaders of the REQUEST */
 static void
 ParseHttpHeaders(struct upnphttp * h)
 {
 	int client = 0;
 	char * line;
+	char * eol;
 	char * colon;
 	char * p;
-	int n;
+	int n, i;
 	line = h->req_buf;
-	/* TODO : check if req_buf, contentoff are ok */
 	while(line < (h->req_buf + h->req_contentoff))
 	{
-		colon = strchr(line, ':');
+		eol = strstr(line, "\r\n");
+		if (!eol)
+			return;
+		colon = memchr(line, ':', eol - line);
 		if(colon)
 		{
-			if(strncasecmp(line, "Content-Length", 14)==0)
+			for(n = colon - line; n > 0 && isblank(line[n-1]); n--)
+				continue;
+			switch(http_header(line, n))
 			{
+			case HDR_CONTENT_LENGTH:
 				p = colon;
 				while(*p && (*p < '0' || *p > '9'))
 					p++;
@@ -171,9 +385,16 @@ ParseHttpHeaders(struct upnphttp * h)
 					DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
 					h->req_contentlen = 0;
 				}
-			}
-			else if(strncasecmp(line, "SOAPAction", 10)==0)
-			{
+				h->reqflags |= FLAG_CONTENTLEN;
+				break;
+			case HDR_CONNECTION:
+				p = colon + 1;
+				while(isspace(*p))
+					p++;
+				if(strncasecmp(p, "close", 5)==0)
+					h->reqflags |= FLAG_CONNCLOSE;
+				break;
+			case HDR_SOAPACTION:
 				p = colon;
 				n = 0;
 				while(*p == ':' || *p == ' ' || *p == '\t')
@@ -187,54 +408,39 @@ ParseHttpHeaders(struct upnphttp * h)
 					p++;
 					n -= 2;
 				}
-				h->req_soapAction = p;
+				h->req_soapAction = p - h->req_buf;
 				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "Callback", 8)==0)
-			{
+				break;
+			case HDR_CALLBACK:
 				p = colon;
 				while(*p && *p != '<' && *p != '\r' )
 					p++;
 				n = 0;
 				while(p[n] && p[n] != '>' && p[n] != '\r' )
 					n++;
-				h->req_Callback = p + 1;
+				h->req_Callback = p + 1 - h->req_buf;
 				h->req_CallbackLen = MAX(0, n - 1);
-			}
-			else if(strncasecmp(line, "SID", 3)==0)
-			{
-				//zqiu: fix bug for test 4.0.5
-				//Skip extra headers like "SIDHEADER: xxxxxx xxx"
-				for(p=line+3;p<colon;p++)
-				{
-					if(!isspace(*p))
-					{
-						p = NULL; //unexpected header
-						break;
-					}
-				}
-				if(p) {
-					p = colon + 1;
-					while(isspace(*p))
-						p++;
-					n = 0;
-					while(p[n] && !isspace(p[n]))
-						n++;
-					h->req_SID = p;
-					h->req_SIDLen = n;
-				}
-			}
-			else if(strncasecmp(line, "NT", 2)==0)
-			{
+				break;
+			case HDR_SID:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
 				n = 0;
 				while(p[n] && !isspace(p[n]))
 					n++;
-				h->req_NT = p;
+				h->req_SID = p - h->req_buf;
+				h->req_SIDLen = n;
+				break;
+			case HDR_NT:
+				p = colon + 1;
+				while(isspace(*p))
+					p++;
+				n = 0;
+				while(p[n] && !isspace(p[n]))
+					n++;
+				h->req_NT = p - h->req_buf;
 				h->req_NTLen = n;
-			}
+				break;
 			/* Timeout: Seconds-nnnn */
 			/* TIMEOUT
 			Recommended. Requested duration until subscription expires,
@@ -242,18 +448,16 @@ ParseHttpHeaders(struct upnphttp * h)
 			by a UPnP Forum working committee. Defined by UPnP vendor.
 			Consists of the keyword "Second-" followed (without an
 			intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout", 7)==0)
-			{
+			case HDR_TIMEOUT:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
 				if(strncasecmp(p, "Second-", 7)==0) {
 					h->req_Timeout = atoi(p+7);
 				}
-			}
+				break;
 			// Range: bytes=xxx-yyy
-			else if(strncasecmp(line, "Range", 5)==0)
-			{
+			case HDR_RANGE:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -300,10 +504,8 @@ ParseHttpHeaders(struct upnphttp * h)
  					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
 						(long long)h->req_RangeStart, h->req_RangeEnd);
  				}
-			}
-			else if(strncasecmp(line, "Host", 4)==0)
-			{
-				int i;
+				break;
+			case HDR_HOST:
 				h->reqflags |= FLAG_HOST;
 				p = colon + 1;
 				while(isspace(*p))
@@ -321,13 +523,11 @@ ParseHttpHeaders(struct upnphttp * h)
 						break;
 					}
 				}
-			}
-			else if(strncasecmp(line, "User-Agent", 10)==0)
-			{
-				int i;
+				break;
+			case HDR_USER_AGENT:
 				/* Skip client detection if we already detected it. */
 				if( client )
-					goto next_header;
+					break;
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -341,13 +541,11 @@ ParseHttpHeaders(struct upnphttp * h)
 						break;
 					}
 				}
-			}
-			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
-			{
-				int i;
+				break;
+			case HDR_X_AV_CLIENT_INFO:
 				/* Skip client detection if we already detected it. */
 				if( client && client_types[client].type < EStandardDLNA150 )
-					goto next_header;
+					break;
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -361,9 +559,8 @@ ParseHttpHeaders(struct upnphttp * h)
 						break;
 					}
 				}
-			}
-			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
-			{
+				break;
+			case HDR_TRANSFER_ENCODING:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -371,41 +568,34 @@ ParseHttpHeaders(struct upnphttp * h)
 				{
 					h->reqflags |= FLAG_CHUNKED;
 				}
-			}
-			else if(strncasecmp(line, "Accept-Language", 15)==0)
-			{
+				break;
+			case HDR_ACCEPT_LANGUAGE:
 				h->reqflags |= FLAG_LANGUAGE;
-			}
-			else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
-			{
+				break;
+			case HDR_GETCONTENTFEATURES_DLNA_ORG:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
 				if( (*p != '1') || !isspace(p[1]) )
 					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
-			{
+				break;
+			case HDR_TIMESEEKRANGE_DLNA_ORG:
 				h->reqflags |= FLAG_TIMESEEK;
-			}
-			else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
-			{
+				break;
+			case HDR_PLAYSPEED_DLNA_ORG:
 				h->reqflags |= FLAG_PLAYSPEED;
-			}
-			else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
-			{
+				break;
+			case HDR_REALTIMEINFO_DLNA_ORG:
 				h->reqflags |= FLAG_REALTIMEINFO;
-			}
-			else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
-			{
+				break;
+			case HDR_GETAVAILABLESEEKRANGE_DLNA_ORG:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
 				if( (*p != '1') || !isspace(p[1]) )
 					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
-			{
+				break;
+			case HDR_TRANSFERMODE_DLNA_ORG:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -421,14 +611,11 @@ ParseHttpHeaders(struct upnphttp * h)
 				{
 					h->reqflags |= FLAG_XFERBACKGROUND;
 				}
-			}
-			else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
-			{
+				break;
+			case HDR_GETCAPTIONINFO_SEC:
 				h->reqflags |= FLAG_CAPTION;
-			}
-			else if(strncasecmp(line, "FriendlyName", 12)==0)
-			{
-				int i;
+				break;
+			case HDR_FRIENDLYNAME:
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
@@ -442,18 +629,16 @@ ParseHttpHeaders(struct upnphttp * h)
 						break;
 					}
 				}
-			}
-			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
-			{
+				break;
+			case HDR_UCTT_UPNP_ORG:
 				/* Conformance testing */
 				SETFLAG(DLNA_STRICT_MASK);
+				break;
+			default:
+				break;
 			}
 		}
-next_header:
-		line = strstr(line, "\r\n");
-		if (!line)
-			return;
-		line += 2;
+		line = eol + 2;
 	}
 	if( h->reqflags & FLAG_CHUNKED )
 	{
@@ -511,6 +696,7 @@ Send400(struct upnphttp * h)
 		"<BODY><H1>Bad Request</H1>The request is invalid"
 		" for this HTTP version.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 400, "Bad Request",
 	                    body400, sizeof(body400) - 1);
 	SendResp_upnphttp(h);
@@ -586,6 +772,7 @@ Send500(struct upnphttp * h)
 		"<BODY><H1>Internal Server Error</H1>Server encountered "
 		"and Internal Error.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 500, "Internal Server Errror",
 	                    body500, sizeof(body500) - 1);
 	SendResp_upnphttp(h);
@@ -601,6 +788,7 @@ Send501(struct upnphttp * h)
 		"<BODY><H1>Not Implemented</H1>The HTTP Method "
 		"is not implemented by this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
@@ -647,6 +835,7 @@ static void
 SendResp_presentation(struct upnphttp * h)
 {
 	struct string_s str;
+	struct respcache_stats rc;
 	char body[4096];
 	int a, v, p, i;
 
@@ -689,6 +878,18 @@ SendResp_presentation(struct upnphttp * h)
 	}
 	strcatf(&str, "</table>");
 
+	respcache_get_stats(&rc);
+	if (rc.budget)
+		strcatf(&str,
+			"<h3>Response cache</h3>"
+			"<table border=1 cellpadding=10>"
+			"<tr><td>Hits</td><td>%lu</td></tr>"
+			"<tr><td>Misses</td><td>%lu</td></tr>"
+			"<tr><td>Entries</td><td>%lu</td></tr>"
+			"<tr><td>Size</td><td>%zu / %zu KiB</td></tr>"
+			"</table>", rc.hits, rc.misses, rc.entries,
+			rc.bytes / 1024, rc.budget / 1024);
+
 	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
 	strcatf(&str, "</BODY></HTML>\r\n");
 
@@ -707,9 +908,9 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 		if(h->req_soapAction)
 		{
 			/* we can process the request */
-			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
+			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, REQ_HDR(h, req_soapAction));
 			ExecuteSoapAction(h, 
-				h->req_soapAction,
+				REQ_HDR(h, req_soapAction),
 				h->req_soapActionLen);
 		}
 		else
@@ -726,7 +927,9 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 	}
 	else
 	{
-		/* waiting for remaining data */
+		/* waiting for remaining data, for which we make room now */
+		if(h->req_contentlen < 1024 * 1024)
+			grow_req_buf(h, h->req_contentoff + h->req_contentlen);
 		h->state = 1;
 	}
 }
@@ -744,8 +947,8 @@ check_event(struct upnphttp *h)
 				            "<html><body>Bad request</body></html>", 37);
 			type = E_INVALID;
 		}
-		else if (strncmp(h->req_Callback, "http://", 7) != 0 ||
-		         strncmp(h->req_NT, "upnp:event", h->req_NTLen) != 0)
+		else if (strncmp(REQ_HDR(h, req_Callback), "http://", 7) != 0 ||
+		         strncmp(REQ_HDR(h, req_NT), "upnp:event", h->req_NTLen) != 0)
 		{
 			/* Missing or invalid CALLBACK : 412 Precondition Failed.
 			 * If CALLBACK header is missing or does not contain a valid HTTP URL,
@@ -784,8 +987,8 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPSubscribe %s\n", path);
 	DPRINTF(E_DEBUG, L_HTTP, "Callback '%.*s' Timeout=%d\n",
-		h->req_CallbackLen, h->req_Callback, h->req_Timeout);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+		h->req_CallbackLen, REQ_HDR(h, req_Callback), h->req_Timeout);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, REQ_HDR(h, req_SID));
 
 	type = check_event(h);
 	if (type == E_SUBSCRIBE)
@@ -794,22 +997,22 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 		 * - respond HTTP/x.x 200 OK 
 		 * - Send the initial event message */
 		/* Server:, SID:; Timeout: Second-(xx|infinite) */
-		sid = upnpevents_addSubscriber(path, h->req_Callback,
+		sid = upnpevents_addSubscriber(path, REQ_HDR(h, req_Callback),
 		                               h->req_CallbackLen, h->req_Timeout);
 		h->respflags = FLAG_TIMEOUT;
 		if (sid)
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "generated sid=%s\n", sid);
 			h->respflags |= FLAG_SID;
-			h->req_SID = sid;
-			h->req_SIDLen = strlen(sid);
+			h->res_SID = sid;
+			h->res_SIDLen = strlen(sid);
 		}
 		BuildResp_upnphttp(h, 0, 0);
 	}
 	else if (type == E_RENEW)
 	{
 		/* subscription renew */
-		if (renewSubscription(h->req_SID, h->req_SIDLen, h->req_Timeout) < 0)
+		if (renewSubscription(REQ_HDR(h, req_SID), h->req_SIDLen, h->req_Timeout) < 0)
 		{
 			/* Invalid SID
 			   412 Precondition Failed. If a SID does not correspond to a known,
@@ -823,6 +1026,8 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 			h->respflags = FLAG_TIMEOUT;
 			h->req_Timeout = 300;
 			h->respflags |= FLAG_SID;
+			h->res_SID = REQ_HDR(h, req_SID);
+			h->res_SIDLen = h->req_SIDLen;
 			BuildResp_upnphttp(h, 0, 0);
 		}
 	}
@@ -835,12 +1040,12 @@ ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
 {
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, REQ_HDR(h, req_SID));
 	/* Remove from the list */
 	type = check_event(h);
 	if (type != E_INVALID)
 	{
-		if(upnpevents_removeSubscriber(h->req_SID, h->req_SIDLen) < 0)
+		if(upnpevents_removeSubscriber(REQ_HDR(h, req_SID), h->req_SIDLen) < 0)
 			BuildResp2_upnphttp(h, 412, "Precondition Failed", 0, 0);
 		else
 			BuildResp_upnphttp(h, 0, 0);
@@ -877,6 +1082,14 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		HttpVer[i] = *(p++);
 	HttpVer[i] = '\0';
 
+	/* Subscriptions live in the main process */
+	if(sparent >= 0 &&
+	   (strcmp("SUBSCRIBE", HttpCommand) == 0 || strcmp("UNSUBSCRIBE", HttpCommand) == 0))
+	{
+		Handoff_upnphttp(h);
+		return;
+	}
+
 	/* set the interface here initially, in case there is no Host header */
 	for(i = 0; i<n_lan_addr; i++)
 	{
@@ -890,6 +1103,14 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 
 	ParseHttpHeaders(h);
 
+	/* HTTP/1.1 connections are persistent unless the client asks
+	 * otherwise, as long as we can tell where the request ends */
+	if( strcmp(HttpVer, "HTTP/1.1") == 0 &&
+	    !(h->reqflags & (FLAG_CONNCLOSE|FLAG_CHUNKED)) &&
+	    ((h->reqflags & FLAG_CONTENTLEN) || strcmp("POST", HttpCommand) != 0) &&
+	    ++h->requests < HTTP_KEEPALIVE_MAX )
+		h->reqflags |= FLAG_KEEPALIVE;
+
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
@@ -1079,17 +1300,49 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* Make room for len bytes of request and a terminating nul.  The buffer
+ * grows geometrically, so a large request is only copied a few times.
+ * returns: 1 if the buffer was reallocated, 0 if it was big enough,
+ * -1 on failure */
+static int
+grow_req_buf(struct upnphttp * h, int len)
+{
+	char * buf;
+	int alloclen;
+
+	if(len < h->req_buf_alloclen)
+		return 0;
+	if(len >= INT_MAX / 2)
+		return -1;
+	alloclen = h->req_buf_alloclen ? h->req_buf_alloclen : 2048;
+	while(alloclen <= len)
+		alloclen *= 2;
+	buf = realloc(h->req_buf, alloclen);
+	if(!buf)
+		return -1;
+	h->req_buf = buf;
+	h->req_buf_alloclen = alloclen;
+
+	return 1;
+}
+
 static void
 Process_upnphttp(struct event *ev)
 {
-	char buf[2048];
 	struct upnphttp *h = ev->data;
-	int n;
+	int n, ret;
 
 	switch(h->state)
 	{
 	case 0:
-		n = recv(h->ev.fd, buf, 2048, 0);
+		if(grow_req_buf(h, h->req_buflen + 2048) < 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
+			h->state = 100;
+			break;
+		}
+		n = recv(h->ev.fd, h->req_buf + h->req_buflen,
+		         h->req_buf_alloclen - h->req_buflen - 1, 0);
 		if(n<0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
@@ -1102,40 +1355,26 @@ Process_upnphttp(struct event *ev)
 		}
 		else
 		{
-			int new_req_buflen;
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			new_req_buflen = n + h->req_buflen + 1;
-			if (new_req_buflen >= 1024 * 1024)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", new_req_buflen);
-				h->state = 100;
-				break;
-			}
-			h->req_buf = (char *)realloc(h->req_buf, new_req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
 			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
-			if(endheaders)
+			if (h->req_buflen >= 1024 * 1024)
 			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				h->req_contentlen = h->req_buflen - h->req_contentoff;
-				ProcessHttpQuery_upnphttp(h);
+				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", h->req_buflen);
+				h->state = 100;
 			}
 		}
 		break;
 	case 1:
 	case 2:
-		n = recv(h->ev.fd, buf, sizeof(buf), 0);
+		ret = grow_req_buf(h, h->req_buflen + 2048);
+		if(ret < 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
+			h->state = 100;
+			break;
+		}
+		n = recv(h->ev.fd, h->req_buf + h->req_buflen,
+		         h->req_buf_alloclen - h->req_buflen - 1, 0);
 		if(n < 0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
@@ -1148,23 +1387,12 @@ Process_upnphttp(struct event *ev)
 		}
 		else
 		{
-			buf[sizeof(buf)-1] = '\0';
-			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
 			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 			{
-				/* Need the struct to point to the realloc'd memory locations */
 				if( h->state == 1 )
 				{
-					ParseHttpHeaders(h);
 					ProcessHTTPPOST_upnphttp(h);
 				}
 				else if( h->state == 2 )
@@ -1174,9 +1402,37 @@ Process_upnphttp(struct event *ev)
 			}
 		}
 		break;
+	case 3:
+		send_file(h);
+		break;
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
+
+	process_pipelined(h);
+}
+
+/* Handle every complete request we have, including any that were
+ * pipelined behind the one that was just answered. */
+static void
+process_pipelined(struct upnphttp * h)
+{
+	while(h->state == 0 && h->req_buflen > 0)
+	{
+		const char * endheaders;
+		/* search for the string "\r\n\r\n", starting from
+		 * where the previous search gave up */
+		endheaders = strstr(h->req_buf + h->req_scanoff, "\r\n\r\n");
+		if(!endheaders)
+		{
+			h->req_scanoff = MAX(0, h->req_buflen - 3);
+			break;
+		}
+		h->req_scanoff = 0;
+		h->req_contentoff = endheaders - h->req_buf + 4;
+		h->req_contentlen = h->req_buflen - h->req_contentoff;
+		ProcessHttpQuery_upnphttp(h);
+	}
 }
 
 /* with response code and response message
@@ -1190,10 +1446,9 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	static const char httpresphead[] =
 		"%s %d %s\r\n"
 		"Content-Type: %s\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
-		"Server: " MINIDLNA_SERVER_STRING "\r\n";
+		"%s";
 	time_t curtime = time(NULL);
+	struct tm tm;
 	char date[30];
 	int templen;
 	struct string_s res;
@@ -1209,7 +1464,12 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
 	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
-							 bodylen);
+	              (h->reqflags&FLAG_KEEPALIVE)?"":"Connection: close\r\n");
+	if(h->respflags & FLAG_CHUNKED)
+		strcatf(&res, "Transfer-Encoding: chunked\r\n");
+	else
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
+	strcatf(&res, "Server: " MINIDLNA_SERVER_STRING "\r\n");
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1220,12 +1480,12 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 		}
 	}
 	if(h->respflags & FLAG_SID) {
-		strcatf(&res, "SID: %.*s\r\n", h->req_SIDLen, h->req_SID);
+		strcatf(&res, "SID: %.*s\r\n", h->res_SIDLen, h->res_SID);
 	}
 	if(h->reqflags & FLAG_LANGUAGE) {
 		strcatf(&res, "Content-Language: en\r\n");
 	}
-	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&curtime));
+	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime_r(&curtime, &tm));
 	strcatf(&res, "Date: %s\r\n", date);
 	strcatf(&res, "EXT:\r\n");
 	strcatf(&res, "\r\n");
@@ -1261,6 +1521,9 @@ void
 SendResp_upnphttp(struct upnphttp * h)
 {
 	int n;
+	/* built on a worker thread; Resume_upnphttp() sends it */
+	if(h->state == 4)
+		return;
 	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
 	n = send(h->ev.fd, h->res_buf, h->res_buflen, 0);
 	if(n<0)
@@ -1273,6 +1536,75 @@ SendResp_upnphttp(struct upnphttp * h)
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
 						n, h->res_buflen);
 	}
+	else
+	{
+		return;
+	}
+	/* the response is incomplete, so the connection can't be reused */
+	h->reqflags &= ~FLAG_KEEPALIVE;
+}
+
+int
+SendChunk_upnphttp(struct upnphttp * h, const char * data, int len)
+{
+	struct iovec iov[4], *v = iov;
+	char size[16];
+	int n = 0;
+	ssize_t ret;
+
+	if(h->res_buflen)
+	{
+		/* Don't let a stalled client hold the worker forever.
+		 * The last chunk puts the old timeout back. */
+		struct timeval tv = { .tv_sec = 30 };
+		socklen_t tvlen = sizeof(h->res_sndtimeo);
+		if(getsockopt(h->ev.fd, SOL_SOCKET, SO_SNDTIMEO, &h->res_sndtimeo, &tvlen) < 0)
+			memset(&h->res_sndtimeo, 0, sizeof(h->res_sndtimeo));
+		setsockopt(h->ev.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
+		iov[n].iov_base = h->res_buf;
+		iov[n++].iov_len = h->res_buflen;
+	}
+	iov[n].iov_base = size;
+	iov[n++].iov_len = snprintf(size, sizeof(size), "%x\r\n", len);
+	if(len)
+	{
+		iov[n].iov_base = (char *)data;
+		iov[n++].iov_len = len;
+	}
+	iov[n].iov_base = "\r\n";
+	iov[n++].iov_len = 2;
+
+	while(n > 0)
+	{
+		ret = writev(h->ev.fd, v, n);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			DPRINTF(E_ERROR, L_HTTP, "writev(chunk): %s\n", strerror(errno));
+			h->reqflags &= ~FLAG_KEEPALIVE;
+			h->res_buflen = 0;
+			return -1;
+		}
+		while(n > 0 && (size_t)ret >= v->iov_len)
+		{
+			ret -= v->iov_len;
+			v++;
+			n--;
+		}
+		if(n > 0)
+		{
+			v->iov_base = (char *)v->iov_base + ret;
+			v->iov_len -= ret;
+		}
+	}
+	h->res_buflen = 0;
+	if(!len)
+		setsockopt(h->ev.fd, SOL_SOCKET, SO_SNDTIMEO,
+		           &h->res_sndtimeo, sizeof(h->res_sndtimeo));
+
+	return 0;
 }
 
 static int
@@ -1295,70 +1627,282 @@ send_data(struct upnphttp * h, char * header, size_t size, int flags)
 	{
 		return 0;
 	}
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	return 1;
 }
 
+/* Switch the socket to non-blocking mode and let the event loop call
+ * send_file() each time it becomes writable. */
+static int
+start_send(struct upnphttp * h)
+{
+	int flags;
+
+	flags = fcntl(h->ev.fd, F_GETFL, 0);
+	if( flags < 0 || fcntl(h->ev.fd, F_SETFL, flags | O_NONBLOCK) < 0 )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "fcntl(O_NONBLOCK): %s\n", strerror(errno));
+		return -1;
+	}
+	h->ev.rdwr = EVENT_WRITE;
+	event_module.add(&h->ev);
+	h->state = 3;
+
+	return 0;
+}
+
+/* Hand the file body over to the event loop, until
+ * [offset, end_offset] has been sent. */
+static void
+start_send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+{
+	h->send_fd = sendfd;
+	h->send_offset = offset;
+	h->send_end = end_offset;
+	h->res_sent = h->res_buflen;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(sendfd, offset, end_offset - offset + 1, POSIX_FADV_SEQUENTIAL);
+#endif
+	event_module.del(&h->ev, 0);
+	if( start_send(h) < 0 )
+	{
+		h->ev.rdwr = EVENT_READ;
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		event_module.add(&h->ev);
+		CloseSocket_upnphttp(h);
+	}
+}
+
+/* Pass the connection, with everything read from it so far,
+ * over to the main process and forget about it. */
 static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+Handoff_upnphttp(struct upnphttp * h)
 {
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	if(h->req_buflen > HANDOFF_MAX)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Request too large to hand off (%d bytes)\n", h->req_buflen);
+		Send500(h);
+		return;
+	}
+	iov[0].iov_base = &h->clientaddr;
+	iov[0].iov_len = sizeof(h->clientaddr);
+	iov[1].iov_base = h->req_buf;
+	iov[1].iov_len = h->req_buflen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &h->ev.fd, sizeof(int));
+
+	if(sendmsg(sparent, &msg, 0) < 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "sendmsg(handoff): %s\n", strerror(errno));
+		Send500(h);
+		return;
+	}
+	h->reqflags &= ~FLAG_KEEPALIVE;
+	CloseSocket_upnphttp(h);
+}
+
+int
+Adopt_upnphttp(int s, struct upnphttp **hp)
+{
+	char buf[sizeof(struct in_addr) + HANDOFF_MAX];
+	struct in_addr clientaddr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct upnphttp *h;
+	int n, fd = -1;
+
+	*hp = NULL;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	n = recvmsg(s, &msg, 0);
+	if(n == 0)
+		return -1;
+	if(n < 0)
+	{
+		if(errno == EINTR || errno == EAGAIN)
+			return 0;
+		DPRINTF(E_ERROR, L_HTTP, "recvmsg(handoff): %s\n", strerror(errno));
+		return -1;
+	}
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if(fd < 0)
+		return 0;
+	if(n < (int)sizeof(clientaddr) || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Bad connection handoff (%d bytes)\n", n);
+		close(fd);
+		return 0;
+	}
+	h = New_upnphttp(fd);
+	if(!h)
+	{
+		close(fd);
+		return 0;
+	}
+	memcpy(&clientaddr, buf, sizeof(clientaddr));
+	h->clientaddr = clientaddr;
+	h->req_buflen = n - sizeof(clientaddr);
+	if(grow_req_buf(h, h->req_buflen) < 0)
+	{
+		Delete_upnphttp(h);
+		return 0;
+	}
+	memcpy(h->req_buf, buf + sizeof(clientaddr), h->req_buflen);
+	h->req_buf[h->req_buflen] = '\0';
+	process_pipelined(h);
+	*hp = h;
+
+	return 0;
+}
+
+void
+Suspend_upnphttp(struct upnphttp * h)
+{
+	event_module.del(&h->ev, 0);
+	h->state = 4;
+}
+
+void
+Resume_upnphttp(struct upnphttp * h)
+{
+	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
+	h->send_offset = 0;
+	h->send_end = -1;
+	h->res_sent = 0;
+	if( start_send(h) < 0 )
+	{
+		h->state = 0;
+		h->ev.rdwr = EVENT_READ;
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		event_module.add(&h->ev);
+		CloseSocket_upnphttp(h);
+		return;
+	}
+	/* Most responses fit in the socket buffer, so try right away. */
+	send_file(h);
+	process_pipelined(h);
+}
+
+/* Send as much of the pending response and file body as the socket
+ * will take without blocking.  Closes the connection once it's done. */
+static void
+send_file(struct upnphttp * h)
+{
+	static char buf[MIN_BUFFER_SIZE];
 	off_t send_size;
+	off_t budget;
 	off_t ret;
-	char *buf = NULL;
-#if HAVE_SENDFILE
-	int try_sendfile = 1;
-#endif
 
-	while( offset <= end_offset )
+	budget = (h->reqflags & FLAG_XFERBACKGROUND) ? BACKGROUND_SEND_BUDGET : SEND_BUDGET;
+
+	while( h->res_sent < h->res_buflen )
 	{
+		ret = send(h->ev.fd, h->res_buf + h->res_sent, h->res_buflen - h->res_sent, 0);
+		if( ret == -1 )
+		{
+			if( errno == EAGAIN || errno == EINTR )
+				return;
+			DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+			h->reqflags &= ~FLAG_KEEPALIVE;
+			CloseSocket_upnphttp(h);
+			return;
+		}
+		h->res_sent += ret;
+	}
+	while( h->send_offset <= h->send_end )
+	{
+		/* Out of budget: the socket is still writable, so the event
+		 * loop comes back here after serving everyone else. */
+		if( budget <= 0 )
+			return;
 #if HAVE_SENDFILE
-		if( try_sendfile )
+		if( !(h->respflags & FLAG_NOSENDFILE) )
 		{
-			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
-			ret = sys_sendfile(h->ev.fd, sendfd, &offset, send_size);
+			send_size = ( ((h->send_end - h->send_offset) < budget) ? (h->send_end - h->send_offset + 1) : budget);
+			ret = sys_sendfile(h->ev.fd, h->send_fd, &h->send_offset, send_size);
 			if( ret == -1 )
 			{
+				if( errno == EAGAIN || errno == EINTR )
+					return;
 				DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
 				/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
 				if( errno == EOVERFLOW || errno == EINVAL )
-					try_sendfile = 0;
-				else if( errno != EAGAIN )
+					h->respflags |= FLAG_NOSENDFILE;
+				else
 					break;
 			}
+			else if( ret == 0 )
+			{
+				/* File was truncated underneath us */
+				break;
+			}
 			else
 			{
-				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
+				budget -= ret;
 				continue;
 			}
 		}
 #endif
 		/* Fall back to regular I/O */
-		if( !buf )
-			buf = malloc(MIN_BUFFER_SIZE);
-		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
-		lseek(sendfd, offset, SEEK_SET);
-		ret = read(sendfd, buf, send_size);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
+		send_size = (((h->send_end - h->send_offset) < MIN_BUFFER_SIZE) ? (h->send_end - h->send_offset + 1) : MIN_BUFFER_SIZE);
+		ret = pread(h->send_fd, buf, send_size, h->send_offset);
+		if( ret <= 0 ) {
+			if( ret == -1 && errno == EINTR )
 				continue;
-			else
-				break;
+			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
+			break;
 		}
-		ret = write(h->ev.fd, buf, ret);
+		ret = send(h->ev.fd, buf, ret, 0);
 		if( ret == -1 ) {
+			if( errno == EAGAIN || errno == EINTR )
+				return;
 			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
-				continue;
-			else
-				break;
+			break;
 		}
-		offset += ret;
-	}
-	free(buf);
+		h->send_offset += ret;
+		budget -= ret;
+	}
+	if( h->send_fd >= 0 )
+		DPRINTF(E_DEBUG, L_HTTP, "Done sending file, offset %jd/%jd\n",
+		        (intmax_t)h->send_offset, (intmax_t)h->send_end + 1);
+	if( h->send_offset <= h->send_end )
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	CloseSocket_upnphttp(h);
 }
 
 static void
-start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
+start_dlna_header(struct upnphttp *h, struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
 	char date[30];
 	time_t now;
@@ -1366,14 +1910,15 @@ start_dlna_header(struct string_s *str, int respcode, const char *tmode, const c
 	now = time(NULL);
 	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
 	strcatf(str, "HTTP/1.1 %d OK\r\n"
-	             "Connection: close\r\n"
+	             "%s"
 	             "Date: %s\r\n"
 	             "Server: " MINIDLNA_SERVER_STRING "\r\n"
 	             "EXT:\r\n"
 	             "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
 	             "transferMode.dlna.org: %s\r\n"
 	             "Content-Type: %s\r\n",
-	             respcode, date, tmode, mime);
+	             respcode, (h->reqflags & FLAG_KEEPALIVE) ? "" : "Connection: close\r\n",
+	             date, tmode, mime);
 }
 
 static int
@@ -1462,7 +2007,7 @@ SendResp_icon(struct upnphttp * h, char * icon)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", mime);
+	start_dlna_header(h, &str, 200, "Interactive", mime);
 	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
@@ -1516,15 +2061,15 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN\r\n\r\n",
 	              (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( send_data(h, str.data, str.off, MSG_MORE) == 0 && h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+		start_send_file(h, fd, 0, size-1);
+		return;
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1566,13 +2111,13 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	start_dlna_header(h, &str, 200, "Interactive", "smi/caption");
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( send_data(h, str.data, str.off, MSG_MORE) == 0 && h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+		start_send_file(h, fd, 0, size-1);
+		return;
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1629,7 +2174,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
 	              (intmax_t)ed->size);
@@ -1721,6 +2266,8 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		}
 	}
 
+	/* The response is either chunked or sent by a child process */
+	h->reqflags &= ~FLAG_KEEPALIVE;
 #if USE_FORK
 	pid_t newpid = 0;
 	newpid = process_fork(h->req_client);
@@ -1805,7 +2352,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else
 #endif
 		tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
+	start_dlna_header(h, &str, 200, tmode, "image/jpeg");
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
@@ -1878,9 +2425,9 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 {
 	char header[1024];
 	struct string_s str;
-	char buf[128];
-	char **result;
-	int rows, ret;
+	sqlite3_stmt *stmt;
+	const char *path, *mime;
+	int ret;
 	off_t total, offset, size;
 	int64_t id;
 	int sendfh;
@@ -1894,9 +2441,6 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	                char mime[32];
 	                char dlna[96];
 	              } last_file = { 0, 0 };
-#if USE_FORK
-	pid_t newpid = 0;
-#endif
 
 	id = strtoll(object, NULL, 10);
 	if( cflags & FLAG_MS_PFS )
@@ -1917,28 +2461,33 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	}
 	if( id != last_file.id || ctype != last_file.client )
 	{
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN from DETAILS where ID = '%lld'", (long long)id);
-		ret = sql_get_table(db, buf, &result, &rows, NULL);
-		if( (ret != SQLITE_OK) )
+		stmt = sql_prepare(db, "SELECT PATH, MIME, DLNA_PN from DETAILS where ID = ?");
+		if( stmt )
+			sqlite3_bind_int64(stmt, 1, id);
+		ret = stmt ? sql_step(stmt) : SQLITE_ERROR;
+		if( ret != SQLITE_ROW && ret != SQLITE_DONE )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
+			sql_finish(stmt);
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[3] || !result[4] )
+		path = ret == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+		mime = ret == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 1) : NULL;
+		if( !path || !mime )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
-			sqlite3_free_table(result);
+			sql_finish(stmt);
 			Send404(h);
 			return;
 		}
 		/* Cache the result */
 		last_file.id = id;
 		last_file.client = ctype;
-		strncpy(last_file.path, result[3], sizeof(last_file.path)-1);
-		if( result[4] )
+		strncpy(last_file.path, path, sizeof(last_file.path)-1);
+		if( mime )
 		{
-			strncpy(last_file.mime, result[4], sizeof(last_file.mime)-1);
+			strncpy(last_file.mime, mime, sizeof(last_file.mime)-1);
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
 			if( cflags & FLAG_SAMSUNG )
 			{
@@ -1958,20 +2507,13 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 					strcpy(last_file.mime+6, "divx");
 			}
 		}
-		if( result[5] )
-			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", result[5]);
+		if( sqlite3_column_type(stmt, 2) != SQLITE_NULL )
+			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;",
+			         (const char *)sqlite3_column_text(stmt, 2));
 		else
 			last_file.dlna[0] = '\0';
-		sqlite3_free_table(result);
+		sql_finish(stmt);
 	}
-#if USE_FORK
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		return;
-	}
-#endif
 
 	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
 
@@ -1981,7 +2523,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
-			goto error;
+			return;
 		}
 	}
 	else if( h->reqflags & FLAG_XFERINTERACTIVE )
@@ -1990,7 +2532,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Bad realTimeInfo flag with Interactive request!\n");
 			Send400(h);
-			goto error;
+			return;
 		}
 		if( strncmp(last_file.mime, "image", 5) != 0 )
 		{
@@ -2000,7 +2542,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			if( !(cflags & FLAG_SAMSUNG) || GETFLAG(DLNA_STRICT_MASK) )
 			{
 				Send406(h);
-				goto error;
+				return;
 			}
 		}
 	}
@@ -2011,7 +2553,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send403(h);
 		else
 			Send404(h);
-		goto error;
+		return;
 	}
 	size = lseek(sendfh, 0, SEEK_END);
 	lseek(sendfh, 0, SEEK_SET);
@@ -2027,17 +2569,16 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 
 	INIT_STR(str, header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	/* All transfers share the event loop; a background one is
+	 * served in smaller slices per wakeup by send_file(). */
+	if( h->reqflags & FLAG_XFERBACKGROUND )
 		tmode = "Background";
-	else
-#endif
-	if( strncmp(last_file.mime, "image", 5) == 0 )
+	else if( strncmp(last_file.mime, "image", 5) == 0 )
 		tmode = "Interactive";
 	else
 		tmode = "Streaming";
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+	start_dlna_header(h, &str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
 
 	if( h->reqflags & FLAG_RANGE )
 	{
@@ -2051,14 +2592,14 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			DPRINTF(E_WARN, L_HTTP, "Specified range was invalid!\n");
 			Send400(h);
 			close(sendfh);
-			goto error;
+			return;
 		}
 		if( h->req_RangeEnd >= size )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
 			Send416(h);
 			close(sendfh);
-			goto error;
+			return;
 		}
 
 		total = h->req_RangeEnd - h->req_RangeStart + 1;
@@ -2098,18 +2639,12 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	              last_file.dlna, 1, 0, dlna_flags, 0);
 
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( send_data(h, str.data, str.off, MSG_MORE) == 0 && h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		start_send_file(h, sendfh, offset, h->req_RangeEnd);
+		return;
 	}
 	close(sendfh);
 
 	CloseSocket_upnphttp(h);
-error:
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
-	return;
 }
@@ -51,6 +51,7 @@
 
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <sys/time.h>
 
 #include "minidlnatypes.h"
 #include "config.h"
@@ -58,10 +59,18 @@
 /* server: HTTP header returned in all HTTP responses : */
 #define MINIDLNA_SERVER_STRING	OS_VERSION " DLNADOC/1.50 UPnP/1.0 " SERVER_NAME "/" MINIDLNA_VERSION
 
+/* persistent connections: seconds to wait for the next request,
+ * and the number of requests served before closing anyway */
+#define HTTP_KEEPALIVE_TIMEOUT	15
+#define HTTP_KEEPALIVE_MAX	100
+
 /*
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for chunked request body
+  3 - sending response and/or file body, driven by EVENT_WRITE
+  4 - request handed to a worker thread (see workers.c)
   ...
   >= 100 - to be deleted
 */
@@ -83,28 +92,49 @@ struct upnphttp {
 	/* request */
 	char * req_buf;
 	int req_buflen;
+	int req_buf_alloclen;
+	int req_scanoff;	/* where to resume looking for the end of the headers */
 	int req_contentlen;
 	int req_contentoff;     /* header length */
 	enum httpCommands req_command;
 	struct client_cache_s * req_client;
-	const char * req_soapAction;
+	/* header values are kept as offsets into req_buf, which can move
+	 * while the body arrives; 0 means the header was not sent */
+	int req_soapAction;
 	int req_soapActionLen;
-	const char * req_Callback;	/* For SUBSCRIBE */
+	int req_Callback;	/* For SUBSCRIBE */
 	int req_CallbackLen;
-	const char * req_NT;
+	int req_NT;
 	int req_NTLen;
 	int req_Timeout;
-	const char * req_SID;		/* For UNSUBSCRIBE */
+	int req_SID;		/* For UNSUBSCRIBE */
 	int req_SIDLen;
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
 	long int req_chunklen;
 	uint32_t reqflags;
+	/* copied from the shared tables when a SOAP action starts, so that
+	 * a worker thread never reads them while the main loop updates them */
+	int req_client_type;
+	uint32_t req_client_flags;
+	char req_host[16];
+	uint32_t req_update_id;
 	/* response */
 	char * res_buf;
 	int res_buflen;
 	int res_buf_alloclen;
+	int res_sent;		/* bytes of res_buf already sent (state 3) */
 	uint32_t respflags;
+	const char * res_SID;
+	int res_SIDLen;
+	struct timeval res_sndtimeo;	/* SO_SNDTIMEO to restore after a chunked reply */
+	/* file body being sent (state 3) */
+	int send_fd;
+	off_t send_offset;
+	off_t send_end;
+	/* persistent connection */
+	int requests;		/* requests received on this connection */
+	time_t idle_since;	/* when the last response was completed */
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
 	LIST_ENTRY(upnphttp) entries;
@@ -115,6 +145,7 @@ struct upnphttp {
 #define FLAG_RANGE              0x00000004
 #define FLAG_HOST               0x00000008
 #define FLAG_LANGUAGE           0x00000010
+#define FLAG_NOSENDFILE         0x00000020 /* respflags: use pread()/send() */
 
 #define FLAG_INVALID_REQ        0x00000040
 #define FLAG_HTML               0x00000080
@@ -127,6 +158,9 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_KEEPALIVE          0x00020000
+#define FLAG_CONNCLOSE          0x00040000
+#define FLAG_CONTENTLEN         0x00080000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -136,10 +170,30 @@ struct upnphttp {
 struct upnphttp *
 New_upnphttp(int);
 
-/* CloseSocket_upnphttp() */
+/* CloseSocket_upnphttp()
+ * called once the response has been sent.  Closes the connection,
+ * or, if it is persistent, gets it ready for the next request */
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
+/* Suspend_upnphttp()
+ * stop watching the connection while a worker thread owns it */
+void
+Suspend_upnphttp(struct upnphttp *);
+
+/* Resume_upnphttp()
+ * called from the main loop once the worker has built the response,
+ * which is then sent without blocking */
+void
+Resume_upnphttp(struct upnphttp *);
+
+/* Adopt_upnphttp()
+ * in the main process, take over a connection that an HTTP process
+ * passed on socket s.  *hp is set to the new connection, if any.
+ * returns: 0 success, -1 if the HTTP process is gone */
+int
+Adopt_upnphttp(int s, struct upnphttp **hp);
+
 /* Delete_upnphttp() */
 void
 Delete_upnphttp(struct upnphttp *);
@@ -175,5 +229,13 @@ Send501(struct upnphttp *);
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* SendChunk_upnphttp()
+ * from a worker thread, send len bytes of data as one chunk of a
+ * "Transfer-Encoding: chunked" body, preceded by anything left in
+ * res_buf (the header, on the first call).  len 0 ends the body.
+ * returns: 0 success, -1 if the connection failed */
+int
+SendChunk_upnphttp(struct upnphttp *, const char *, int);
+
 #endif
 
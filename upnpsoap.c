@@ -60,6 +60,8 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "event.h"
 #include "upnpglobalvars.h"
@@ -71,6 +73,8 @@
 #include "getifaddr.h"
 #include "scanner.h"
 #include "sql.h"
+#include "workers.h"
+#include "respcache.h"
 #include "log.h"
 
 #ifdef __sparc__ /* Sorting takes too long on slow processors with very large containers */
@@ -125,26 +129,73 @@ _SoapError(struct upnphttp * h, int errCode, const char * errDesc, const char *f
 	int bodylen;
 
 	DPRINTF(E_WARN, L_HTTP, "%s Returning UPnPError %d: %s\n", func, errCode, errDesc);
+	if (h->respflags & FLAG_CHUNKED)
+	{
+		/* Too late for a fault; cut the response short instead. */
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		CloseSocket_upnphttp(h);
+		return;
+	}
 	bodylen = snprintf(body, sizeof(body), resp, errCode, errDesc);
 	BuildResp2_upnphttp(h, 500, "Internal Server Error", body, bodylen);
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
+static const char beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
+/* A worker thread owns its connection and may block on it, so a large
+ * result can be sent as it is built instead of being held in memory.
+ * Chunked encoding needs an HTTP/1.1 client. */
+static int
+CanStreamSoapResp(struct upnphttp * h)
+{
+	return h->state == 4 && strcmp(h->HttpVer, "HTTP/1.1") == 0;
+}
+
+/* Send the body built so far as a chunk, and empty the buffer.
+ * The first call also sends the header and the SOAP envelope. */
+static int
+StreamSoapResp(struct upnphttp * h, struct string_s * str)
+{
+	if (!(h->respflags & FLAG_CHUNKED))
+	{
+		h->respflags |= FLAG_CHUNKED;
+		BuildHeader_upnphttp(h, 200, "OK", 0);
+		if (SendChunk_upnphttp(h, beforebody, sizeof(beforebody) - 1) < 0)
+			return -1;
+	}
+	if (SendChunk_upnphttp(h, str->data, str->off) < 0)
+		return -1;
+	str->off = 0;
+
+	return 0;
+}
+
 static void
 BuildSendAndCloseSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
+	if (h->respflags & FLAG_CHUNKED)
+	{
+		/* the rest of the body went out with StreamSoapResp() */
+		if (body && bodylen > 0 &&
+		    SendChunk_upnphttp(h, body, bodylen) == 0 &&
+		    SendChunk_upnphttp(h, afterbody, sizeof(afterbody) - 1) == 0)
+			SendChunk_upnphttp(h, NULL, 0);
+		else
+			h->reqflags &= ~FLAG_KEEPALIVE;
+		CloseSocket_upnphttp(h);
+		return;
+	}
 	if (!body || bodylen < 0)
 	{
 		Send500(h);
@@ -421,7 +472,7 @@ set_filter_flags(char *filter, struct upnphttp *h)
 {
 	char *item, *saveptr = NULL;
 	uint32_t flags = 0;
-	int samsung = h->req_client && (h->req_client->type->flags & FLAG_SAMSUNG);
+	int samsung = h->req_client_flags & FLAG_SAMSUNG;
 
 	if( !filter || (strlen(filter) <= 1) ) {
 		/* Not the full 32 bits.  Skip vendor-specific stuff by default. */
@@ -643,7 +694,7 @@ parse_sort_criteria(char *sortCriteria, int *error)
 		}
 		else if( strcasecmp(item, "dc:title") == 0 )
 		{
-			strcatf(&str, "d.TITLE COLLATE naturalsort");
+			strcatf(&str, "o.TITLE_KEY");
 			title_sorted = 1;
 		}
 		else if( strcasecmp(item, "dc:date") == 0 )
@@ -687,7 +738,7 @@ parse_sort_criteria(char *sortCriteria, int *error)
 	}
 	/* Add a "tiebreaker" sort order */
 	if( !title_sorted )
-		strcatf(&str, ", d.TITLE COLLATE naturalsort ASC");
+		strcatf(&str, ", o.TITLE_KEY ASC");
 
 	if( force_sort_criteria )
 		free(sortCriteria);
@@ -724,6 +775,20 @@ _alphasort_alt_title(char **title, char **alt_title, int requested, int returned
 	free(old_title);
 }
 
+/* Append "&lt;TAG&gt;VAL&lt;/TAG&gt;" or ' NAME="VAL"' without going through
+ * the printf machinery; the escaped markup is glued together at compile time. */
+#define add_tag(str, tag, val) do { \
+	strcatl(str, "&lt;" tag "&gt;"); \
+	strcats(str, val); \
+	strcatl(str, "&lt;/" tag "&gt;"); \
+} while (0)
+#define add_attr(str, name, val) do { \
+	strcatl(str, name "=\""); \
+	strcats(str, val); \
+	strcatl(str, "\" "); \
+} while (0)
+#define add_url(str, args) strcatn(str, (args)->url, (args)->url_len)
+
 inline static void
 add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
                 char *detailID, struct Response *args)
@@ -747,10 +812,10 @@ add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
 	}
 	strcatf(args->str, "protocolInfo=\"http-get:*:image/jpeg:"
 	                          "DLNA.ORG_PN=%s;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\"&gt;"
-	                          "http://%s:%d/Resized/%s.jpg?width=%d,height=%d"
+	                          "%s/Resized/%s.jpg?width=%d,height=%d"
 	                          "&lt;/res&gt;",
 	                          dlna_pn, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 0,
-	                          lan_addr[args->iface].str, runtime_vars.port,
+	                          args->url,
 	                          detailID, dstw, dsth);
 }
 
@@ -759,12 +824,12 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
         char *nrAudioChannels, char *resolution, char *dlna_pn, char *mime,
         char *detailID, const char *ext, struct Response *args)
 {
-	strcatf(args->str, "&lt;res ");
+	strcatl(args->str, "&lt;res ");
 	if( size && (args->filter & FILTER_RES_SIZE) ) {
-		strcatf(args->str, "size=\"%s\" ", size);
+		add_attr(args->str, "size", size);
 	}
 	if( duration && (args->filter & FILTER_RES_DURATION) ) {
-		strcatf(args->str, "duration=\"%s\" ", duration);
+		add_attr(args->str, "duration", duration);
 	}
 	if( bitrate && (args->filter & FILTER_RES_BITRATE) ) {
 		int br = atoi(bitrate);
@@ -773,13 +838,13 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
 		strcatf(args->str, "bitrate=\"%d\" ", br);
 	}
 	if( sampleFrequency && (args->filter & FILTER_RES_SAMPLEFREQUENCY) ) {
-		strcatf(args->str, "sampleFrequency=\"%s\" ", sampleFrequency);
+		add_attr(args->str, "sampleFrequency", sampleFrequency);
 	}
 	if( nrAudioChannels && (args->filter & FILTER_RES_NRAUDIOCHANNELS) ) {
-		strcatf(args->str, "nrAudioChannels=\"%s\" ", nrAudioChannels);
+		add_attr(args->str, "nrAudioChannels", nrAudioChannels);
 	}
 	if( resolution && (args->filter & FILTER_RES_RESOLUTION) ) {
-		strcatf(args->str, "resolution=\"%s\" ", resolution);
+		add_attr(args->str, "resolution", resolution);
 	}
 	if( args->filter & FILTER_PV_SUBTITLE )
 	{
@@ -788,46 +853,388 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
 			if( args->filter & FILTER_PV_SUBTITLE_FILE_TYPE )
 				strcatf(args->str, "pv:subtitleFileType=\"SRT\" ");
 			if( args->filter & FILTER_PV_SUBTITLE_FILE_URI )
-				strcatf(args->str, "pv:subtitleFileUri=\"http://%s:%d/Captions/%s.srt\" ",
-					lan_addr[args->iface].str, runtime_vars.port, detailID);
+				strcatf(args->str, "pv:subtitleFileUri=\"%s/Captions/%s.srt\" ",
+					args->url, detailID);
 		}
 	}
-	strcatf(args->str, "protocolInfo=\"http-get:*:%s:%s\"&gt;"
-	                          "http://%s:%d/MediaItems/%s.%s"
-	                          "&lt;/res&gt;",
-	                          mime, dlna_pn, lan_addr[args->iface].str,
-	                          runtime_vars.port, detailID, ext);
+	strcatl(args->str, "protocolInfo=\"http-get:*:");
+	strcats(args->str, mime);
+	strcatl(args->str, ":");
+	strcats(args->str, dlna_pn);
+	strcatl(args->str, "\"&gt;");
+	add_url(args->str, args);
+	strcatl(args->str, "/MediaItems/");
+	strcats(args->str, detailID);
+	strcatl(args->str, ".");
+	strcats(args->str, ext);
+	strcatl(args->str, "&lt;/res&gt;");
 }
 
 static int
-get_child_count(const char *object, struct magic_container_s *magic)
+get_child_count(sqlite3 *db, const char *object, struct magic_container_s *magic)
 {
-	int ret;
+	sqlite3_stmt *stmt;
+	int ret = 0;
 
 	if (magic && magic->child_count)
 		ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
-	else if (magic && magic->objectid && *(magic->objectid))
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", *(magic->objectid));
-	else
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+	else if ((stmt = sql_prepare(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?")))
+	{
+		if (magic && magic->objectid && *(magic->objectid))
+			object = *(magic->objectid);
+		sqlite3_bind_text(stmt, 1, object, -1, SQLITE_STATIC);
+		if (sql_step(stmt) == SQLITE_ROW)
+			ret = sqlite3_column_int(stmt, 0);
+		sql_finish(stmt);
+	}
 
 	return (ret > 0) ? ret : 0;
 }
 
 static int
-object_exists(const char *object)
+object_exists(sqlite3 *db, const char *object)
 {
+	sqlite3_stmt *stmt;
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
-				strcmp(object, "*") == 0 ? "0" : object);
-	return (ret > 0);
+
+	stmt = sql_prepare(db, "SELECT 1 from OBJECTS where OBJECT_ID = ?");
+	if (!stmt)
+		return 0;
+	sqlite3_bind_text(stmt, 1, strcmp(object, "*") == 0 ? "0" : object, -1, SQLITE_STATIC);
+	ret = (sql_step(stmt) == SQLITE_ROW);
+	sql_finish(stmt);
+
+	return ret;
+}
+
+/* The columns callback() reads after the object, parent and reference
+ * IDs, in order, with the filter bits and client flags that make it
+ * read each one.  The ones with neither are always needed. */
+static const struct {
+	const char *name;
+	uint32_t filter;
+	uint32_t flags;
+} columns[] = {
+	{ "o.DETAIL_ID",	0, 0 },
+	{ "o.CLASS",		0, 0 },
+	{ "d.SIZE",		0, 0 },	/* storageUsed of every folder */
+	{ "d.TITLE",		0, 0 },
+	{ "d.DURATION",		FILTER_RES_DURATION, 0 },
+	{ "d.BITRATE",		FILTER_RES_BITRATE, 0 },
+	{ "d.SAMPLERATE",	FILTER_RES_SAMPLEFREQUENCY, 0 },
+	{ "d.ARTIST",		FILTER_UPNP_ARTIST | FILTER_UPNP_ACTOR, 0 },
+	{ "d.ALBUM",		FILTER_UPNP_ALBUM, FLAG_MS_PFS },
+	{ "d.GENRE",		FILTER_UPNP_GENRE, 0 },
+	{ "d.COMMENT",		FILTER_DC_DESCRIPTION, 0 },
+	{ "d.CHANNELS",		FILTER_RES_NRAUDIOCHANNELS, 0 },
+	{ "d.TRACK",		FILTER_UPNP_ORIGINALTRACKNUMBER | FILTER_UPNP_EPISODENUMBER |
+				FILTER_UPNP_EPISODESEASON, 0 },
+	{ "d.DATE",		FILTER_DC_DATE, 0 },
+	{ "d.RESOLUTION",	FILTER_RES, 0 },
+	{ "d.THUMBNAIL",	FILTER_RES, FLAG_MS_PFS },
+	{ "d.CREATOR",		FILTER_DC_CREATOR, FLAG_MIME_AVI_DIVX },
+	{ "d.DLNA_PN",		FILTER_RES, 0 },
+	{ "d.MIME",		0, 0 },
+	{ "d.ALBUM_ART",	FILTER_RES | FILTER_UPNP_ALBUMARTURI, 0 },
+	{ "d.ROTATION",		FILTER_RES, FLAG_MS_PFS },
+	{ "d.DISC",		FILTER_UPNP_EPISODESEASON, 0 },
+	{ "o.CHILD_COUNT",	FILTER_CHILDCOUNT, 0 },
+	{ "c.ID",		FILTER_SEC_CAPTION_INFO_EX | FILTER_PV_SUBTITLE, FLAG_CAPTION_RES },
+	{ "b.SEC",		FILTER_UPNP_LASTPLAYBACKPOSITION | FILTER_SEC_DCM_INFO, 0 },
+	{ "b.WATCH_COUNT",	FILTER_UPNP_PLAYBACKCOUNT, 0 },
+};
+/* room for every name in columns[], and NULL is no longer than any */
+#define COLUMNS_SIZE 384
+#define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, %s"
+/* a compound Search can only order by columns it selects */
+#define SEARCH_COLUMNS SELECT_COLUMNS ", o.TITLE_KEY "
+/* sort keys selected after the columns, for keyset paging */
+#define KEY_COLUMNS 29
+/* captions and bookmarks come along with each row, instead of
+ * costing a query per item */
+#define FROM_OBJECTS "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)" \
+                     " left join CAPTIONS c on (c.ID = o.DETAIL_ID)" \
+                     " left join BOOKMARKS b on (b.ID = o.DETAIL_ID)"
+
+/* Fill buf with the column list for a response with these filter bits
+ * and client flags.  Columns that nothing will print, and that order
+ * does not sort by, are selected as NULL: rows keep the shape callback()
+ * expects, and joins whose columns all go unused drop out of the plan. */
+static void
+filter_columns(char *buf, uint32_t filter, uint32_t flags, const char *order)
+{
+	struct string_s str;
+	int i, used;
+
+	str.data = buf;
+	str.off = 0;
+	str.size = COLUMNS_SIZE;
+	/* callback() also reads these outside of the properties they carry */
+	if( GETFLAG(FORCE_ALPHASORT_MASK) )
+		filter |= FILTER_UPNP_ORIGINALTRACKNUMBER | FILTER_UPNP_EPISODESEASON;
+	if( GETFLAG(SUBTITLES_MASK) )
+		flags |= FLAG_CAPTION_RES;
+	for( i = 0; i < sizeof(columns) / sizeof(columns[0]); i++ )
+	{
+		used = (!columns[i].filter && !columns[i].flags) ||
+		       (filter & columns[i].filter) || (flags & columns[i].flags) ||
+		       (order && strstr(order, columns[i].name));
+		strcatf(&str, "%s%s", i ? ", " : "", used ? columns[i].name : "NULL");
+	}
+	strcatf(&str, " ");
 }
 
-#define COLUMNS "o.DETAIL_ID, o.CLASS," \
-                " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
-                " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
-#define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
+/* Paging through a big container with "limit StartingIndex, N" makes
+ * SQLite walk and discard every row before the page.  Instead, remember
+ * the sort keys of the last row each client got, and when it asks for
+ * the page right after it, start from there with a where clause. */
+#define CURSOR_SLOTS	16
+#define CURSOR_KEYS	8
+
+struct order_term {
+	char column[32];
+	char collate[32];
+	int desc;
+};
+
+struct sort_cursor {
+	struct in_addr addr;
+	unsigned int update_id;
+	char *object_id;
+	char *order;
+	int next;		/* StartingIndex of the next page */
+	time_t used;
+	int nkeys;
+	int key[CURSOR_KEYS];	/* offset in buf, or -1 for NULL */
+	char buf[512];
+};
+
+static struct sort_cursor cursors[CURSOR_SLOTS];
+static pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Split an "order by" clause into its terms.  Only plain columns can be
+ * compared with the saved keys, so anything else returns -1.  A unique
+ * column is appended if needed, so that every row has its own key. */
+static int
+parse_order_terms(const char *orderBy, struct order_term *terms)
+{
+	const char *p = orderBy + 9;
+	int n = 0, len;
+
+	if( strncasecmp(orderBy, "order by ", 9) != 0 )
+		return -1;
+	for( ;; )
+	{
+		if( n >= CURSOR_KEYS - 1 )
+			return -1;
+		memset(&terms[n], 0, sizeof(terms[n]));
+		while( *p == ' ' )
+			p++;
+		len = strspn(p, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_.");
+		if( !len || len >= sizeof(terms[n].column) )
+			return -1;
+		memcpy(terms[n].column, p, len);
+		p += len;
+		if( strncasecmp(p, " COLLATE ", 9) == 0 )
+		{
+			p += 9;
+			len = strspn(p, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_");
+			if( !len || len >= sizeof(terms[n].collate) )
+				return -1;
+			memcpy(terms[n].collate, p, len);
+			p += len;
+		}
+		if( strncasecmp(p, " ASC", 4) == 0 )
+			p += 4;
+		else if( strncasecmp(p, " DESC", 5) == 0 )
+		{
+			terms[n].desc = 1;
+			p += 5;
+		}
+		n++;
+		if( *p == '\0' )
+			break;
+		if( *p++ != ',' )
+			return -1;
+	}
+	if( strcmp(terms[n-1].column, "o.OBJECT_ID") != 0 &&
+	    strcmp(terms[n-1].column, "o.ID") != 0 )
+	{
+		memset(&terms[n], 0, sizeof(terms[n]));
+		strcpy(terms[n++].column, "o.ID");
+	}
+
+	return n;
+}
+
+static void
+save_cursor_keys(struct sort_cursor *c, int argc, char **argv)
+{
+	int i, len, off = 0;
+
+	c->nkeys = 0;
+	for( i = KEY_COLUMNS; i < argc && c->nkeys < CURSOR_KEYS; i++ )
+	{
+		if( !argv[i] )
+		{
+			c->key[c->nkeys++] = -1;
+			continue;
+		}
+		len = strlen(argv[i]) + 1;
+		if( off + len > sizeof(c->buf) )
+		{
+			c->nkeys = 0;
+			return;
+		}
+		memcpy(c->buf + off, argv[i], len);
+		c->key[c->nkeys++] = off;
+		off += len;
+	}
+}
+
+/* Build the where clause for the rows that sort after the cursor.
+ * The keys are left as parameters ?4 onwards, see bind_cursor(), so
+ * that every page of a container shares one statement.
+ * NULL sorts first, like SQLite does. */
+static char *
+cursor_where(const struct sort_cursor *c, const struct order_term *terms, int n)
+{
+	char *expr[CURSOR_KEYS];
+	int null;
+	char *sql = NULL;
+	int i;
+
+	for( i = 0; i < n; i++ )
+		expr[i] = sqlite3_mprintf("%s%s%s", terms[i].column,
+		                          terms[i].collate[0] ? " COLLATE " : "", terms[i].collate);
+	/* a bound on the first key lets SQLite seek to it */
+	if( c->key[0] >= 0 && !terms[0].desc )
+		sql = sqlite3_mprintf("%s >= ?4 and ", expr[0]);
+	for( i = 0; i < n; i++ )
+	{
+		null = (c->key[i] < 0);
+		if( !terms[i].desc )
+			sql = !null ? sqlite3_mprintf("%z(%s > ?%d", sql, expr[i], i + 4)
+			            : sqlite3_mprintf("%z(%s is not NULL", sql, expr[i]);
+		else
+			sql = !null ? sqlite3_mprintf("%z(%s < ?%d or %s is NULL", sql, expr[i], i + 4, expr[i])
+			            : sqlite3_mprintf("%z(0", sql);
+		if( i < n - 1 )
+			sql = !null ? sqlite3_mprintf("%z or %s = ?%d and ", sql, expr[i], i + 4)
+			            : sqlite3_mprintf("%z or %s is NULL and ", sql, expr[i]);
+	}
+	for( i = 0; i < n; i++ )
+	{
+		sql = sqlite3_mprintf("%z)", sql);
+		sqlite3_free(expr[i]);
+	}
+
+	return sql;
+}
+
+/* Bind the keys that cursor_where() left as parameters */
+static void
+bind_cursor(sqlite3_stmt *stmt, const struct sort_cursor *c)
+{
+	int i;
+
+	for( i = 0; i < c->nkeys; i++ )
+	{
+		if( c->key[i] >= 0 )
+			sqlite3_bind_text(stmt, i + 4, c->buf + c->key[i], -1, SQLITE_STATIC);
+	}
+}
+
+/* Rebuild the "order by" clause from its terms, along with the list
+ * of sort keys to select after the columns. */
+static void
+order_terms_sql(const struct order_term *terms, int n, char **order, char **keys)
+{
+	int i;
+
+	*order = sqlite3_mprintf("order by");
+	*keys = NULL;
+	for( i = 0; i < n; i++ )
+	{
+		*order = sqlite3_mprintf("%z%s %s%s%s%s", *order, i ? "," : "",
+		                         terms[i].column,
+		                         terms[i].collate[0] ? " COLLATE " : "", terms[i].collate,
+		                         terms[i].desc ? " DESC" : "");
+		*keys = sqlite3_mprintf("%z, %s", *keys, terms[i].column);
+	}
+	*keys = sqlite3_mprintf("%z ", *keys);
+}
+
+/* Look for a cursor at StartingIndex start, copy its keys to found, and
+ * turn it into a where clause.  Returns NULL if this page has to be found
+ * the slow way. */
+static char *
+find_cursor(struct in_addr addr, uint32_t update_id, const char *object_id,
+            const char *order, int start, const struct order_term *terms, int n,
+            struct sort_cursor *found)
+{
+	char *sql = NULL;
+	int i;
+
+	pthread_mutex_lock(&cursor_lock);
+	for( i = 0; i < CURSOR_SLOTS; i++ )
+	{
+		struct sort_cursor *c = &cursors[i];
+		if( !c->object_id || c->addr.s_addr != addr.s_addr ||
+		    c->next != start || c->update_id != update_id ||
+		    c->nkeys != n || strcmp(c->object_id, object_id) != 0 ||
+		    strcmp(c->order, order) != 0 )
+			continue;
+		c->used = time(NULL);
+		found->nkeys = c->nkeys;
+		memcpy(found->key, c->key, sizeof(c->key));
+		memcpy(found->buf, c->buf, sizeof(c->buf));
+		sql = cursor_where(c, terms, n);
+		break;
+	}
+	pthread_mutex_unlock(&cursor_lock);
+
+	return sql;
+}
+
+/* Remember where the page that was just sent ended. */
+static void
+save_cursor(struct sort_cursor *new, struct in_addr addr, uint32_t update_id,
+            const char *object_id, const char *order, int next)
+{
+	struct sort_cursor *c = NULL;
+	int i;
+
+	pthread_mutex_lock(&cursor_lock);
+	for( i = 0; i < CURSOR_SLOTS; i++ )
+	{
+		/* a client only pages through one container at a time */
+		if( cursors[i].object_id && cursors[i].addr.s_addr == addr.s_addr &&
+		    strcmp(cursors[i].object_id, object_id) == 0 )
+		{
+			c = &cursors[i];
+			break;
+		}
+		if( !c || cursors[i].used < c->used )
+			c = &cursors[i];
+	}
+	free(c->object_id);
+	free(c->order);
+	memcpy(c, new, sizeof(*c));
+	c->addr = addr;
+	c->update_id = update_id;
+	c->object_id = strdup(object_id);
+	c->order = strdup(order);
+	c->next = next;
+	c->used = time(NULL);
+	if( !c->object_id || !c->order )
+	{
+		free(c->object_id);
+		free(c->order);
+		c->object_id = c->order = NULL;
+	}
+	pthread_mutex_unlock(&cursor_lock);
+}
 
 static int
 callback(void *args, int argc, char **argv, char **azColName)
@@ -836,14 +1243,23 @@ callback(void *args, int argc, char **argv, char **azColName)
 	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
 	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
 	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23], *disc = argv[24];
+	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23], *disc = argv[24],
+	     *childCount = argv[25], *caption = argv[26], *bookmark = argv[27], *watchCount = argv[28];
 	char dlna_buf[128];
 	const char *ext;
 	struct string_s *str = passed_args->str;
 	int ret = 0;
 
 	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
-	if( str->off > (str->size - 8192) )
+	if( str->off > (str->size - 8192) && passed_args->stream )
+	{
+		if( StreamSoapResp(passed_args->stream, str) < 0 )
+		{
+			passed_args->flags |= RESPONSE_TRUNCATED;
+			return 1;
+		}
+	}
+	else if( str->off > (str->size - 8192) )
 	{
 #if MAX_RESPONSE_SIZE > 0
 		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
@@ -874,6 +1290,8 @@ callback(void *args, int argc, char **argv, char **azColName)
 	}
 	passed_args->returned++;
 	passed_args->flags &= ~RESPONSE_FLAGS;
+	if( passed_args->cursor )
+		save_cursor_keys(passed_args->cursor, argc, argv);
 
 	if( strncmp(class, "item", 4) == 0 )
 	{
@@ -923,7 +1341,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			if( (passed_args->flags & FLAG_CAPTION_RES) ||
 			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
 			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
+				if( caption )
 					passed_args->flags |= FLAG_HAS_CAPTIONS;
 			}
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
@@ -1001,26 +1419,33 @@ callback(void *args, int argc, char **argv, char **azColName)
 		else
 			strcpy(dlna_buf, "*");
 
-		ret = strcatf(str, "&lt;item id=\"%s\" parentID=\"%s\" restricted=\"1\"", id, parent);
+		strcatl(str, "&lt;item id=\"");
+		strcats(str, id);
+		strcatl(str, "\" parentID=\"");
+		strcats(str, parent);
+		strcatl(str, "\" restricted=\"1\"");
 		if( refID && (passed_args->filter & FILTER_REFID) ) {
-			ret = strcatf(str, " refID=\"%s\"", refID);
-		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+			strcatl(str, " refID=\"");
+			strcats(str, refID);
+			strcatl(str, "\"");
+		}
+		strcatl(str, "&gt;");
+		add_tag(str, "dc:title", title);
+		strcatl(str, "&lt;upnp:class&gt;object.");
+		strcats(str, class);
+		strcatl(str, "&lt;/upnp:class&gt;");
 		if( comment && (passed_args->filter & FILTER_DC_DESCRIPTION) ) {
 			ret = strcatf(str, "&lt;dc:description&gt;%.384s&lt;/dc:description&gt;", comment);
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			add_tag(str, "dc:creator", creator);
 		}
 		if( date && (passed_args->filter & FILTER_DC_DATE) ) {
-			ret = strcatf(str, "&lt;dc:date&gt;%s&lt;/dc:date&gt;", date);
+			add_tag(str, "dc:date", date);
 		}
 		if( (passed_args->filter & FILTER_BOOKMARK_MASK) ) {
 			/* Get bookmark */
-			int sec = sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID);
+			int sec = bookmark ? atoi(bookmark) : 0;
 			if( sec > 0 ) {
 				/* This format is wrong according to the UPnP/AV spec.  It should be in duration format,
 				** so HH:MM:SS. But Kodi seems to be the only user of this tag, and it only works with a
@@ -1038,35 +1463,35 @@ callback(void *args, int argc, char **argv, char **azColName)
 			}
 			if( passed_args->filter & FILTER_UPNP_PLAYBACKCOUNT ) {
 				ret = strcatf(str, "&lt;upnp:playbackCount&gt;%d&lt;/upnp:playbackCount&gt;",
-				              sql_get_int_field(db, "SELECT WATCH_COUNT from BOOKMARKS where ID = '%s'", detailID));
+				              watchCount ? atoi(watchCount) : 0);
 			}
 		}
 		free(alt_title);
 		if( artist ) {
 			if( (*mime == 'v') && (passed_args->filter & FILTER_UPNP_ACTOR) ) {
-				ret = strcatf(str, "&lt;upnp:actor&gt;%s&lt;/upnp:actor&gt;", artist);
+				add_tag(str, "upnp:actor", artist);
 			}
 			if( passed_args->filter & FILTER_UPNP_ARTIST ) {
-				ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+				add_tag(str, "upnp:artist", artist);
 			}
 		}
 		if( album && (passed_args->filter & FILTER_UPNP_ALBUM) ) {
-			ret = strcatf(str, "&lt;upnp:album&gt;%s&lt;/upnp:album&gt;", album);
+			add_tag(str, "upnp:album", album);
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			add_tag(str, "upnp:genre", genre);
 		}
 		if( strncmp(id, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 ) {
 			track = strrchr(id, '$')+1;
 		}
 		if( NON_ZERO(track) ) {
 			if( *mime == 'a' && (passed_args->filter & FILTER_UPNP_ORIGINALTRACKNUMBER) ) {
-				ret = strcatf(str, "&lt;upnp:originalTrackNumber&gt;%s&lt;/upnp:originalTrackNumber&gt;", track);
+				add_tag(str, "upnp:originalTrackNumber", track);
 			} else if( *mime == 'v' ) {
 				if( NON_ZERO(disc) && (passed_args->filter & FILTER_UPNP_EPISODESEASON) )
-					ret = strcatf(str, "&lt;upnp:episodeSeason&gt;%s&lt;/upnp:episodeSeason&gt;", disc);
+					add_tag(str, "upnp:episodeSeason", disc);
 				if( passed_args->filter & FILTER_UPNP_EPISODENUMBER )
-					ret = strcatf(str, "&lt;upnp:episodeNumber&gt;%s&lt;/upnp:episodeNumber&gt;", track);
+					add_tag(str, "upnp:episodeNumber", track);
 			}
 		}
 		if( passed_args->filter & FILTER_RES ) {
@@ -1086,10 +1511,9 @@ callback(void *args, int argc, char **argv, char **azColName)
 				}
 				if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
 					ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:%s:%s\"&gt;"
-					                   "http://%s:%d/Thumbnails/%s.jpg"
+					                   "%s/Thumbnails/%s.jpg"
 					                   "&lt;/res&gt;",
-					                   mime, "DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1", lan_addr[passed_args->iface].str,
-					                   runtime_vars.port, detailID);
+					                   mime, "DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1", passed_args->url, detailID);
 				}
 				else
 					add_resized_res(srcw, srch, 160, 160, "JPEG_TN", detailID, passed_args);
@@ -1170,14 +1594,14 @@ callback(void *args, int argc, char **argv, char **azColName)
 					{
 						if( passed_args->flags & FLAG_CAPTION_RES )
 							ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:text/srt:*\"&gt;"
-									     "http://%s:%d/Captions/%s.srt"
+									     "%s/Captions/%s.srt"
 									   "&lt;/res&gt;",
-									   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+									   passed_args->url, detailID);
 						if( passed_args->filter & FILTER_SEC_CAPTION_INFO_EX )
 							ret = strcatf(str, "&lt;sec:CaptionInfoEx sec:type=\"srt\"&gt;"
-							                     "http://%s:%d/Captions/%s.srt"
+							                     "%s/Captions/%s.srt"
 							                   "&lt;/sec:CaptionInfoEx&gt;",
-							                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+							                   passed_args->url, detailID);
 					}
 					break;
 				}
@@ -1188,25 +1612,30 @@ callback(void *args, int argc, char **argv, char **azColName)
 			/* Video and audio album art is handled differently */
 			if( *mime == 'v' && (passed_args->filter & FILTER_RES) && !(passed_args->flags & FLAG_MS_PFS) ) {
 				ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\"&gt;"
-				                   "http://%s:%d/AlbumArt/%s-%s.jpg"
+				                   "%s/AlbumArt/%s-%s.jpg"
 				                   "&lt;/res&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				                   passed_args->url, album_art, detailID);
 				if (passed_args->client == ESamsungSeriesCDE ) {
 					ret = strcatf(str, "&lt;res dlna:profileID=\"JPEG_SM\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\""
 							   " protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_SM;"
 							   "DLNA.ORG_OP=01;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\" resolution=\"320x320\"&gt;"
-							   "http://%s:%d/AlbumArt/%s-%s.jpg"
+							   "%s/AlbumArt/%s-%s.jpg"
 							   "&lt;/res&gt;",
 							   DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 0,
-							   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+							   passed_args->url, album_art, detailID);
 				}
 			} else if( passed_args->filter & FILTER_UPNP_ALBUMARTURI ) {
 				ret = strcatf(str, "&lt;upnp:albumArtURI");
 				if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
 					ret = strcatf(str, " dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 				}
-				ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				strcatl(str, "&gt;");
+				add_url(str, passed_args);
+				strcatl(str, "/AlbumArt/");
+				strcats(str, album_art);
+				strcatl(str, "-");
+				strcats(str, detailID);
+				strcatl(str, ".jpg&lt;/upnp:albumArtURI&gt;");
 			}
 		}
 		if( (passed_args->flags & FLAG_MS_PFS) && *mime == 'i' ) {
@@ -1216,26 +1645,32 @@ callback(void *args, int argc, char **argv, char **azColName)
 			/* EVA2000 doesn't seem to handle embedded thumbnails */
 			if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
 				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Thumbnails/%s.jpg"
+				                   "%s/Thumbnails/%s.jpg"
 				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				                   passed_args->url, detailID);
 			} else {
 				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Resized/%s.jpg?width=160,height=160"
+				                   "%s/Resized/%s.jpg?width=160,height=160"
 				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				                   passed_args->url, detailID);
 			}
 		}
-		ret = strcatf(str, "&lt;/item&gt;");
+		strcatl(str, "&lt;/item&gt;");
 	}
 	else if( strncmp(class, "container", 9) == 0 )
 	{
-		ret = strcatf(str, "&lt;container id=\"%s\" parentID=\"%s\" restricted=\"1\" ", id, parent);
+		struct magic_container_s *magic = check_magic_container(id, passed_args->flags);
+		strcatl(str, "&lt;container id=\"");
+		strcats(str, id);
+		strcatl(str, "\" parentID=\"");
+		strcats(str, parent);
+		strcatl(str, "\" restricted=\"1\" ");
 		if( passed_args->filter & FILTER_SEARCHABLE ) {
-			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
+			ret = strcatf(str, "searchable=\"%d\" ", magic ? 0 : 1);
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
-			ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags)));
+			ret = strcatf(str, "childCount=\"%d\"", magic ? get_child_count(passed_args->db, id, magic)
+			                                         : (childCount ? atoi(childCount) : 0));
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
 		if( passed_args->requested == 1 && strcmp(id, "0") == 0 && (passed_args->filter & FILTER_UPNP_SEARCHCLASS) ) {
@@ -1244,30 +1679,36 @@ callback(void *args, int argc, char **argv, char **azColName)
 			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.imageItem&lt;/upnp:searchClass&gt;"
 			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.videoItem&lt;/upnp:searchClass");
 		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+		strcatl(str, "&gt;");
+		add_tag(str, "dc:title", title);
+		strcatl(str, "&lt;upnp:class&gt;object.");
+		strcats(str, class);
+		strcatl(str, "&lt;/upnp:class&gt;");
 		if( (passed_args->filter & FILTER_UPNP_STORAGEUSED) || strcmp(class+10, "storageFolder") == 0 ) {
 			/* TODO: Implement real folder size tracking */
-			ret = strcatf(str, "&lt;upnp:storageUsed&gt;%s&lt;/upnp:storageUsed&gt;", (size ? size : "-1"));
+			add_tag(str, "upnp:storageUsed", (size ? size : "-1"));
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			add_tag(str, "dc:creator", creator);
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			add_tag(str, "upnp:genre", genre);
 		}
 		if( artist && (passed_args->filter & FILTER_UPNP_ARTIST) ) {
-			ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+			add_tag(str, "upnp:artist", artist);
 		}
 		if( NON_ZERO(album_art) && (passed_args->filter & FILTER_UPNP_ALBUMARTURI) ) {
 			ret = strcatf(str, "&lt;upnp:albumArtURI ");
 			if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
 				ret = strcatf(str, "dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 			}
-			ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-			                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+			strcatl(str, "&gt;");
+			add_url(str, passed_args);
+			strcatl(str, "/AlbumArt/");
+			strcats(str, album_art);
+			strcatl(str, "-");
+			strcats(str, detailID);
+			strcatl(str, ".jpg&lt;/upnp:albumArtURI&gt;");
 		}
 		if( passed_args->filter & FILTER_AV_MEDIA_CLASS ) {
 			char class;
@@ -1283,12 +1724,29 @@ callback(void *args, int argc, char **argv, char **azColName)
 				ret = strcatf(str, "&lt;av:mediaClass xmlns:av=\"urn:schemas-sony-com:av\"&gt;"
 				                    "%c&lt;/av:mediaClass&gt;", class);
 		}
-		ret = strcatf(str, "&lt;/container&gt;");
+		strcatl(str, "&lt;/container&gt;");
 	}
 
 	return 0;
 }
 
+/* Key of a cached Browse or Search response: everything the reply
+ * depends on, other than the library itself. */
+static char *
+soap_cache_key(char action, const char *id, const char *what, const char *sort,
+               int start, int count, uint32_t update_id, const struct Response *args)
+{
+	char *key = NULL;
+
+	if (xasprintf(&key, "%c %d %d %u %d %u %u %u\n%zu:%s\n%zu:%s\n%s",
+	              action, start, count, update_id, args->iface, args->filter,
+	              args->client, args->flags,
+	              strlen(id), id, strlen(THISORNUL(what)), THISORNUL(what),
+	              THISORNUL(sort)) < 0)
+		return NULL;
+	return key;
+}
+
 static void
 BrowseContentDirectory(struct upnphttp * h, const char * action)
 {
@@ -1299,8 +1757,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	sqlite3_stmt *stmt;
+	char *sql = NULL;
+	char *ptr, *key = NULL, *cached;
+	size_t cachedlen;
+	unsigned int gen;
 	struct Response args;
 	struct string_s str;
 	int totalMatches = 0;
@@ -1312,6 +1773,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	const char *refid_sql = "o.REF_ID";
 	char where[256] = "";
 	char *orderBy = NULL;
+	struct order_term terms[CURSOR_KEYS];
+	struct sort_cursor cursor, resume;
+	char *order = NULL, *keys = NULL, *cursor_sql = NULL;
+	char cols[COLUMNS_SIZE];
+	int paged = 0, nterms = 0;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
@@ -1358,6 +1824,8 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
 	args.iface = h->iface;
+	args.url_len = snprintf(args.url, sizeof(args.url), "http://%s:%d",
+	                        h->req_host, runtime_vars.port);
 	args.filter = set_filter_flags(Filter, h);
 	if( args.filter & FILTER_DLNA_NAMESPACE )
 		ret = strcatf(&str, DLNA_NAMESPACE);
@@ -1369,9 +1837,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
-	args.flags = h->req_client ? h->req_client->type->flags : 0;
+	args.client = h->req_client_type;
+	args.flags = h->req_client_flags;
 	args.str = &str;
+	args.db = worker_db();
+	args.stream = CanStreamSoapResp(h) ? h : NULL;
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1382,6 +1852,18 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				ObjectID, RequestedCount, StartingIndex,
 	                        BrowseFlag, Filter, SortCriteria);
 
+	key = soap_cache_key('B', ObjectID, BrowseFlag, SortCriteria,
+	                     StartingIndex, RequestedCount, h->req_update_id, &args);
+	respcache_sync(db_changes(args.db));
+	if (key && (cached = respcache_get(key, &cachedlen, &gen)))
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Browse response from cache\n");
+		BuildSendAndCloseSoapResp(h, cached, cachedlen);
+		free(cached);
+		goto browse_error;
+	}
+
+	filter_columns(cols, args.filter, args.flags, NULL);
 	if( strcmp(BrowseFlag+6, "Metadata") == 0 )
 	{
 		const char *id = ObjectID;
@@ -1396,11 +1878,14 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->refid_sql)
 				refid_sql = magic->refid_sql;
 		}
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where OBJECT_ID = '%q';",
-				      objectid_sql, parentid_sql, refid_sql, id);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+		sql = sqlite3_mprintf("SELECT %s, %s, %s, %s"
+				      FROM_OBJECTS
+				      " where OBJECT_ID = ?",
+				      objectid_sql, parentid_sql, refid_sql, cols);
+		stmt = sql ? sql_prepare(args.db, sql) : NULL;
+		if (stmt)
+			sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+		ret = stmt ? sql_foreach(stmt, callback, (void *) &args) : SQLITE_ERROR;
 		totalMatches = args.returned;
 	}
 	else
@@ -1423,17 +1908,17 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->max_count > 0)
 			{
 				int limit = MAX(magic->max_count - StartingIndex, 0);
-				ret = get_child_count(ObjectID, magic);
+				ret = get_child_count(args.db, ObjectID, magic);
 				totalMatches = MIN(ret, limit);
 				if (RequestedCount > limit || RequestedCount < 0)
 					RequestedCount = limit;
 			}
 		}
 		if (!where[0])
-			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+			paged = (RequestedCount > 0);
 
 		if (!totalMatches)
-			totalMatches = get_child_count(ObjectID, magic);
+			totalMatches = get_child_count(args.db, ObjectID, magic);
 		ret = 0;
 		if (SortCriteria && !orderBy)
 		{
@@ -1445,7 +1930,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if( strncmp(ObjectID, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
 			{
 				if( strcmp(ObjectID, MUSIC_PLIST_ID) == 0 )
-					ret = xasprintf(&orderBy, "order by d.TITLE COLLATE naturalsort");
+					ret = xasprintf(&orderBy, "order by o.TITLE_KEY");
 				else
 					ret = xasprintf(&orderBy, "order by length(OBJECT_ID), OBJECT_ID");
 			}
@@ -1473,33 +1958,68 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where %s %s limit %d, %d;",
-				      objectid_sql, parentid_sql, refid_sql,
-				      where, THISORNUL(orderBy), StartingIndex, RequestedCount);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+		/* Make the order of unsorted children, which is that of
+		 * IDX_SCANNER_OPT, explicit so that pages can be resumed. */
+		if (paged && !orderBy)
+			orderBy = strdup("order by o.NAME, o.OBJECT_ID");
+		if (paged && orderBy)
+			nterms = parse_order_terms(orderBy, terms);
+		if (nterms > 0)
+		{
+			order_terms_sql(terms, nterms, &order, &keys);
+			cursor_sql = find_cursor(h->clientaddr, h->req_update_id, ObjectID,
+			                         order, StartingIndex, terms, nterms, &resume);
+			memset(&cursor, 0, sizeof(cursor));
+			args.cursor = &cursor;
+		}
+
+		/* Plain children are looked up by parameter, so that one
+		 * statement serves every container. */
+		if (where[0])
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, %s%s"
+					      FROM_OBJECTS
+					      " where %s%s%s %s limit ?1, ?2",
+					      objectid_sql, parentid_sql, refid_sql, cols, THISORNUL(keys),
+					      where, cursor_sql ? " and " : "", THISORNUL(cursor_sql),
+					      order ? order : THISORNUL(orderBy));
+		else
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, %s%s"
+					      FROM_OBJECTS
+					      " where PARENT_ID = ?3%s%s %s limit ?1, ?2",
+					      objectid_sql, parentid_sql, refid_sql, cols, THISORNUL(keys),
+					      cursor_sql ? " and " : "", THISORNUL(cursor_sql),
+					      order ? order : THISORNUL(orderBy));
+		stmt = sql ? sql_prepare(args.db, sql) : NULL;
+		if (stmt)
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
+			sqlite3_bind_int(stmt, 1, cursor_sql ? 0 : StartingIndex);
+			sqlite3_bind_int(stmt, 2, RequestedCount);
+			if (!where[0])
+				sqlite3_bind_text(stmt, 3, ObjectID, -1, SQLITE_STATIC);
+			if (cursor_sql)
+				bind_cursor(stmt, &resume);
+		}
+		ret = stmt ? sql_foreach(stmt, callback, (void *) &args) : SQLITE_ERROR;
+		if( ret == SQLITE_OK && args.cursor && args.returned == RequestedCount &&
+		    cursor.nkeys == nterms )
+			save_cursor(&cursor, h->clientaddr, h->req_update_id,
+			            ObjectID, order, StartingIndex + args.returned);
 	}
-	if( ret != SQLITE_OK )
+	if( ret != SQLITE_OK && !(args.flags & RESPONSE_TRUNCATED) )
 	{
-		if( args.flags & RESPONSE_TRUNCATED )
-		{
-			sqlite3_free(zErrMsg);
-		}
-		else
-		{
-			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-			sqlite3_free(zErrMsg);
-			SoapError(h, 709, "Unsupported or invalid sort criteria");
-			goto browse_error;
-		}
+		if (stmt)
+			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n",
+				sqlite3_errmsg(args.db), sqlite3_sql(stmt));
+		sql_finish(stmt);
+		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		goto browse_error;
 	}
-	sqlite3_free(sql);
+	sql_finish(stmt);
 	/* Does the object even exist? */
 	if( !totalMatches )
 	{
-		if( !object_exists(ObjectID) )
+		if( !object_exists(args.db, ObjectID) )
 		{
 			SoapError(h, 701, "No such object error");
 			goto browse_error;
@@ -1510,11 +2030,18 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
-	                    args.returned, totalMatches, updateID);
+	                    args.returned, totalMatches, h->req_update_id);
+	if (key && !(h->respflags & FLAG_CHUNKED) && !(args.flags & RESPONSE_TRUNCATED))
+		respcache_put(key, str.data, str.off, gen);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 browse_error:
 	ClearNameValueList(&data);
+	free(key);
 	free(orderBy);
+	sqlite3_free(order);
+	sqlite3_free(keys);
+	sqlite3_free(cursor_sql);
+	sqlite3_free(sql);
 	free(str.data);
 }
 
@@ -1535,13 +2062,16 @@ parse_search_criteria(const char *str, char *sep)
 {
 	struct string_s criteria;
 	int len;
-	int literal = 0, like = 0, class = 0;
+	int literal = 0, like = 0, class = 0, fts_close = 0;
+	int prop = 0, prop_end = 0;
+	const char *fts = NULL;
 	const char *s;
 
 	if (!str)
 		return strdup("1 = 1");
 
-	len = strlen(str) + 32;
+	/* Room for every "contains" to become an index lookup */
+	len = strlen(str) * 4 + 32;
 	criteria.data = malloc(len);
 	criteria.size = len;
 	criteria.off = 0;
@@ -1575,6 +2105,11 @@ parse_search_criteria(const char *str, char *sep)
 					like--;
 				}
 				charcat(&criteria, '"');
+				if (fts_close)
+				{
+					charcat(&criteria, ')');
+					fts_close = 0;
+				}
 				break;
 			case '\\':
 				if (strncmp(s, "\\&quot;", 7) == 0)
@@ -1680,7 +2215,23 @@ parse_search_criteria(const char *str, char *sep)
 			case 'c':
 				if (strncmp(s, "contains", 8) == 0)
 				{
-					strcatf(&criteria, "like");
+					/* Text properties are matched through the
+					 * trigram index when the property is right
+					 * before the operator. */
+					while (fts && prop_end < criteria.off &&
+					       isspace(criteria.data[prop_end]))
+						prop_end++;
+					if (fts && prop_end == criteria.off &&
+					    GETFLAG(FTS_SEARCH_MASK))
+					{
+						criteria.off = prop;
+						strcatf(&criteria, "o.DETAIL_ID in (select rowid from DETAILS_FTS"
+						                   " where %s like", fts);
+						fts_close = 1;
+					}
+					else
+						strcatf(&criteria, "like");
+					fts = NULL;
 					s += 8;
 					like = 2;
 					continue;
@@ -1704,13 +2255,19 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "dc:title", 8) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.TITLE");
+					prop_end = criteria.off;
+					fts = "TITLE";
 					s += 8;
 					continue;
 				}
 				else if (strncmp(s, "dc:creator", 10) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.CREATOR");
+					prop_end = criteria.off;
+					fts = "CREATOR";
 					s += 10;
 					continue;
 				}
@@ -1764,25 +2321,37 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "upnp:actor", 10) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
+					prop_end = criteria.off;
+					fts = "ARTIST";
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:artist", 11) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
+					prop_end = criteria.off;
+					fts = "ARTIST";
 					s += 11;
 					continue;
 				}
 				else if (strncmp(s, "upnp:album", 10) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.ALBUM");
+					prop_end = criteria.off;
+					fts = "ALBUM";
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:genre", 10) == 0)
 				{
+					prop = criteria.off;
 					strcatf(&criteria, "d.GENRE");
+					prop_end = criteria.off;
+					fts = "GENRE";
 					s += 10;
 					continue;
 				}
@@ -1811,6 +2380,73 @@ parse_search_criteria(const char *str, char *sep)
 	return criteria.data;
 }
 
+/* Object IDs are paths, so everything below a container shares the
+ * prefix "<id>$" and is one contiguous range of the OBJECT_ID index.
+ * Unlike glob, the range drives the index even with the bounds bound
+ * to a cached statement, and the ID is taken literally. */
+static void
+subtree_range(const char *id, const char *sep, char **lo, char **hi)
+{
+	size_t len;
+
+	xasprintf(lo, "%s%.*s", id, (int)strcspn(sep, "*"), sep);
+	*hi = strdup(*lo);
+	len = strlen(*hi);
+	if (len)
+		(*hi)[len-1]++;
+}
+
+/* Exact TotalMatches of a search, which a page of results may not show */
+static int
+count_matches(sqlite3 *db, const char *id, const char *sep,
+              const char *lo, const char *hi, const char *where)
+{
+	sqlite3_stmt *stmt;
+	char *sql, glob[8];
+	int ret = -1;
+
+	if (*id == '*')
+		sql = sqlite3_mprintf("SELECT count(distinct DETAIL_ID)"
+		                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                      " where (OBJECT_ID glob ?1) and (%s)",
+		                      where);
+	else
+		sql = sqlite3_mprintf("SELECT (select count(distinct DETAIL_ID)"
+		                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                      " where (OBJECT_ID >= ?2 and OBJECT_ID < ?3) and (%s))"
+		                      " + "
+		                      "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                      " where (OBJECT_ID = ?1) and (%s))",
+		                      where, where);
+	stmt = sql ? sql_prepare(db, sql) : NULL;
+	sqlite3_free(sql);
+	if (!stmt)
+		return -1;
+	if (*id == '*')
+	{
+		snprintf(glob, sizeof(glob), "*%s", sep);
+		sqlite3_bind_text(stmt, 1, glob, -1, SQLITE_STATIC);
+	}
+	else
+	{
+		sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, lo, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, hi, -1, SQLITE_STATIC);
+	}
+	switch (sql_step(stmt))
+	{
+	case SQLITE_ROW:
+		ret = sqlite3_column_int(stmt, 0);
+		break;
+	case SQLITE_DONE:
+		ret = 0;
+		break;
+	}
+	sql_finish(stmt);
+
+	return ret;
+}
+
 static void
 SearchContentDirectory(struct upnphttp * h, const char * action)
 {
@@ -1821,16 +2457,20 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	sqlite3_stmt *stmt;
+	char *ptr, *key = NULL, *ckey = NULL, *cached;
+	size_t cachedlen;
+	unsigned int gen, cgen = 0;
 	struct Response args;
 	struct string_s str;
-	int totalMatches;
+	int totalMatches = -1, counted = 0, badsort;
 	int ret;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
 	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *lo = NULL, *hi = NULL, *sql = NULL, glob[8];
 	char groupBy[] = "group by DETAIL_ID";
+	char cols[COLUMNS_SIZE];
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
@@ -1865,6 +2505,8 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
 	args.iface = h->iface;
+	args.url_len = snprintf(args.url, sizeof(args.url), "http://%s:%d",
+	                        h->req_host, runtime_vars.port);
 	args.filter = set_filter_flags(Filter, h);
 	if( args.filter & FILTER_DLNA_NAMESPACE )
 	{
@@ -1874,9 +2516,11 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
-	args.flags = h->req_client ? h->req_client->type->flags : 0;
+	args.client = h->req_client_type;
+	args.flags = h->req_client_flags;
 	args.str = &str;
+	args.db = worker_db();
+	args.stream = CanStreamSoapResp(h) ? h : NULL;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1887,6 +2531,17 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 				ContainerID, RequestedCount, StartingIndex,
 	                        SearchCriteria, Filter, SortCriteria);
 
+	key = soap_cache_key('S', ContainerID, SearchCriteria, SortCriteria,
+	                     StartingIndex, RequestedCount, h->req_update_id, &args);
+	respcache_sync(db_changes(args.db));
+	if (key && (cached = respcache_get(key, &cachedlen, &gen)))
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Search response from cache\n");
+		BuildSendAndCloseSoapResp(h, cached, cachedlen);
+		free(cached);
+		goto search_error;
+	}
+
 	magic = check_magic_container(ContainerID, args.flags);
 	if (magic && magic->objectid && *(magic->objectid))
 		ContainerID = *(magic->objectid);
@@ -1901,28 +2556,24 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	where = parse_search_criteria(SearchCriteria, sep);
 	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
 
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
-	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s))"
-	                                     " + "
-	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID = '%q') and (%s))",
-	                                     ContainerID, sep, where, ContainerID, where);
-	if( totalMatches < 0 )
+	if (*ContainerID != '*')
+		subtree_range(ContainerID, sep, &lo, &hi);
+
+	/* Later pages of the same search reuse the count of the first */
+	if (xasprintf(&ckey, "C %s%s\n%s", ContainerID, sep, where) > 0 &&
+	    (cached = respcache_peek(ckey, &cachedlen, &cgen)))
 	{
-		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
-		SoapError(h, 708, "Unsupported or invalid search criteria");
-		goto search_error;
+		totalMatches = atoi(cached);
+		free(cached);
 	}
-	/* Does the object even exist? */
-	if( !totalMatches )
+#ifdef __sparc__
+	/* The sort limit needs the count up front */
+	if( totalMatches < 0 )
 	{
-		if( !object_exists(ContainerID) )
-		{
-			SoapError(h, 710, "No such container");
-			goto search_error;
-		}
+		totalMatches = count_matches(args.db, ContainerID, sep, lo, hi, where);
+		counted = 1;
 	}
+#endif
 	ret = 0;
 	__SORT_LIMIT
     if ( SortCriteria )
@@ -1931,47 +2582,120 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
     }
     else
     {
-       asprintf(&orderBy, "order by d.TITLE COLLATE naturalsort");
+       asprintf(&orderBy, "order by o.TITLE_KEY");
     }
-
 	/* If it's a DLNA client, return an error for bad sort criteria */
-	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
+	badsort = ( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) );
+
+	/* Both halves of the compound below sort by what they select */
+	filter_columns(cols, args.filter, args.flags, orderBy);
+	/* The container itself is looked up by rowid, or the planner may
+	 * walk a whole title index just to skip sorting that one row. */
+	if (*ContainerID == '*')
+		sql = sqlite3_mprintf(SELECT_COLUMNS
+		                      FROM_OBJECTS
+		                      " where OBJECT_ID glob ?3 and (%s) %s %s"
+		                      " limit ?1, ?2",
+		                      cols, where, groupBy, orderBy);
+	else
+		sql = sqlite3_mprintf(SEARCH_COLUMNS
+		                      FROM_OBJECTS
+		                      " where OBJECT_ID >= ?3 and OBJECT_ID < ?4 and (%s) %s "
+		                      "UNION ALL " SEARCH_COLUMNS
+		                      FROM_OBJECTS
+		                      " where o.ID = (SELECT ID from OBJECTS where OBJECT_ID = ?5) and (%s) %s"
+		                      " limit ?1, ?2",
+		                      cols, where, groupBy,
+		                      cols, where, orderBy);
+	stmt = sql ? sql_prepare(args.db, sql) : NULL;
+	if (stmt)
 	{
-		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		sqlite3_bind_int(stmt, 1, StartingIndex);
+		sqlite3_bind_int(stmt, 2, RequestedCount);
+		if (*ContainerID == '*')
+		{
+			snprintf(glob, sizeof(glob), "*%s", sep);
+			sqlite3_bind_text(stmt, 3, glob, -1, SQLITE_STATIC);
+		}
+		else
+		{
+			sqlite3_bind_text(stmt, 3, lo, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 4, hi, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 5, ContainerID, -1, SQLITE_STATIC);
+		}
+	}
+	if( !stmt )
+	{
+		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
+		SoapError(h, 708, "Unsupported or invalid search criteria");
 		goto search_error;
 	}
-
-	sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) %s "
-	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, groupBy,
-	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
-	                      orderBy, StartingIndex, RequestedCount);
 	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	if( ret != SQLITE_OK )
+	ret = badsort ? SQLITE_OK : sql_foreach(stmt, callback, (void *) &args);
+	if( ret != SQLITE_OK && !(args.flags & RESPONSE_TRUNCATED) )
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n",
+			sqlite3_errmsg(args.db), sqlite3_sql(stmt));
+	sql_finish(stmt);
+
+	/* A page that ends before RequestedCount tells the total without
+	 * another pass, as long as each grouped row is one DETAIL_ID. */
+	if( totalMatches < 0 && !badsort && ret == SQLITE_OK && *groupBy &&
+	    !(args.flags & RESPONSE_TRUNCATED) &&
+	    (RequestedCount < 0 || args.returned < RequestedCount) &&
+	    (args.returned || !StartingIndex) )
 	{
-		if( !(args.flags & RESPONSE_TRUNCATED) )
-			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
+		totalMatches = StartingIndex + args.returned;
+		counted = 1;
+	}
+	else if( totalMatches < 0 )
+	{
+		totalMatches = count_matches(args.db, ContainerID, sep, lo, hi, where);
+		counted = 1;
+	}
+	if( totalMatches < 0 )
+	{
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
+	}
+	/* Does the object even exist? */
+	if( !totalMatches )
+	{
+		if( !object_exists(args.db, ContainerID) )
+		{
+			SoapError(h, 710, "No such container");
+			goto search_error;
+		}
+	}
+	if( badsort )
+	{
+		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		goto search_error;
+	}
+	if( ckey && counted )
+	{
+		char buf[16];
+
+		snprintf(buf, sizeof(buf), "%d", totalMatches);
+		respcache_put(ckey, buf, strlen(buf) + 1, cgen);
 	}
-	sqlite3_free(sql);
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:SearchResponse>",
-	                    args.returned, totalMatches, updateID);
+	                    args.returned, totalMatches, h->req_update_id);
+	if (key && !(h->respflags & FLAG_CHUNKED) && !(args.flags & RESPONSE_TRUNCATED))
+		respcache_put(key, str.data, str.off, gen);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 search_error:
 	ClearNameValueList(&data);
+	free(key);
+	free(ckey);
 	free(orderBy);
 	free(where);
+	free(lo);
+	free(hi);
+	sqlite3_free(sql);
 	free(str.data);
 }
 
@@ -2262,16 +2986,20 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 	ClearNameValueList(&data);
 }
 
+/* Actions that may run long queries are handed to a worker thread */
+#define SOAP_THREADED	0x01
+
 static const struct
 {
 	const char * methodName;
 	void (*methodImpl)(struct upnphttp *, const char *);
+	int flags;
 }
 soapMethods[] =
 {
 	{ "QueryStateVariable", QueryStateVariable},
-	{ "Browse", BrowseContentDirectory},
-	{ "Search", SearchContentDirectory},
+	{ "Browse", BrowseContentDirectory, SOAP_THREADED},
+	{ "Search", SearchContentDirectory, SOAP_THREADED},
 	{ "GetSearchCapabilities", GetSearchCapabilities},
 	{ "GetSortCapabilities", GetSortCapabilities},
 	{ "GetSystemUpdateID", GetSystemUpdateID},
@@ -2311,6 +3039,22 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 			len = strlen(soapMethods[i].methodName);
 			if(strncmp(p, soapMethods[i].methodName, len) == 0)
 			{
+				if(h->req_client)
+				{
+					h->req_client_type = h->req_client->type->type;
+					h->req_client_flags = h->req_client->type->flags;
+				}
+				else
+				{
+					h->req_client_type = 0;
+					h->req_client_flags = 0;
+				}
+				strncpyt(h->req_host, lan_addr[h->iface].str, sizeof(h->req_host));
+				h->req_update_id = updateID;
+				if((soapMethods[i].flags & SOAP_THREADED) &&
+				   workers_submit(h, soapMethods[i].methodImpl,
+				                  soapMethods[i].methodName) == 0)
+					return;
 				soapMethods[i].methodImpl(h, soapMethods[i].methodName);
 				return;
 			}
@@ -45,6 +45,11 @@ struct Response
 	uint32_t filter;
 	uint32_t flags;
 	enum client_types client;
+	sqlite3 *db;
+	struct upnphttp *stream;	/* send full buffers as chunks, if set */
+	struct sort_cursor *cursor;	/* sort keys of the last row, if set */
+	char url[32];	/* "http://<iface addr>:<port>", shared by every URL */
+	int url_len;
 };
 
 /* ExecuteSoapAction():
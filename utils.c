@@ -214,18 +214,52 @@ unescape_tag(const char *tag, int force_alloc)
 char *
 escape_tag(const char *tag, int force_alloc)
 {
-	char *esc_tag = NULL;
+	static const char special[] = "&<>\"";
+	const char *p, *rep;
+	char *esc_tag, *q;
+	size_t len, extra = 0;
+
+	/* strcspn() is vectorized by the C library, so the common case of
+	 * nothing to escape costs a single fast scan. */
+	len = strcspn(tag, special);
+	if( !tag[len] )
+		return force_alloc ? strdup(tag) : NULL;
+
+	for( p = tag + len; *p; p += strcspn(p, special) )
+	{
+		switch( *p++ )
+		{
+			case '&': extra += sizeof("&amp;amp;") - 2; break;
+			case '"': extra += sizeof("&amp;quot;") - 2; break;
+			default:  extra += sizeof("&amp;lt;") - 2; break;
+		}
+	}
+	len = p - tag;
+	esc_tag = malloc(len + extra + 1);
+	if( !esc_tag )
+		return NULL;
 
-	if( strchr(tag, '&') || strchr(tag, '<') || strchr(tag, '>') || strchr(tag, '"') )
+	/* Escape on copy, one run of plain text at a time */
+	for( p = tag, q = esc_tag; *p; )
 	{
-		esc_tag = strdup(tag);
-		esc_tag = modifyString(esc_tag, "&", "&amp;amp;", 0);
-		esc_tag = modifyString(esc_tag, "<", "&amp;lt;", 0);
-		esc_tag = modifyString(esc_tag, ">", "&amp;gt;", 0);
-		esc_tag = modifyString(esc_tag, "\"", "&amp;quot;", 0);
+		len = strcspn(p, special);
+		memcpy(q, p, len);
+		q += len;
+		p += len;
+		switch( *p )
+		{
+			case '&': rep = "&amp;amp;"; break;
+			case '<': rep = "&amp;lt;"; break;
+			case '>': rep = "&amp;gt;"; break;
+			case '"': rep = "&amp;quot;"; break;
+			default: continue;
+		}
+		len = strlen(rep);
+		memcpy(q, rep, len);
+		q += len;
+		p++;
 	}
-	else if( force_alloc )
-		esc_tag = strdup(tag);
+	*q = '\0';
 
 	return esc_tag;
 }
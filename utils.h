@@ -25,6 +25,7 @@
 #define __UTILS_H__
 
 #include <stdarg.h>
+#include <string.h>
 #include <dirent.h>
 #include <sys/param.h>
 
@@ -51,6 +52,38 @@ strcatf(struct string_s *str, const char *fmt, ...)
 
 	return ret;
 }
+/* Plain appends for the hot paths, without the format string parsing;
+ * truncation behaves exactly like strcatf */
+static inline void
+strcatn(struct string_s *str, const char *s, size_t len)
+{
+	size_t size;
+
+	if (str->off >= str->size)
+		return;
+
+	size = str->size - str->off;
+	if (len < size)
+	{
+		memcpy(str->data + str->off, s, len);
+		str->off += len;
+		str->data[str->off] = '\0';
+	}
+	else
+	{
+		memcpy(str->data + str->off, s, size - 1);
+		str->data[str->size - 1] = '\0';
+		str->off = str->size;
+	}
+}
+/* A NULL string (a missing column) appends nothing */
+static inline void
+strcats(struct string_s *str, const char *s)
+{
+	if (s)
+		strcatn(str, s, strlen(s));
+}
+#define strcatl(str, lit) strcatn(str, lit, sizeof(lit) - 1)
 static inline void strncpyt(char *dst, const char *src, size_t len)
 {
 	strncpy(dst, src, len);
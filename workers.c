@@ -0,0 +1,272 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * Thread pool for SOAP actions that can spend a long time in SQLite
+ * (Browse and Search).  Each worker has a private read-only connection,
+ * so a slow query only ties up its own thread.  The main loop suspends
+ * the connection while the action runs, and a pipe wakes it up to send
+ * the finished response.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "naturalsort.h"
+#include "sql.h"
+#include "workers.h"
+#include "log.h"
+
+struct job {
+	struct upnphttp *h;
+	worker_func_t func;
+	const char *action;
+	TAILQ_ENTRY(job) entries;
+};
+
+static TAILQ_HEAD(, job) pending = TAILQ_HEAD_INITIALIZER(pending);
+static TAILQ_HEAD(, job) done = TAILQ_HEAD_INITIALIZER(done);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads;
+static int nthreads;
+static int stopping;
+static int wakeup[2] = { -1, -1 };
+static struct event wakeupev;
+
+static __thread sqlite3 *thread_db;
+
+sqlite3 *
+worker_db(void)
+{
+	return thread_db ? thread_db : db;
+}
+
+static sqlite3 *
+open_worker_db(void)
+{
+	char path[PATH_MAX];
+	sqlite3 *wdb;
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	if (sqlite3_open_v2(path, &wdb, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Failed to open %s for worker: %s\n",
+			path, sqlite3_errmsg(wdb));
+		sqlite3_close(wdb);
+		return NULL;
+	}
+	sqlite3_busy_timeout(wdb, 5000);
+	db_configure(wdb, 1);
+	sqlite3_create_collation(wdb, "naturalsort", SQLITE_UTF8, NULL, naturalsort);
+
+	return wdb;
+}
+
+static void *
+worker(void *arg)
+{
+	struct job *job;
+
+	thread_db = arg;
+	db = thread_db;
+
+	pthread_mutex_lock(&lock);
+	for (;;)
+	{
+		while (!stopping && TAILQ_EMPTY(&pending))
+			pthread_cond_wait(&cond, &lock);
+		if (stopping)
+			break;
+		job = TAILQ_FIRST(&pending);
+		TAILQ_REMOVE(&pending, job, entries);
+		pthread_mutex_unlock(&lock);
+
+		job->func(job->h, job->action);
+
+		pthread_mutex_lock(&lock);
+		/* The main loop drains the whole list, so only wake it
+		 * up when the list goes from empty to non-empty. */
+		if (TAILQ_EMPTY(&done) && write(wakeup[1], "", 1) < 0 && errno != EAGAIN)
+			DPRINTF(E_ERROR, L_HTTP, "write(wakeup): %s\n", strerror(errno));
+		TAILQ_INSERT_TAIL(&done, job, entries);
+	}
+	pthread_mutex_unlock(&lock);
+
+	sql_close(thread_db);
+	thread_db = db = NULL;
+
+	return NULL;
+}
+
+static void
+workers_process(struct event *ev)
+{
+	char buf[64];
+	struct job *job;
+
+	while (read(ev->fd, buf, sizeof(buf)) > 0)
+		continue;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&lock);
+		job = TAILQ_FIRST(&done);
+		if (job)
+			TAILQ_REMOVE(&done, job, entries);
+		pthread_mutex_unlock(&lock);
+		if (!job)
+			break;
+		Resume_upnphttp(job->h);
+		free(job);
+	}
+}
+
+int
+workers_init(int count)
+{
+	sigset_t set, oset;
+	sqlite3 *wdb;
+	int i;
+
+	if (count <= 0)
+		return 0;
+	if (!sqlite3_threadsafe())
+	{
+		DPRINTF(E_WARN, L_GENERAL, "SQLite library is not threadsafe!  "
+		                           "SOAP worker threads will be disabled.\n");
+		return 0;
+	}
+
+	if (pipe(wakeup) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "pipe(): %s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		fcntl(wakeup[i], F_SETFL, fcntl(wakeup[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+	threads = calloc(count, sizeof(pthread_t));
+	if (!threads)
+		goto error;
+
+	/* Leave signal handling to the main thread. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (i = 0; i < count; i++)
+	{
+		wdb = open_worker_db();
+		if (!wdb)
+			break;
+		if (pthread_create(&threads[i], NULL, worker, wdb) != 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "pthread_create() failed for worker: %s\n", strerror(errno));
+			sqlite3_close(wdb);
+			break;
+		}
+		nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (!nthreads)
+		goto error;
+
+	wakeupev = (struct event ){ .fd = wakeup[0], .rdwr = EVENT_READ, .process = workers_process };
+	event_module.add(&wakeupev);
+	DPRINTF(E_INFO, L_GENERAL, "Started %d SOAP worker threads\n", nthreads);
+
+	return 0;
+error:
+	free(threads);
+	threads = NULL;
+	close(wakeup[0]);
+	close(wakeup[1]);
+	wakeup[0] = wakeup[1] = -1;
+	return -1;
+}
+
+void
+workers_fini(void)
+{
+	struct job *job;
+	int i;
+
+	if (!nthreads)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	nthreads = 0;
+
+	/* Suspended connections are closed along with the others. */
+	while ((job = TAILQ_FIRST(&pending)))
+	{
+		TAILQ_REMOVE(&pending, job, entries);
+		free(job);
+	}
+	while ((job = TAILQ_FIRST(&done)))
+	{
+		TAILQ_REMOVE(&done, job, entries);
+		free(job);
+	}
+
+	event_module.del(&wakeupev, EV_FLAG_CLOSING);
+	close(wakeup[0]);
+	close(wakeup[1]);
+	wakeup[0] = wakeup[1] = -1;
+}
+
+int
+workers_submit(struct upnphttp *h, worker_func_t func, const char *action)
+{
+	struct job *job;
+
+	if (!nthreads)
+		return -1;
+	job = malloc(sizeof(struct job));
+	if (!job)
+		return -1;
+	job->h = h;
+	job->func = func;
+	job->action = action;
+
+	Suspend_upnphttp(h);
+	pthread_mutex_lock(&lock);
+	TAILQ_INSERT_TAIL(&pending, job, entries);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <sqlite3.h>
+
+struct upnphttp;
+
+typedef void (*worker_func_t)(struct upnphttp *, const char *);
+
+/* workers_init()
+ * start the pool of threads that run slow SOAP actions, each with its
+ * own read-only database connection.  With 0 threads, or if SQLite is
+ * not threadsafe, actions keep running on the main loop.
+ * returns: 0 success, -1 failure */
+int workers_init(int threads);
+
+/* workers_fini()
+ * stop and join the worker threads */
+void workers_fini(void);
+
+/* workers_submit()
+ * queue func(h, action) on the pool.  The connection is suspended
+ * until the worker is done, then its response is sent from the main loop.
+ * returns: 0 if queued, -1 if the caller should run func itself */
+int workers_submit(struct upnphttp *h, worker_func_t func, const char *action);
+
+/* worker_db()
+ * database connection to use from the calling thread */
+sqlite3 *worker_db(void);
+
+#endif